@@ -0,0 +1,479 @@
+/*	batch.c
+	Copyright (C) 2026 Dmitry Groshev
+
+	This file is part of mtPaint.
+
+	mtPaint is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	mtPaint is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with mtPaint in the file COPYING.
+*/
+
+#include "global.h"
+
+#include "mygtk.h"
+#include "memory.h"
+#include "png.h"
+#include "canvas.h"
+#include "wu.h"
+#include "thread.h"
+#include "batch.h"
+
+#ifndef WIN32
+#include <sys/wait.h>
+#endif
+
+/* Script is a text file with one command per line; empty lines and anything
+ * after '#' are ignored. Commands are applied in order to every input file:
+ *
+ *	scale W H [TYPE [GAMMA [SHARP]]]
+ *		Scale to W x H pixels, or to percentage of current size if
+ *		number is followed by '%'. TYPE is the method as listed in
+ *		Scale Canvas dialog (0 = nearest neighbour, the default is 1),
+ *		GAMMA and SHARP are 0 or 1; all are ignored for indexed images
+ *	rotate ANGLE [SMOOTH [GAMMA]]
+ *		Free rotation by ANGLE degrees
+ *	gauss RX [RY [GAMMA]]
+ *		Gaussian blur (RGB only)
+ *	unsharp RADIUS AMOUNT [THRESHOLD [GAMMA]]
+ *		Unsharp mask (RGB only)
+ *	quantize COLOURS [wu|pnn|maxmin [none|fs|stucki|dumb|old|scatter]]
+ *		Convert RGB image to indexed; default is Wu quantizer and
+ *		Floyd-Steinberg dithering
+ *	rgb
+ *		Convert indexed image to RGB
+ *	save PATTERN
+ *		Save to file, in format given by extension; in PATTERN, "%n"
+ *		is input filename without extension, "%d" its directory, and
+ *		"%%" is a single '%' */
+
+enum {
+	BC_SCALE = 0,
+	BC_ROTATE,
+	BC_GAUSS,
+	BC_UNSHARP,
+	BC_QUANTIZE,
+	BC_RGB,
+	BC_SAVE,
+
+	BC_MAX
+};
+
+static char *bc_names[BC_MAX + 1] = { "scale", "rotate", "gauss", "unsharp",
+	"quantize", "rgb", "save", NULL };
+static const char bc_min[BC_MAX] = { 2, 1, 1, 2, 1, 0, 1 };
+static const char bc_max[BC_MAX] = { 5, 3, 3, 4, 3, 0, 1 };
+
+static char *quan_names[] = { "wu", "pnn", "maxmin", NULL };
+static char *dith_names[] = { "none", "fs", "stucki", "dumb", "old", "scatter",
+	NULL };
+
+#define BATCH_ARGS 5
+
+typedef struct {
+	int op, line;
+	int pct;		// Bitmask of percentage args
+	double v[BATCH_ARGS];
+	char *str;		// Filename pattern
+} batch_cmd;
+
+typedef struct {
+	batch_cmd *cmds;
+	int ncmds;
+	char *script;
+} batch_script;
+
+static int find_word(char *s, char **list)
+{
+	int i;
+
+	for (i = 0; list[i]; i++) if (!strcasecmp(s, list[i])) return (i);
+	return (-1);
+}
+
+static int parse_script(batch_script *bs, char *fname)
+{
+	char buf[PATHBUF + 256], *s, *tail, *bad;
+	batch_cmd *cmd, *tmp;
+	FILE *fp;
+	int i, j, line = 0, nsave = 0, err = 0;
+
+
+	memset(bs, 0, sizeof(batch_script));
+	bs->script = fname;
+	if (!(fp = fopen(fname, "r")))
+	{
+		fprintf(stderr, "%s: %s\n", fname, _("cannot open script"));
+		return (FALSE);
+	}
+	while (!err && fgets(buf, sizeof(buf), fp))
+	{
+		line++;
+		if ((s = strchr(buf, '#'))) *s = '\0';
+		s = buf + strspn(buf, " \t\r\n");
+		if (!*s) continue;
+		tail = s + strcspn(s, " \t\r\n");
+		if (*tail) *tail++ = '\0';
+
+		tmp = realloc(bs->cmds, (bs->ncmds + 1) * sizeof(batch_cmd));
+		if (!tmp)
+		{
+			fprintf(stderr, "%s: %s\n", fname,
+				_("not enough memory"));
+			err = TRUE;
+			break;
+		}
+		bs->cmds = tmp;
+		cmd = bs->cmds + bs->ncmds++;
+		memset(cmd, 0, sizeof(batch_cmd));
+		cmd->line = line;
+		cmd->op = find_word(s, bc_names);
+
+		switch (cmd->op)
+		{
+		case -1:
+			fprintf(stderr, "%s:%d: %s \"%s\"\n", fname, line,
+				_("unknown command"), s);
+			err = TRUE;
+			continue;
+		case BC_SAVE: /* Rest of line is the pattern */
+			tail += strspn(tail, " \t");
+			for (i = strlen(tail); i && strchr(" \t\r\n", tail[i - 1]); i--);
+			tail[i] = '\0';
+			if (!i) break;
+			cmd->str = strdup(tail);
+			nsave++;
+			continue;
+		case BC_QUANTIZE: /* Defaults */
+			cmd->v[2] = 1; // Floyd-Steinberg
+			break;
+		case BC_SCALE:
+			cmd->v[2] = 1; // Bilinear
+			break;
+		}
+
+		/* Numeric & keyword args */
+		for (bad = NULL , i = 0; !bad; i++)
+		{
+			char *ep;
+
+			s = tail + strspn(tail, " \t\r\n");
+			if (!*s) break;
+			tail = s + strcspn(s, " \t\r\n");
+			if (*tail) *tail++ = '\0';
+			bad = s;
+			if (i >= bc_max[cmd->op]) break;
+			j = cmd->op != BC_QUANTIZE ? -1 : i == 1 ?
+				find_word(s, quan_names) : i == 2 ?
+				find_word(s, dith_names) : -1;
+			if (j >= 0)
+			{
+				cmd->v[i] = j;
+				bad = NULL;
+				continue;
+			}
+			cmd->v[i] = strtod(s, &ep);
+			if ((*ep == '%') && (cmd->op == BC_SCALE) && (i < 2))
+				cmd->pct |= 1 << i , ep++;
+			if ((ep != s) && !*ep) bad = NULL;
+		}
+		if (bad) fprintf(stderr, "%s:%d: %s \"%s\"\n", fname, line,
+			_("bad argument"), bad);
+		else if (i < bc_min[cmd->op]) fprintf(stderr,
+			"%s:%d: %s \"%s\"\n", fname, line,
+			_("too few arguments for"), bc_names[cmd->op]);
+		else continue;
+		err = TRUE;
+	}
+	fclose(fp);
+
+	if (!err && !nsave)
+	{
+		fprintf(stderr, "%s: %s\n", fname,
+			_("script never saves anything"));
+		err = TRUE;
+	}
+	if (err)
+	{
+		for (i = 0; i < bs->ncmds; i++) free(bs->cmds[i].str);
+		free(bs->cmds);
+		bs->cmds = NULL;
+		bs->ncmds = 0;
+	}
+	return (!err);
+}
+
+/* Expand %n, %d & %% in filename pattern */
+static int expand_name(char *buf, char *pat, char *fname)
+{
+	char *nm, *ext, *s;
+	int l, dl, nl, w = 0;
+
+
+	nm = strrchr(fname, DIR_SEP);
+	nm = nm ? nm + 1 : fname;
+	dl = nm - fname - 1;
+	ext = strrchr(nm, '.');
+	nl = ext && (ext != nm) ? ext - nm : (int)strlen(nm);
+
+	for (; *pat; pat++)
+	{
+		s = pat , l = 1;
+		if (*pat == '%')
+		{
+			if (*++pat == 'n') s = nm , l = nl;
+			else if (*pat == 'd')
+			{
+				s = fname , l = dl;
+				if (dl < 0) s = "." , l = 1; // Current dir
+				else if (!dl) l = 1; // Root dir
+			}
+			else if (*pat != '%') return (FALSE);
+		}
+		if (w + l >= PATHBUF) return (FALSE);
+		memcpy(buf + w, s, l);
+		w += l;
+	}
+	buf[w] = '\0';
+	return (TRUE);
+}
+
+static char *run_command(batch_cmd *cmd, char *fname)
+{
+	static short *dithers[3] = { NULL, dither_fs, dither_stucki };
+	static char ebuf[PATHBUF + 64];
+	char buf[PATHBUF];
+	png_color newpal[256];
+	ls_settings settings;
+	unsigned char *old;
+	double v;
+	int i, fflags, res = 0, rgb = mem_img_bpp == 3;
+
+	switch (cmd->op)
+	{
+	case BC_SCALE:
+	{
+		int sz[2] = { mem_width, mem_height },
+			lim[2] = { MAX_WIDTH, MAX_HEIGHT };
+
+		for (i = 0; i < 2; i++)
+		{
+			v = cmd->v[i];
+			if (cmd->pct & (1 << i)) v *= sz[i] * 0.01;
+			sz[i] = v < 1 ? 1 : v > lim[i] ? lim[i] : (int)(v + 0.5);
+		}
+		if ((sz[0] == mem_width) && (sz[1] == mem_height)) break;
+		res = mem_image_scale(sz[0], sz[1], rgb ? (int)cmd->v[2] : 0,
+			rgb && cmd->v[3], cmd->v[4], BOUND_MIRROR);
+		break;
+	}
+	case BC_ROTATE:
+		res = mem_rotate_free(cmd->v[0], rgb && cmd->v[1],
+			rgb && cmd->v[2], 0);
+		if (res == -5) return (_("image is too large for this rotation"));
+		break;
+	case BC_GAUSS:
+	case BC_UNSHARP:
+		if (!rgb) return (_("filter needs an RGB image"));
+		mem_undo_next(cmd->op == BC_GAUSS ? UNDO_DRAW : UNDO_FILT);
+		if (cmd->op == BC_GAUSS) mem_gauss(cmd->v[0],
+			cmd->v[1] > 0 ? cmd->v[1] : cmd->v[0], cmd->v[2],
+			GAUSS_AUTO);
+		else mem_unsharp(cmd->v[0], cmd->v[1], cmd->v[2], cmd->v[3],
+			GAUSS_AUTO);
+		mem_undo_prepare();
+		break;
+	case BC_QUANTIZE:
+	{
+		int n = cmd->v[0], dither = cmd->v[2];
+
+		if (!rgb) return (_("image is indexed already"));
+		n = n < 2 ? 2 : n > 256 ? 256 : n;
+		old = mem_img[CHN_IMAGE];
+		if ((res = undo_next_core(UC_NOCOPY, mem_width, mem_height, 1,
+			CMASK_IMAGE))) break;
+		switch ((int)cmd->v[1])
+		{
+		default:
+		case 0: res = wu_quant(old, mem_width, mem_height, n, newpal);
+			break;
+		case 1: res = pnnquan(old, mem_width, mem_height, n, newpal);
+			break;
+		case 2: res = maxminquan(old, mem_width, mem_height, n, newpal);
+			break;
+		}
+		if (res) break;
+		memcpy(mem_pal, newpal, n * sizeof(*mem_pal));
+		mem_cols = n;
+		if (dither < 3) res = mem_dither(old, n, dithers[dither],
+			CSPACE_SRGB, DIST_L2, 0, FALSE, TRUE, FALSE, 1.0);
+		else if (dither == 3) res = mem_dumb_dither(old,
+			mem_img[CHN_IMAGE], mem_pal, mem_width, mem_height,
+			n, TRUE);
+		else res = mem_quantize(old, n, dither - 2);
+		break;
+	}
+	case BC_RGB:
+		if (rgb) break;
+		old = mem_img[CHN_IMAGE];
+		if ((res = undo_next_core(UC_NOCOPY, mem_width, mem_height, 3,
+			CMASK_IMAGE))) break;
+		do_convert_rgb(0, 1, mem_width * mem_height,
+			mem_img[CHN_IMAGE], old, mem_pal);
+		break;
+	case BC_SAVE:
+		if (!expand_name(buf, cmd->str, fname))
+			return (_("bad or too long output filename"));
+		i = file_type_by_ext(buf, FF_IMAGE);
+		if (i == FT_NONE) return (_("unknown output file format"));
+		fflags = file_formats[i].flags;
+		if ((fflags & FF_NOSAVE) || !(fflags & FF_SAVE_MASK))
+			return (rgb ? _("format cannot hold an RGB image") :
+				_("format cannot hold an image with this many colours"));
+
+		init_ls_settings(&settings, NULL);
+		memcpy(settings.img, mem_img, sizeof(chanlist));
+		settings.mode = FS_PNG_SAVE;
+		settings.ftype = i;
+		settings.pal = mem_pal;
+		settings.width = mem_width;
+		settings.height = mem_height;
+		settings.bpp = mem_img_bpp;
+		settings.colors = mem_cols;
+		settings.silent = TRUE;
+		if (save_image(buf, &settings))
+		{
+			snprintf(ebuf, sizeof(ebuf), "%s %s",
+				_("unable to save file"), buf);
+			return (ebuf);
+		}
+		break;
+	}
+	return (res ? _("not enough memory") : NULL);
+}
+
+static int batch_file(batch_script *bs, char *fname)
+{
+	char *err;
+	int i, res, ftype;
+
+
+	ftype = detect_image_format(fname);
+	if (ftype < 0)
+	{
+		fprintf(stderr, "%s: %s\n", fname, _("cannot open file"));
+		return (FALSE);
+	}
+	if ((ftype == FT_NONE) || (ftype == FT_LAYERS1))
+	{
+		fprintf(stderr, "%s: %s\n", fname,
+			_("unsupported file format"));
+		return (FALSE);
+	}
+	res = load_image(fname, FS_PNG_LOAD, ftype);
+	/* Animations & multipage files yield their first frame */
+	if ((res == FILE_HAS_FRAMES) || (res == FILE_HAS_ANIM)) res = 1;
+	else if (res == FILE_LIB_ERROR)
+		fprintf(stderr, "%s: %s\n", fname,
+			_("file is damaged, processing what was loaded"));
+	else if (res != 1)
+	{
+		fprintf(stderr, "%s: %s\n", fname, res == TOO_BIG ?
+			_("image is too big") : res == FILE_MEM_ERROR ?
+			_("not enough memory") : _("unable to load file"));
+		return (FALSE);
+	}
+
+	for (i = 0; i < bs->ncmds; i++)
+	{
+		if (!(err = run_command(bs->cmds + i, fname))) continue;
+		fprintf(stderr, "%s: %s:%d: %s\n", fname, bs->script,
+			bs->cmds[i].line, err);
+		return (FALSE);
+	}
+	return (TRUE);
+}
+
+/* Process every nth file, starting from given one; return failure count */
+static int batch_files(batch_script *bs, char **files, int nfiles,
+	int start, int step)
+{
+	int i, fails = 0;
+
+	for (i = start; i < nfiles; i += step)
+		fails += !batch_file(bs, files[i]);
+	return (fails);
+}
+
+int batch_main(int argc, char *argv[])
+{
+	batch_script bs;
+	char **files;
+	int i, nfiles, nworkers = 0, fails = 0;
+
+
+	if (argc < 1)
+	{
+		fprintf(stderr, "%s: mtpaint --batch SCRIPT [-j N] "
+			"imagefile ...\n", _("Usage"));
+		return (2);
+	}
+	for (i = 1; (i + 1 < argc) && !strcmp(argv[i], "-j"); i += 2)
+		nworkers = atoi(argv[i + 1]);
+	files = argv + i;
+	nfiles = argc - i;
+	if (!nfiles)
+	{
+		fprintf(stderr, "%s\n", _("No input files"));
+		return (2);
+	}
+	if (!parse_script(&bs, argv[0])) return (2);
+
+	/* Image state is global, so parallelism means worker processes */
+	if (nworkers < 1) nworkers = cpu_cores();
+	if (nworkers > nfiles) nworkers = nfiles;
+#ifdef WIN32
+	nworkers = 1; /* No fork() there */
+#else
+	if (nworkers > 1)
+	{
+		pid_t pid;
+		int status;
+
+		/* Have the cores split between the workers */
+		if (!maxthreads) maxthreads = cpu_cores() / nworkers;
+		if (maxthreads < 1) maxthreads = 1;
+		fflush(NULL);
+		/* Fork before the thread pool gets started: children would
+		 * inherit workers which do not exist in them */
+		for (i = 0; i < nworkers; i++)
+		{
+			if ((pid = fork()) < 0) break;
+			if (!pid)
+			{
+				fails = batch_files(&bs, files, nfiles,
+					i, nworkers);
+				fflush(NULL);
+				_exit(fails ? 1 : 0);
+			}
+		}
+		/* If fork failed, do the shares left here, with no more forks */
+		for (; i < nworkers; i++)
+			fails += batch_files(&bs, files, nfiles, i, nworkers);
+		while ((pid = wait(&status)) > 0)
+			if (!WIFEXITED(status) || WEXITSTATUS(status)) fails++;
+		nworkers = 0;
+	}
+#endif
+	if (nworkers) fails = batch_files(&bs, files, nfiles, 0, 1);
+
+	return (fails ? 1 : 0);
+}
@@ -0,0 +1,494 @@
+/*	bench.c
+	Copyright (C) 2026 Dmitry Groshev
+
+	This file is part of mtPaint.
+
+	mtPaint is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	mtPaint is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with mtPaint in the file COPYING.
+*/
+
+/* Standalone benchmark for image processing kernels: links only memory.o,
+ * wu.o, csel.o and thread.o, times a fixed matrix of operations over
+ * synthetic images and thread counts, and writes results as JSON to stdout.
+ *
+ * Usage: mtpaint-bench [-c] [-s SIZES] [-t THREADS] [-o OPS] [-r REPS]
+ * where lists are comma-separated; default sizes are 256,1024,4096 (add
+ * 8192,16384 for the full matrix), default threads are 1, 2, 4... up to
+ * number of cores, default is all ops, and 3 repetitions of each.
+ * Images are generated from fixed seed, so "hash" field of a result must
+ * stay the same across builds unless the algorithm itself is changed.
+ *
+ * With "-c", runs self-checks instead: code paths which must give identical
+ * results are run on the same images and compared; JSON lists the checks,
+ * exit code is 1 if any of them failed. */
+
+#include "global.h"
+
+#include "mygtk.h"
+#include "memory.h"
+#include "png.h"
+#include "wu.h"
+#include "csel.h"
+#include "thread.h"
+#include "channels.h"
+
+#include <sys/time.h>
+
+/* The few outside functions that memory.o pulls in - no GUI here */
+
+fformat file_formats[NUM_FTYPES];
+
+int alert_box(char *title, char *message, char *text1, ...)
+{
+	fprintf(stderr, "%s: %s\n", title, message);
+	return (1);
+}
+
+void memory_errors(int type)
+{
+	fprintf(stderr, "Error: out of memory\n");
+}
+
+void progress_init(char *text, int canc) {}
+int progress_update(float val) { return (FALSE); }
+void progress_end() {}
+
+char *inifile_get(char *setting, char *defaultValue)
+{
+	return (defaultValue);
+}
+
+int inifile_get_gint32(char *setting, int defaultValue)
+{
+	return (defaultValue);
+}
+
+int detect_file_format(char *name, int need_palette) { return (-1); }
+int load_image(char *file_name, int mode, int ftype) { return (-1); }
+void mem_pat_update() {}
+void mem_set_brush(int val) {}
+void notify_changed() {}
+void update_stuff(int flags) {}
+int temp_scratch() { return (-1); }
+
+/* Synthetic images */
+
+static unsigned int seed;
+
+static int rnd()
+{
+	seed = seed * 1103515245 + 12345;
+	return ((seed >> 16) & 0x7FFF);
+}
+
+/* Gradients with blocky edges and some noise - not too easy for filters,
+ * nor for quantizers */
+static void make_image(int w, int h)
+{
+	unsigned char *dest;
+	int i, j, k, n;
+
+	mem_new(w, h, 3, CMASK_IMAGE);
+	dest = mem_img[CHN_IMAGE];
+	seed = 1;
+	for (i = 0; i < h; i++)
+	for (j = 0; j < w; j++ , dest += 3)
+	{
+		k = ((i >> 5) ^ (j >> 5)) & 1;
+		n = rnd() & 31;
+		dest[0] = ((j * 224) / w + n);
+		dest[1] = ((i * 160) / h + k * 64 + n);
+		dest[2] = (((i + j) * 96) / (w + h) +
+			((k ^ (j >> 7)) & 1) * 128 + n);
+	}
+}
+
+/* Serpentine maze - flood fill has to crawl all over it */
+static void make_maze(int w, int h)
+{
+	unsigned char *dest;
+	int i, j, gap;
+
+	mem_new(w, h, 3, CMASK_IMAGE);
+	dest = mem_img[CHN_IMAGE];
+	memset(dest, 255, (size_t)w * h * 3);
+	for (i = 3; i < h; i += 4)
+	{
+		dest = mem_img[CHN_IMAGE] + (size_t)i * w * 3;
+		gap = (i >> 2) & 1 ? 0 : w - 1;
+		for (j = 0; j < w; j++) if (j != gap)
+			dest[j * 3] = dest[j * 3 + 1] = dest[j * 3 + 2] = 0;
+	}
+}
+
+static png_color bench_pal[256];
+
+/* Indexed image to dither into */
+static void make_quantized(int w, int h)
+{
+	make_image(w, h);
+	wu_quant(mem_img[CHN_IMAGE], w, h, 256, mem_pal);
+	mem_cols = 256;
+}
+
+/* Operations */
+
+static int op_gauss(int arg)
+{
+	double r = arg ? 40.0 : 5.0; // Explicit kernel, then extended box
+
+	mem_undo_next(UNDO_DRAW);
+	mem_gauss(r, r, FALSE, GAUSS_AUTO);
+	return (0);
+}
+
+static int op_unsharp(int arg)
+{
+	mem_undo_next(UNDO_FILT);
+	mem_unsharp(4.0, 0.5, 3, FALSE, GAUSS_AUTO);
+	return (0);
+}
+
+static int op_kuwahara(int arg)
+{
+	mem_undo_next(UNDO_FILT);
+	mem_kuwahara(5, FALSE, TRUE);
+	return (0);
+}
+
+static int op_scale(int arg)
+{
+	return (mem_image_scale((mem_width * 2) / 3, (mem_height * 2) / 3,
+		arg, FALSE, FALSE, BOUND_MIRROR));
+}
+
+static int op_rotate(int arg)
+{
+	return (mem_rotate_free(33.3, 1, FALSE, 0));
+}
+
+static int op_skew(int arg)
+{
+	return (mem_skew(0.3, 0.2, 1, FALSE));
+}
+
+static int op_quantize(int arg)
+{
+	return ((arg ? wu_quant : pnnquan)(mem_img[CHN_IMAGE], mem_width,
+		mem_height, 256, bench_pal));
+}
+
+static int op_dither(int arg)
+{
+	unsigned char *old = mem_img[CHN_IMAGE];
+	int res;
+
+	res = undo_next_core(UC_NOCOPY, mem_width, mem_height, 1, CMASK_IMAGE);
+	if (!res) res = mem_dither(old, 256, dither_fs, CSPACE_SRGB, DIST_L2,
+		0, FALSE, !arg, FALSE, 1.0); // Serpentine, then raster order
+	return (res);
+}
+
+static int op_effect(int arg)
+{
+	mem_undo_next(UNDO_FILT);
+	do_effect(arg, 40);
+	return (0);
+}
+
+static int op_flood(int arg)
+{
+	mem_undo_next(UNDO_TOOL | UNDO_TRACK);
+	flood_fill(0, 0, get_pixel(0, 0));
+	return (0);
+}
+
+typedef struct {
+	char *name;
+	int (*op)(int arg);
+	int arg;
+	void (*prep)(int w, int h);
+} bench_op;
+
+static bench_op ops[] = {
+	{ "gauss",		op_gauss,	0, make_image },
+	{ "gauss_large",	op_gauss,	1, make_image },
+	{ "unsharp",		op_unsharp,	0, make_image },
+	{ "kuwahara",		op_kuwahara,	0, make_image },
+	{ "scale_nearest",	op_scale,	0, make_image },
+	{ "scale_bilinear",	op_scale,	1, make_image },
+	{ "scale_bicubic",	op_scale,	2, make_image },
+	{ "scale_bicubic_edged", op_scale,	3, make_image },
+	{ "scale_bicubic_better", op_scale,	4, make_image },
+	{ "scale_bicubic_sharper", op_scale,	5, make_image },
+	{ "scale_blackman_harris", op_scale,	6, make_image },
+	{ "rotate",		op_rotate,	0, make_image },
+	{ "skew",		op_skew,	0, make_image },
+	{ "pnnquan",		op_quantize,	0, make_image },
+	{ "wu_quant",		op_quantize,	1, make_image },
+	{ "dither",		op_dither,	0, make_quantized },
+	{ "dither_raster",	op_dither,	1, make_quantized },
+	{ "floodfill",		op_flood,	0, make_maze },
+	{ NULL }
+};
+
+/* Parse comma-separated list of numbers */
+static int get_list(int *list, int max, char *s)
+{
+	int n = 0;
+
+	while (*s && (n < max))
+	{
+		if ((list[n] = strtol(s, &s, 10)) > 0) n++;
+		if (*s) s++;
+	}
+	return (n);
+}
+
+static double now()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec + tv.tv_usec * 1e-6);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double d = *(const double *)a - *(const double *)b;
+	return (d < 0 ? -1 : d > 0);
+}
+
+static unsigned int image_hash()
+{
+	unsigned char *src = mem_img[CHN_IMAGE];
+	size_t l = (size_t)mem_width * mem_height * mem_img_bpp;
+	unsigned int h = 2166136261U;
+
+	/* FNV-1a over image, then palette */
+	while (l--) h = (h ^ *src++) * 16777619U;
+	src = (unsigned char *)mem_pal;
+	for (l = 0; l < sizeof(mem_pal); l++) h = (h ^ *src++) * 16777619U;
+	src = (unsigned char *)bench_pal;
+	for (l = 0; l < sizeof(bench_pal); l++) h = (h ^ *src++) * 16777619U;
+	return (h);
+}
+
+/* Self-checks */
+
+static int effects[] = { FX_EDGE, FX_EMBOSS, FX_SHARPEN, FX_SOFTEN, FX_SOBEL,
+	FX_PREWITT, FX_GRADIENT, FX_ROBERTS, FX_LAPLACE, FX_KIRSCH, FX_ERODE,
+	FX_DILATE, FX_MORPHEDGE, -1 };
+
+/* Image with alpha, and mask with a ramp of partial opacities */
+static void make_masked(int w, int h)
+{
+	unsigned char *dest;
+	int i, j;
+
+	make_image(w, h);
+	if (undo_next_core(UC_CREATE, w, h, 3, CMASK_FOR(CHN_ALPHA) |
+		CMASK_FOR(CHN_MASK))) return;
+	dest = mem_img[CHN_ALPHA];
+	for (i = 0; i < h; i++)
+	for (j = 0; j < w; j++) *dest++ = (i * 7 + j * 3) ^ (rnd() & 15);
+	dest = mem_img[CHN_MASK];
+	for (i = 0; i < h; i++)
+	for (j = 0; j < w; j++) *dest++ = j < w / 3 ? 0 : (i + j) & 255;
+}
+
+static unsigned int channel_hash(int channel)
+{
+	unsigned char *src = mem_img[channel];
+	size_t l = (size_t)mem_width * mem_height * BPP(channel);
+	unsigned int h = 2166136261U;
+
+	while (l--) h = (h ^ *src++) * 16777619U;
+	return (h);
+}
+
+static int nchecks, failed;
+
+/* Run an op twice, changing a setting in between, and compare results */
+static void check_pair(char *name, char *what, int *var, int v0, int v1,
+	void (*prep)(int w, int h), int (*op)(int arg), int arg, int channel)
+{
+	unsigned int hash[2];
+	int i, res[2], w = 517, h = 301; // Odd sizes, to leave some tails
+
+	for (i = 0; i < 2; i++)
+	{
+		*var = i ? v1 : v0;
+		memset(bench_pal, 0, sizeof(bench_pal));
+		prep(w, h);
+		mem_channel = channel;
+		res[i] = op(arg);
+		hash[i] = channel_hash(channel);
+		mem_channel = CHN_IMAGE;
+	}
+	*var = v0;
+	i = !res[0] && !res[1] && (hash[0] == hash[1]);
+	failed += !i;
+	printf("%s\n    { \"check\": \"%s\", %s, \"ok\": %s }",
+		nchecks++ ? "," : "", name, what, i ? "true" : "false");
+	fflush(stdout);
+}
+
+static int run_checks()
+{
+	char buf[256];
+	int i, j, k;
+
+	printf("{\n  \"checks\": [");
+	maxthreads = 4;
+	/* SSE2 effect kernel against C, for every effect and bpp, masked or not */
+	for (i = 0; effects[i] >= 0; i++)
+	for (j = 0; j < 2; j++)
+	for (k = 0; k < 2; k++)
+	{
+		channel_dis[CHN_MASK] = !k;
+		snprintf(buf, sizeof(buf), "\"type\": %d, \"bpp\": %d, "
+			"\"mask\": %s", effects[i], j ? 1 : 3, k ? "true" : "false");
+		check_pair("effect_sse2", buf, &mem_no_sse2,
+			FALSE, TRUE, make_masked, op_effect, effects[i],
+			j ? CHN_ALPHA : CHN_IMAGE);
+	}
+	channel_dis[CHN_MASK] = FALSE;
+	/* Threaded paths against a single thread */
+	for (i = 0; effects[i] >= 0; i++)
+	{
+		snprintf(buf, sizeof(buf), "\"type\": %d", effects[i]);
+		check_pair("effect_threads", buf, &maxthreads, 1, 4,
+			make_image, op_effect, effects[i], CHN_IMAGE);
+	}
+	for (i = 0; i < 2; i++)
+	{
+		snprintf(buf, sizeof(buf), "\"serpentine\": %s",
+			i ? "false" : "true");
+		check_pair("dither_threads", buf, &maxthreads, 1, 4,
+			make_quantized, op_dither, i, CHN_IMAGE);
+	}
+	printf("\n  ],\n  \"failed\": %d\n}\n", failed);
+
+	mem_free_image(&mem_image, FREE_ALL);
+	return (!!failed);
+}
+
+#define MAX_LIST 32
+#define MAX_REPS 100
+
+int main(int argc, char *argv[])
+{
+	static int sizes[MAX_LIST] = { 256, 1024, 4096 }, threads[MAX_LIST];
+	double times[MAX_REPS];
+	char *opnames = NULL;
+	bench_op *op;
+	unsigned int hash;
+	int i, j, k, r, t, res, nsizes = 3, nthreads = 0, reps = 3, first = TRUE;
+	int check = FALSE;
+
+
+	for (i = 1; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "-c")) check = TRUE;
+		else if (i == argc - 1) break;
+		else if (!strcmp(argv[i], "-s"))
+			nsizes = get_list(sizes, MAX_LIST, argv[++i]);
+		else if (!strcmp(argv[i], "-t"))
+			nthreads = get_list(threads, MAX_LIST, argv[++i]);
+		else if (!strcmp(argv[i], "-o")) opnames = argv[++i];
+		else if (!strcmp(argv[i], "-r")) reps = atoi(argv[++i]);
+		else break;
+	}
+	if (i < argc)
+	{
+		fprintf(stderr, "Usage: %s [-c] [-s SIZES] [-t THREADS] "
+			"[-o OPS] [-r REPS]\n", argv[0]);
+		return (1);
+	}
+	if (reps < 1) reps = 1;
+	if (reps > MAX_REPS) reps = MAX_REPS;
+	if (!nthreads) /* Powers of 2, then all cores */
+	{
+		k = cpu_cores();
+		for (t = 1; (t < k) && (nthreads < MAX_LIST - 1); t += t)
+			threads[nthreads++] = t;
+		threads[nthreads++] = k;
+	}
+
+	/* Enough undo memory for the largest images */
+	mem_undo_depth = MIN_UNDO;
+	mem_undo_limit = sizeof(size_t) > 4 ? 1 << 20 : 2048;
+	mem_init();
+	init_cols();
+	tool_opacity = 255;
+	if (check) return (run_checks());
+
+	printf("{\n");
+#ifdef MT_VERSION
+	printf("  \"version\": \"%s\",\n", MT_VERSION);
+#endif
+	printf("  \"cores\": %d,\n  \"reps\": %d,\n  \"results\": [", cpu_cores(),
+		reps);
+
+	for (op = ops; op->name; op++)
+	{
+		if (opnames)
+		{
+			char *s = strstr(opnames, op->name);
+			j = strlen(op->name);
+			if (!s || ((s > opnames) && (s[-1] != ',')) ||
+				(s[j] && (s[j] != ','))) continue;
+		}
+		for (i = 0; i < nsizes; i++)
+		{
+			k = sizes[i] > MAX_WIDTH ? MAX_WIDTH : sizes[i];
+			for (t = 0; t < nthreads; t++)
+			{
+				fprintf(stderr, "%s %dx%d, %d thread(s)\n",
+					op->name, k, k, threads[t]);
+				maxthreads = threads[t];
+				hash = 0;
+				for (r = res = 0; !res && (r < reps); r++)
+				{
+					double t0;
+
+					memset(bench_pal, 0, sizeof(bench_pal));
+					op->prep(k, k);
+					t0 = now();
+					res = op->op(op->arg);
+					times[r] = now() - t0;
+					hash = image_hash();
+				}
+				printf("%s\n    { \"op\": \"%s\", \"size\": %d, "
+					"\"threads\": %d, ", first ? "" : ",",
+					op->name, k, threads[t]);
+				first = FALSE;
+				if (res)
+				{
+					printf("\"error\": %d }", res);
+					continue;
+				}
+				qsort(times, reps, sizeof(double), cmp_double);
+				printf("\"min\": %.6f, \"median\": %.6f, "
+					"\"hash\": \"%08x\" }", times[0],
+					times[reps / 2], hash);
+				fflush(stdout);
+			}
+		}
+	}
+	printf("\n  ]\n}\n");
+
+	mem_free_image(&mem_image, FREE_ALL);
+	return (0);
+}
@@ -275,7 +275,8 @@ void commit_paste(int swap, int *update)
 	image = mem_clipboard + ofs * mem_clip_bpp;
 	iofs = fy * mem_width + fx;
 
-	mem_undo_next(UNDO_PASTE);	// Do memory stuff for undo
+	mem_undo_next(UNDO_PASTE | UNDO_TRACK);	// Do memory stuff for undo
+	mem_undo_dirty(fx, fy, fw, fh);
 
 	old_image = mem_img[mem_channel];
 	old_alpha = mem_img[CHN_ALPHA];
@@ -466,7 +467,7 @@ void pressed_fx(int what)
 typedef struct {
 	filterwindow_dd fw;
 	int rgb;
-	int x, y, xy, gamma;
+	int x, y, xy, gamma, method;
 	void **yspin;
 } gauss_dd;
 
@@ -481,7 +482,7 @@ static int do_gauss(gauss_dd *dt, void **wdata)
 	if (dt->xy) radiusY = dt->y;
 
 	spot_undo(UNDO_DRAW);
-	mem_gauss(radiusX * 0.01, radiusY * 0.01, gcor);
+	mem_gauss(radiusX * 0.01, radiusY * 0.01, gcor, dt->method);
 	mem_undo_prepare();
 
 	return TRUE;
@@ -496,6 +497,8 @@ static void gauss_xy_click(gauss_dd *dt, void **wdata, int what, void **where)
 #undef _
 #define _(X) X
 
+static char *gmethod_txt[] = { _("Auto"), _("Exact"), _("Fast") };
+
 #define WBbase gauss_dd
 static void *gauss_code[] = {
 	VBOXPS,
@@ -504,6 +507,7 @@ static void *gauss_code[] = {
 	REF(yspin), FSPIN(y, 0, 20000), INSENS,
 	CHECK(_("Different X/Y"), xy), EVENT(CHANGE, gauss_xy_click),
 	IF(rgb), CHECK(_("Gamma corrected"), gamma),
+	FRPACK(_("Method"), gmethod_txt, 3, 1, method),
 	WDONE, RET
 };
 #undef WBbase
@@ -512,7 +516,7 @@ void pressed_gauss()
 {
 	gauss_dd tdata = {
 		{ _("Gaussian Blur"), gauss_code, FW_FN(do_gauss) },
-		mem_channel == CHN_IMAGE, 100, 100, FALSE, use_gamma };
+		mem_channel == CHN_IMAGE, 100, 100, FALSE, use_gamma, GAUSS_AUTO };
 	run_create(filterwindow_code, &tdata, sizeof(tdata));
 }
 
@@ -522,7 +526,7 @@ void pressed_gauss()
 typedef struct {
 	filterwindow_dd fw;
 	int rgb;
-	int radius, amount, threshold, gamma;
+	int radius, amount, threshold, gamma, method;
 } unsharp_dd;
 
 static int do_unsharp(unsharp_dd *dt, void **wdata)
@@ -531,7 +535,7 @@ static int do_unsharp(unsharp_dd *dt, void **wdata)
 	// !!! No RGBA mode for now, so UNDO_DRAW isn't needed
 	spot_undo(UNDO_FILT);
 	mem_unsharp(dt->radius * 0.01, dt->amount * 0.01, dt->threshold,
-		(mem_channel == CHN_IMAGE) && dt->gamma);
+		(mem_channel == CHN_IMAGE) && dt->gamma, dt->method);
 	mem_undo_prepare();
 
 	return TRUE;
@@ -550,6 +554,7 @@ static void *unsharp_code[] = {
 	TSPIN(_("Threshold "), threshold, 0, 255),
 	WDONE,
 	IF(rgb), CHECK(_("Gamma corrected"), gamma),
+	FRPACK(_("Method"), gmethod_txt, 3, 1, method),
 	WDONE, RET
 };
 #undef WBbase
@@ -558,7 +563,7 @@ void pressed_unsharp()
 {
 	unsharp_dd tdata = {
 		{ _("Unsharp Mask"), unsharp_code, FW_FN(do_unsharp) },
-		mem_channel == CHN_IMAGE, 500, 50, 0, use_gamma };
+		mem_channel == CHN_IMAGE, 500, 50, 0, use_gamma, GAUSS_AUTO };
 	run_create(filterwindow_code, &tdata, sizeof(tdata));
 }
 
@@ -568,7 +573,7 @@ void pressed_unsharp()
 typedef struct {
 	filterwindow_dd fw;
 	int rgb;
-	int outer, inner, norm, gamma;
+	int outer, inner, norm, gamma, method;
 } dog_dd;
 
 static int do_dog(dog_dd *dt, void **wdata)
@@ -578,7 +583,7 @@ static int do_dog(dog_dd *dt, void **wdata)
 
 	spot_undo(UNDO_FILT);
 	mem_dog(dt->outer * 0.01, dt->inner * 0.01, dt->norm,
-		(mem_channel == CHN_IMAGE) && dt->gamma);
+		(mem_channel == CHN_IMAGE) && dt->gamma, dt->method);
 	mem_undo_prepare();
 
 	return TRUE;
@@ -597,6 +602,7 @@ static void *dog_code[] = {
 	WDONE,
 	CHECK(_("Normalize"), norm),
 	IF(rgb), CHECK(_("Gamma corrected"), gamma),
+	FRPACK(_("Method"), gmethod_txt, 3, 1, method),
 	WDONE, RET
 };
 #undef WBbase
@@ -605,7 +611,7 @@ void pressed_dog()
 {
 	dog_dd tdata = {
 		{ _("Difference of Gaussians"), dog_code, FW_FN(do_dog) },
-		mem_channel == CHN_IMAGE, 300, 100, TRUE, use_gamma };
+		mem_channel == CHN_IMAGE, 300, 100, TRUE, use_gamma, GAUSS_AUTO };
 	run_create(filterwindow_code, &tdata, sizeof(tdata));
 }
 
@@ -920,9 +926,12 @@ void pressed_paste(int centre)
 
 void pressed_rectangle(int filled)
 {
-	int sb;
+	int sb, oldmode = mem_undo_opacity;
 
-	spot_undo(UNDO_DRAW);
+	/* Polygons get drawn in opacity mode, undo needs to know beforehand */
+	if (tool_type == TOOL_POLYGON) mem_undo_opacity = TRUE;
+	spot_undo(UNDO_DRAW | UNDO_TRACK);
+	mem_undo_opacity = oldmode;
 
 	/* Shapeburst mode */
 	sb = STROKE_GRADIENT;
@@ -978,7 +987,7 @@ void pressed_rectangle(int filled)
 
 void pressed_ellipse(int filled)
 {
-	spot_undo(UNDO_DRAW);
+	spot_undo(UNDO_DRAW | UNDO_TRACK);
 	mem_ellipse(marq_x1, marq_y1, marq_x2, marq_y2, filled ? 0 : tool_size);
 	mem_undo_prepare();
 	update_stuff(UPD_IMG);
@@ -1033,7 +1042,7 @@ static void cut_clip()
 {
 	int i, sb = 0;
 
-	spot_undo(UNDO_DRAW);
+	spot_undo(UNDO_DRAW | UNDO_TRACK);
 	/* Shapeburst mode */
 	if (STROKE_GRADIENT)
 	{
@@ -1317,7 +1326,7 @@ void update_stuff(int flags)
 
 void pressed_do_undo(int redo)
 {
-	mem_do_undo(redo);
+	if (mem_do_undo(redo)) memory_errors(1);
 	update_stuff(UPD_ALL | CF_NAME);
 }
 
@@ -2355,6 +2364,11 @@ static void poly_add_po(int x, int y)
 
 static int first_point;
 
+/* Tools which write only through put_pixel(), put_pixel_row() and do_clone(),
+ * so all their changes get marked by mem_undo_dirty() */
+#define TRACKED_TOOL(T) (((T) <= TOOL_SPRAY) || ((T) == TOOL_SMUDGE) || \
+	((T) == TOOL_CLONE))
+
 static int tool_draw(int x, int y, int *update)
 {
 	static int ncx, ncy;
@@ -2414,6 +2428,8 @@ static int tool_draw(int x, int y, int *update)
 				if (pixel_protected(rx, ry) ||
 					pixel_protected(sx, sy))
 					continue;
+				mem_undo_dirty(rx, ry, 1, 1);
+				mem_undo_dirty(sx, sy, 1, 1);
 				off1 = rx + ry * mem_width;
 				off2 = sx + sy * mem_width;
 				if ((mem_channel == CHN_IMAGE) &&
@@ -2544,22 +2560,23 @@ void tool_action(int event, int x, int y, int button, gdouble pressure)
 			if ( line_status == LINE_LINE )
 			{
 				grad_info svgrad = gradient[mem_channel];
+				int oldmode = mem_undo_opacity;
 
 				/* If not called from draw_arrow() */
 				if (event != GDK_NOTHING) line_to_gradient();
 
-				mem_undo_next(UNDO_TOOL);
+				/* Undo needs to know of opacity mode beforehand */
+				if ( tool_size > 1 ) mem_undo_opacity = TRUE;
+				mem_undo_next(UNDO_TOOL | UNDO_TRACK);
 				if ( tool_size > 1 )
 				{
-					int oldmode = mem_undo_opacity;
-					mem_undo_opacity = TRUE;
 					f_circle( line_x1, line_y1, tool_size );
 					f_circle( line_x2, line_y2, tool_size );
 					// Draw tool_size thickness line from 1-2
 					tline( line_x1, line_y1, line_x2, line_y2, tool_size );
-					mem_undo_opacity = oldmode;
 				}
 				else sline( line_x1, line_y1, line_x2, line_y2 );
+				mem_undo_opacity = oldmode;
 
 				minx = (line_x1 < line_x2 ? line_x1 : line_x2) - ts2;
 				miny = (line_y1 < line_y2 ? line_y1 : line_y2) - ts2;
@@ -2659,7 +2676,8 @@ void tool_action(int event, int x, int y, int button, gdouble pressure)
 		if ((button == 1) || ((button == 3) && rmb_tool))
 		{
 			// Do memory stuff for undo
-			if (tool_type != TOOL_FLOOD) mem_undo_next(UNDO_TOOL);	
+			if (tool_type != TOOL_FLOOD) mem_undo_next(UNDO_TOOL |
+				(TRACKED_TOOL(tool_type) ? UNDO_TRACK : 0));
 			res = 0; 
 		}
 	}
@@ -2675,7 +2693,7 @@ void tool_action(int event, int x, int y, int button, gdouble pressure)
 				mem_img_bpp == 1 ? mem_col_A : PNG_2_INT(mem_col_A24);
 			if (j != k) /* And never start on colour A */
 			{
-				spot_undo(UNDO_TOOL);
+				spot_undo(UNDO_TOOL | UNDO_TRACK);
 				flood_fill(x, y, j);
 				// All pixels could change
 				minx = miny = 0;
@@ -3303,6 +3321,9 @@ void create_default_image()			// Create default new image
 		nc = inifile_get_gint32("lastnewCols", 256 ),
 		nt = inifile_get_gint32("lastnewType", 2 );
 
-	do_new_one(nw, nh, nc, nt == 1 ? NULL : mem_pal_def,
+	/* No GUI to update in batch mode */
+	if (cmd_mode) mem_new(nw, nh, (nt == 0) || (nt > 2) ? 3 : 1,
+		CMASK_IMAGE);
+	else do_new_one(nw, nh, nc, nt == 1 ? NULL : mem_pal_def,
 		(nt == 0) || (nt > 2) ? 3 : 1, FALSE);
 }
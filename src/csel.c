@@ -401,17 +401,18 @@ static double get_vect(int col)
 	return ((c2 + c2 + c1) * 255 + midc * 255 / (double)maxc);
 }
 
-/* Answer which pixels are masked through selectivity */
+/* Answer which pixels are masked through selectivity; can run in several
+ * threads at once, with results cached without locking - cache entries get
+ * only set, never changed, and are all deterministic, so at worst a thread
+ * may compute some entry which another thread is computing too */
 int csel_scan(int start, int step, int cnt, unsigned char *mask,
 	unsigned char *img, csel_info *info)
 {
 	unsigned char res = 0;
 	double d, dist = 0.0, lxn[3];
 	int i, j, k, l, jj, st3 = step * 3;
-	DEF_MUTEX(csel_lock); // To prevent concurrent writes to *info
 
 
-	LOCK_MUTEX(csel_lock);
 	cnt = start + step * (cnt - 1) + 1;
 	if (!mask)
 	{
@@ -424,9 +425,11 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 		{
 			j = img[i];
 			k = PNG_2_INT(mem_pal[j]);
-			if (info->pcache[j] != k)
+			/* Colour and its state are stored together, so that no
+			 * other thread can see one without the other */
+			l = info->pcache[j];
+			if ((l ^ k) & ~PCACHE_IN)
 			{
-				info->pcache[j] = k;
 				if (info->mode == 0) /* Sphere mode */
 				{
 					get_lxn(lxn, k);
@@ -450,10 +453,10 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 					jj = abs(INT_2_B(info->center) - INT_2_B(k));
 					dist = l > jj ? l : jj;
 				}
-				if (dist <= info->range2)
-					info->pmap[j >> 5] |= 1 << (j & 31);
+				info->pcache[j] = l = dist <= info->range2 ?
+					k + PCACHE_IN : k;
 			}
-			if (((info->pmap[j >> 5] >> (j & 31)) ^ info->invert) & 1)
+			if (((l >> PCACHE_SHIFT) ^ info->invert) & 1)
 				mask[i] |= 255;
 		}
 	}
@@ -489,7 +492,7 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 					(lxn[2] - info->clxn[2]) *
 					(lxn[2] - info->clxn[2]);
 				l = dist <= info->range2 ? 3 : 2;
-				info->colormap[j] |= l << k;
+				thread_or(info->colormap + j, l << k);
 			}
 			if ((l ^ info->invert) & 1) mask[i] |= 255;
 		}
@@ -517,7 +520,8 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 					if (dist > 765.0) dist = 1530.0 - dist;
 					if (dist <= info->range2) l += jj;
 				}
-				info->colormap[j >> 3] |= (l + 8) << ((j & 7) << 2);
+				thread_or(info->colormap + (j >> 3),
+					(l + 8) << ((j & 7) << 2));
 			}
 			if (((l >> k) ^ info->invert) & 1) mask[i] |= 255;
 		}
@@ -537,7 +541,6 @@ int csel_scan(int start, int step, int cnt, unsigned char *mask,
 				mask[i] |= 255;
 		}
 	}
-	UNLOCK_MUTEX(csel_lock);
 	return (res);
 }
 
@@ -579,7 +582,6 @@ void csel_reset(csel_info *info)
 	int i, j, k, l;
 
 	memset(info->colormap, 0, sizeof(info->colormap));
-	memset(info->pmap, 0, sizeof(info->pmap));
 	memset(info->pcache, 255, sizeof(info->pcache));
 	switch (info->mode)
 	{
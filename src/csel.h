@@ -19,6 +19,10 @@
 
 #define CMAPSIZE (64 * 64 * 64 / 16)
 
+/* Palette cache holds RGB, with this bit set if colour is in range */
+#define PCACHE_SHIFT 24
+#define PCACHE_IN (1 << PCACHE_SHIFT)
+
 typedef struct
 {
 	/* Input fields */
@@ -27,7 +31,6 @@ typedef struct
 	double range;
 	/* Cache fields */
 	guint32 colormap[CMAPSIZE * 2];
-	guint32 pmap[256 / 32];
 	int pcache[256], cbase, irange, amin, amax;
 	double clxn[3], cvec, range2;
 } csel_info;
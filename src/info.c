@@ -188,29 +188,8 @@ static void hs_click_normalize(GtkToggleButton *togglebutton, gpointer user_data
 static void hs_populate_rgb()				// Populate RGB tables
 {
 	int i, j, k, t;
-	unsigned char *im = mem_img[CHN_IMAGE];
 
-	memset(&hs_rgb[0][0], 0, sizeof(hs_rgb));
-
-	j = mem_width * mem_height;
-
-	if ( mem_img_bpp == 3 )
-	{
-		for ( i=0; i<j; i++ )			// Populate table with RGB frequencies
-		{
-			hs_rgb[im[0]][0]++;
-			hs_rgb[im[1]][1]++;
-			hs_rgb[im[2]][2]++;
-			im += 3;
-		}
-	}
-	else
-	{
-		for ( i=0; i<j; i++ )			// Populate table with pixel indexes
-		{
-			hs_rgb[im[i]][0]++;
-		}
-	}
+	mem_get_histogram3(hs_rgb, CHN_IMAGE);	// RGB frequencies or pixel indexes
 
 	memcpy(hs_rgb_sorted, hs_rgb, sizeof(hs_rgb_sorted));
 
@@ -32,6 +32,11 @@
 #include "prefs.h"
 #include "csel.h"
 #include "spawn.h"
+#include "batch.h"
+
+#ifdef U_NLS
+#include <locale.h>
+#endif
 
 #ifndef WIN32
 #include <glob.h>
@@ -265,10 +270,13 @@ int main( int argc, char *argv[] )
 		if ( strcmp(argv[1], "--help") == 0 )
 		{
 			printf("%s\n\n"
-				"Usage: mtpaint [option] [imagefile ... ]\n\n"
+				"Usage: mtpaint [option] [imagefile ... ]\n"
+				"       mtpaint --batch script [-j N] imagefile ...\n\n"
 				"Options:\n"
 				"  --help          Output this help\n"
 				"  --version       Output version information\n"
+				"  --batch         Process files by script, without GUI\n"
+				"  -j N            Run N batch jobs in parallel\n"
 				"  -s              Grab screenshot\n"
 				"  -v              Start in viewer mode\n\n"
 			, MT_VERSION);
@@ -290,6 +298,29 @@ int main( int argc, char *argv[] )
 #endif
 	inifile_init("/etc/mtpaint/mtpaintrc", "~/.mtpaint");
 
+	/* Batch mode never touches the display, so leaves GTK+ uninitialized */
+	if ((argc > 1) && !strcmp(argv[1], "--batch"))
+	{
+		cmd_mode = TRUE;
+		string_init();
+		var_init();
+		mem_init();
+		layers_init();
+		init_cols();
+#ifdef U_NLS
+		/* Messages go to the terminal, so in its locale */
+		setlocale(LC_ALL, "");
+		{
+			char *locdir = extend_path(MT_LANG_DEST);
+			bindtextdomain("mtpaint", locdir);
+			g_free(locdir);
+			textdomain("mtpaint");
+		}
+#endif
+		/* Leave inifile alone, as parallel runs would fight over it */
+		return (batch_main(argc - 2, argv + 2));
+	}
+
 #ifdef U_NLS
 #if GTK_MAJOR_VERSION == 1
 	/* !!! GTK+1 needs locale set up before gtk_init(); GTK+2, *QUITE*
@@ -117,6 +117,7 @@ static inilist ini_int[] = {
 	{ "gridMin",		&mem_grid_min,		8   },
 	{ "undoMBlimit",	&mem_undo_limit,	32  },
 	{ "undoCommon",		&mem_undo_common,	25  },
+	{ "undoDiskMB",		&mem_undo_disk,		0   },
 	{ "maxThreads",		&maxthreads,		0   },
 	{ "backgroundGrey",	&mem_background,	180 },
 	{ "pixelNudge",		&mem_nudge,		8   },
@@ -1091,11 +1092,12 @@ static void draw_arrow(int mode)
 // !!! Call this, or let undo engine do it?
 //	mem_undo_prepare();
 	pen_down = 0;
+	/* Arrow gets drawn in opacity mode, undo needs to know beforehand */
+	mem_undo_opacity = TRUE;
 	tool_action(GDK_NOTHING, line_x2, line_y2, 1, 1.0);
 	line_status = LINE_LINE;
 
 	// Draw arrow lines & circles
-	mem_undo_opacity = TRUE;
 	f_circle(xa1, ya1, tool_size);
 	f_circle(xa2, ya2, tool_size);
 	tline(xa1, ya1, line_x2, line_y2, tool_size);
@@ -34,7 +34,25 @@
 #include "viewer.h"
 #include "csel.h"
 #include "thread.h"
+#include "spawn.h"
 
+/* SSE2 code is selected at runtime, so needs no special compiler flags */
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__)) && \
+	((__GNUC__ > 4) || ((__GNUC__ == 4) && (__GNUC_MINOR__ >= 9)))
+
+#include <emmintrin.h>
+
+#define SSE2_FUNC __attribute__ ((target("sse2")))
+
+static int cpu_sse2;
+
+static int have_sse2()
+{
+	if (!cpu_sse2) cpu_sse2 = __builtin_cpu_supports("sse2") ? 1 : -1;
+	return ((cpu_sse2 > 0) && !mem_no_sse2);
+}
+
+#endif
 
 grad_info gradient[NUM_CHANNELS];	// Per-channel gradients
 double grad_path, grad_x0, grad_y0;	// Stroke gradient temporaries
@@ -106,9 +124,13 @@ transform_state mem_bcsp;
 #define UF_SIZED 0x04
 #define UF_ORIG  0x08 /* Unmodified state */
 #define UF_ACCUM 0x10 /* Cumulative */
+#define UF_DISK  0x20 /* Data is in scratch file */
+#define UF_DIRTY 0x40 /* Tileptr has map of changed tiles, if any */
+#define UF_COW   0x80 /* Channels shared with image, tileptr has saved tiles */
 
 int mem_undo_limit;		// Max MB memory allocation limit
 int mem_undo_common;		// Percent of undo space in common arena
+int mem_undo_disk;		// Max MB disk space for undo, 0 for none
 int mem_undo_opacity;		// Use previous image for opacity calculations?
 
 typedef struct {
@@ -741,11 +763,16 @@ int init_undo(undo_stack *ustack, int depth)
 	return (FALSE);
 }
 
+/* Changes whenever image may have been changed, to validate cached results */
+static unsigned int undo_stamp;
+
 /* Copy image state into current undo frame */
 void update_undo(image_info *image)
 {
 	undo_item *undo = image->undo_.items[image->undo_.pointer];
 
+	undo_stamp++;
+
 /* !!! If system is unable to allocate 768 bytes, may as well die by SIGSEGV
  * !!! right here, and not hobble along till GUI does the dying - WJ */
 	if (!undo->pal_) undo->pal_ = malloc(SIZEOF_PALETTE);
@@ -772,6 +799,132 @@ void mem_free_chanlist(chanlist img)
 	}
 }
 
+/* Undo frames pushed out of memory can go into a scratch file, up to
+ * mem_undo_disk MB of it, instead of getting dropped; free space in the file
+ * is kept as a list of extents, sorted by offset */
+
+typedef struct {
+	off_t ofs;
+	size_t len;
+} extent;
+
+typedef struct {
+	extent ext;			// Where in file the data is
+	size_t len[NUM_CHANNELS];	// Length of each channel's chunk
+	size_t tileofs;			// Tilemap offset in first chunk
+	int pal;			// Palette is stored too
+} spill_item;
+
+static int spill_fd = -1, spill_fail;
+static off_t spill_end;
+static extent *spill_free;
+static int spill_nfree, spill_max;
+
+static int spill_alloc(extent *ext, size_t len)
+{
+	off_t lim = (off_t)(mem_undo_disk < MAX_UNDO_DISK ? mem_undo_disk :
+		MAX_UNDO_DISK) * (1024 * 1024);
+	int i;
+
+	ext->len = len;
+	/* First fit */
+	for (i = 0; i < spill_nfree; i++)
+	{
+		if (spill_free[i].len < len) continue;
+		ext->ofs = spill_free[i].ofs;
+		spill_free[i].ofs += len;
+		if (!(spill_free[i].len -= len)) memmove(spill_free + i,
+			spill_free + i + 1, (--spill_nfree - i) * sizeof(extent));
+		return (TRUE);
+	}
+	/* Extend the file */
+	if ((off_t)len > lim - spill_end) return (FALSE);
+	ext->ofs = spill_end;
+	spill_end += len;
+	return (TRUE);
+}
+
+static void spill_release(extent *ext)
+{
+	extent *tmp;
+	off_t ofs = ext->ofs;
+	size_t len = ext->len;
+	int i;
+
+	if (!len) return;
+	for (i = 0; (i < spill_nfree) && (spill_free[i].ofs < ofs); i++);
+	/* Merge with free extent after */
+	if ((i < spill_nfree) && (spill_free[i].ofs == ofs + (off_t)len))
+	{
+		len += spill_free[i].len;
+		memmove(spill_free + i, spill_free + i + 1,
+			(--spill_nfree - i) * sizeof(extent));
+	}
+	/* Merge with free extent before */
+	if (i && (spill_free[i - 1].ofs + (off_t)spill_free[i - 1].len == ofs))
+	{
+		ofs = spill_free[--i].ofs;
+		len += spill_free[i].len;
+		memmove(spill_free + i, spill_free + i + 1,
+			(--spill_nfree - i) * sizeof(extent));
+	}
+	/* Give space at end back to filesystem */
+	if ((ofs + (off_t)len == spill_end) && !ftruncate(spill_fd, ofs))
+	{
+		spill_end = ofs;
+		return;
+	}
+	if (spill_nfree >= spill_max)
+	{
+		tmp = realloc(spill_free, (spill_max * 2 + 16) * sizeof(extent));
+		if (!tmp) return; // Lose the space then
+		spill_free = tmp;
+		spill_max = spill_max * 2 + 16;
+	}
+	memmove(spill_free + i + 1, spill_free + i,
+		(spill_nfree++ - i) * sizeof(extent));
+	spill_free[i].ofs = ofs;
+	spill_free[i].len = len;
+}
+
+static int spill_io(off_t ofs, unsigned char *buf, size_t len, int out)
+{
+	int l;
+
+	if (lseek(spill_fd, ofs, SEEK_SET) != ofs) return (FALSE);
+	while (len)
+	{
+		l = len > 0x40000000 ? 0x40000000 : len;
+		l = out ? write(spill_fd, buf, l) : read(spill_fd, buf, l);
+		if (l <= 0) return (FALSE);
+		buf += l; len -= l;
+	}
+	return (TRUE);
+}
+
+static void undo_free_spill(undo_item *undo)
+{
+	spill_item *sp = undo->spillptr;
+
+	spill_release(&sp->ext);
+	free(sp);
+	undo->spillptr = NULL;
+	undo->flags &= ~UF_DISK;
+}
+
+/* Drop saved tiles */
+static void undo_free_cow(undo_item *undo)
+{
+	unsigned char **tiles = (void *)undo->tileptr;
+	int i, n = ((undo->width + TILE_SIZE - 1) / TILE_SIZE) *
+		((undo->height + TILE_SIZE - 1) / TILE_SIZE);
+
+	for (i = 0; i < n; i++) free(tiles[i]);
+	free(tiles);
+	undo->tileptr = NULL;
+	undo->flags &= ~UF_COW;
+}
+
 static size_t undo_free_x(undo_item **undo_)
 {
 	undo_item *undo = *undo_;
@@ -779,6 +932,13 @@ static size_t undo_free_x(undo_item **undo_)
 
 	if (!undo) return (0);
 	j = undo->size;
+	if (undo->flags & UF_DISK) undo_free_spill(undo);
+	if (undo->flags & UF_DIRTY) free(undo->tileptr);
+	if (undo->flags & UF_COW) /* Channels belong to image */
+	{
+		undo_free_cow(undo);
+		memset(undo->img, 0, sizeof(chanlist));
+	}
 	undo_free_data(undo);
 	free(undo->pal_);
 	mem_free_chanlist(undo->img);
@@ -1046,6 +1206,8 @@ int mem_clip_new(int width, int height, int bpp, int cmask, int backup)
 	return (!res);
 }
 
+static int undo_cow_flatten(undo_item *undo);
+
 /* Get address of previous channel data (or current if none) */
 unsigned char *mem_undo_previous(int channel)
 {
@@ -1053,24 +1215,15 @@ unsigned char *mem_undo_previous(int channel)
 	unsigned char *res;
 
 	undo = mem_undo_im_[(mem_undo_pointer ? mem_undo_pointer : mem_undo_max) - 1];
+	/* Shared channels need be separated first */
+	if (undo && (undo->flags & UF_COW) && !undo_cow_flatten(undo))
+		undo = NULL;
 	if (!undo || !(res = undo->img[channel]) || (res == (void *)(-1)) ||
 		(undo->flags & UF_TILED))
 		res = mem_img[channel];	// No usable undo so use current
 	return (res);
 }
 
-static size_t lose_oldest(undo_stack *ustack)	// Lose the oldest undo image
-{
-	int idx;
-
-	if (ustack->redo > ustack->done) idx = ustack->redo--;
-	else if (ustack->done) idx = ustack->max - ustack->done--;
-	else return (0);
-/* !!! mem_try_malloc() may call this on an unsized undo stack - but it
- * !!! doesn't need valid sizes anyway - WJ */
-	return (undo_free_x(ustack->items + (ustack->pointer + idx) % ustack->max));
-}
-
 /* Convert tile bitmap row into a set of spans (skip/copy), terminated by
  * a zero-length copy span; return copied length */
 static int mem_undo_spans(int *spans, unsigned char *tmap, int width, int bpp)
@@ -1096,139 +1249,173 @@ static int mem_undo_spans(int *spans, unsigned char *tmap, int width, int bpp)
 	return (l);
 }
 
-/* Endianness-aware byte shifts */
-#if G_BYTE_ORDER == G_LITTLE_ENDIAN
-#define SHIFTUP(X,N) (X) <<= ((N) << 3)
-#define SHIFTDN(X,N) (X) >>= ((N) << 3)
-#else /* G_BYTE_ORDER == G_BIG_ENDIAN */
-#define SHIFTUP(X,N) (X) >>= ((N) << 3)
-#define SHIFTDN(X,N) (X) <<= ((N) << 3)
-#endif
-
 /* Register-sized unsigned integer - redefine if this isn't it */
 #include <stdint.h>
 #define R_INT uintptr_t
 
-/* Integer-at-a-time byte array comparison function; its efficiency depends on
- * both arrays aligned, or misaligned, the same - which is natural for channel
- * strips when geometry and position match - WJ */
+/* Comparison goes in TILE_SIZE-byte columns, and stops for a column once it is
+ * found to differ, and for the strip once all columns do; rows get compared
+ * one at a time, so only rows which get read are ever touched */
+
+#ifdef SSE2_FUNC
+static SSE2_FUNC int tile_row_sse2(unsigned char *src, unsigned char *dest,
+	int n, unsigned char *buf)
+{
+	__m128i v, z = _mm_setzero_si128();
+	int j, k, nc = 0;
+
+	for (k = 0; k < n; k++ , src += TILE_SIZE , dest += TILE_SIZE)
+	{
+		if (buf[k]) continue;
+		v = z;
+		for (j = 0; j < TILE_SIZE; j += 16) v = _mm_or_si128(v,
+			_mm_xor_si128(_mm_loadu_si128((__m128i *)(src + j)),
+			_mm_loadu_si128((__m128i *)(dest + j))));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi8(v, z)) == 0xFFFF) continue;
+		buf[k] = 1;
+		nc++;
+	}
+	return (nc);
+}
+#endif
+
 static int tile_row_compare(unsigned char *src, unsigned char *dest,
 	int w, int h, unsigned char *buf)
 {
-	const int amask = sizeof(R_INT) - 1;
-	int l = w * h, mc = (w + TILE_SIZE - 1) >> TILE_SHIFT, nc = 0;
+	int i, k, n = w >> TILE_SHIFT, tl = w & (TILE_SIZE - 1);
+	int left, nc = 0;
 
-	/* Long enough & identically aligned - use fast path */
-	if ((w > sizeof(R_INT)) && (l > sizeof(R_INT) * 4) &&
-		(((int)src & amask) == ((int)dest & amask)))
-	{
-		R_INT v, vm, vt1, vt2, *isrc, *idest;
-		int i, k, t, x, d0, d1, il;
+	/* Columns already marked need not be compared */
+	for (left = k = n + !!tl; k > 0; k--) left -= !!buf[k - 1];
 
-		/* Given that loose ends, if any, belong to tiles too, we
-		 * simply leave them for later - maybe there won't be need */
-		d0 = (((int)src ^ amask) + 1) & amask;
-		d1 = (int)(src + l) & amask;
-		isrc = (R_INT *)(src + d0);
-		idest = (R_INT *)(dest + d0);
-		il = (l - d0 - d1) / sizeof(v);
-		i = 0;
-		while (TRUE)
+	for (i = 0; (i < h) && (nc < left); i++ , src += w , dest += w)
+	{
+#ifdef SSE2_FUNC
+		if (have_sse2()) nc += tile_row_sse2(src, dest, n, buf);
+		else
+#endif
+		for (k = 0; k < n; k++)
 		{
-			/* Fast comparison loop - damn GCC's guts for not
-			 * allocating it on registers without heavy wizardry */
-			{
-				int wi = il - i;
-				R_INT *wsrc = isrc + i, *wdest = idest + i;
-				while (TRUE)
-				{
-					if (wi-- <= 0) goto done;
-					if (*wsrc != *wdest) break;
-					++wsrc; ++wdest;
-				}
-				t = (unsigned char *)wsrc - src;
-			}
-			k = (unsigned int)t % w;
-			x = TILE_SIZE - (k & (TILE_SIZE - 1));
-			if (k + x > w) x = w - k;
-			k >>= TILE_SHIFT;
-
-			/* Value overlaps two or three tiles */
-			while (x < sizeof(v))
-			{
-				v = *(R_INT *)(src + t) ^ *(R_INT *)(dest + t);
-tile2:				vm = ~0UL;
-				SHIFTUP(vm, x);
-				x += sizeof(v);
-				if (!(vm &= v)) break;
-				x -= sizeof(v);
-
-				/* Farther tile(s) differ */
-				if ((v != vm) && !buf[k]) /* First one differs too */
-				{
-					buf[k] = 1;
-					if (++nc >= mc) x = l; /* Done is done */
-				}
-				if (++k + 1 == mc) /* May be 3 tiles */
-				{
-					x += w & (TILE_SIZE - 1);
-					if (x >= sizeof(v)) break;
-					v = vm;
-					goto tile2;
-				}
-				x += TILE_SIZE;
-				if (k == mc) k = 0; /* Row wrap */
-				break;
-			}
-			i = (t + x - d0) / sizeof(v);
-			if (buf[k]) continue;
+			if (buf[k] || !memcmp(src + (k << TILE_SHIFT),
+				dest + (k << TILE_SHIFT), TILE_SIZE)) continue;
 			buf[k] = 1;
-			if (++nc >= mc) break;
-		}
-done:
-		/* Compare the ends - using the fact that memory blocks
-		 * *must* be aligned at least that much */
-		if (d1 && !buf[mc - 1])
-		{
-			vt2 = isrc[il] ^ idest[il];
-			SHIFTUP(vt2, sizeof(vt2) - d1);
-			if (vt2) ++nc , buf[mc - 1] = 1;
+			nc++;
 		}
-		if (d0 && !buf[0])
+		/* Partial column */
+		if (!tl || buf[n] || !memcmp(src + (n << TILE_SHIFT),
+			dest + (n << TILE_SHIFT), tl)) continue;
+		buf[n] = 1;
+		nc++;
+	}
+	return (nc);
+}
+
+/* Undo tiles are stored as XOR with the image they will be applied to, which
+ * is zero wherever pixels did not change, and is the same for undo and redo.
+ * Runs of zeros get packed out: data is a sequence of (zeros, literals) length
+ * pairs, each followed by its literal bytes */
+
+#define ZRUN_MIN 4 /* Shortest zero run to end literals at */
+
+/* Nonzero if register-sized value has a zero byte */
+#define R_ONES ((R_INT)~0 / 255)
+#define R_ZBYTE(V) (((V) - R_ONES) & ~(V) & (R_ONES << 7))
+
+static unsigned char *zrun_putlen(unsigned char *dest, size_t n)
+{
+	for (; n > 0x7F; n >>= 7) *dest++ = (n & 0x7F) | 0x80;
+	*dest++ = n;
+	return (dest);
+}
+
+static size_t zrun_getlen(unsigned char **src)
+{
+	unsigned char *s = *src;
+	size_t n = 0;
+	int sh = 0;
+
+	while (*s & 0x80) n |= (size_t)(*s++ & 0x7F) << sh , sh += 7;
+	n |= (size_t)*s++ << sh;
+	*src = s;
+	return (n);
+}
+
+/* Pack l bytes, to at most l + l / 256 + 16 bytes; return packed length */
+static size_t zrun_pack(unsigned char *dest, unsigned char *src, size_t l)
+{
+	unsigned char *d = dest;
+	size_t i, z, n, k;
+
+	for (i = 0; i < l; i = n)
+	{
+		/* Zeros get skipped a word at a time once aligned */
+		for (z = i; (z < l) && !src[z] &&
+			((R_INT)(src + z) & (sizeof(R_INT) - 1)); z++);
+		while ((z + sizeof(R_INT) <= l) && !*(R_INT *)(src + z))
+			z += sizeof(R_INT);
+		for (; (z < l) && !src[z]; z++);
+		for (n = z; n < l; n++)
 		{
-			vt1 = *(isrc - 1) ^ *(idest - 1);
-			SHIFTDN(vt1, d0);
-			if (vt1) ++nc , buf[0] = 1;
+			/* Literals without zeros get skipped a word at a time */
+			if (!((R_INT)(src + n) & (sizeof(R_INT) - 1)))
+				while ((n + sizeof(R_INT) <= l) &&
+					!R_ZBYTE(*(R_INT *)(src + n)))
+					n += sizeof(R_INT);
+			if (n >= l) break;
+			if (src[n]) continue;
+			for (k = n + 1; (k < l) && !src[k] && (k - n < ZRUN_MIN); k++);
+			if ((k - n >= ZRUN_MIN) || (k >= l)) break;
+			n = k - 1;
 		}
+		d = zrun_putlen(d, z - i);
+		d = zrun_putlen(d, n - z);
+		memcpy(d, src + z, n - z);
+		d += n - z;
 	}
-	/* Misaligned - use slow path */
-	else
-	{
-		int i, k, x;
+	return (d - dest);
+}
 
-		for (i = 0; i < l; i++)
+typedef struct {
+	unsigned char *src;
+	size_t zeros, lits;
+} zrun_state;
+
+/* XOR next l bytes of unpacked data into dest */
+static void zrun_xor(zrun_state *zs, unsigned char *dest, int l)
+{
+	unsigned char *src;
+	size_t k;
+
+	while (l > 0)
+	{
+		if (zs->zeros)
 		{
-			if (src[i] != dest[i])
-			{
-				k = (unsigned int)i % w;
-				x = TILE_SIZE - (k & (TILE_SIZE - 1));
-				if (k + x > w) x = w - k;
-				i += x;
-				k >>= TILE_SHIFT;
-				if (buf[k]) continue;
-				buf[k] = 1;
-				if (++nc >= mc) break;
-			}
+			k = zs->zeros < l ? zs->zeros : l;
+			zs->zeros -= k;
+			dest += k; l -= k;
+		}
+		else if (zs->lits)
+		{
+			k = zs->lits < l ? zs->lits : l;
+			zs->lits -= k;
+			l -= k;
+			for (src = zs->src; k > 0; k--) *dest++ ^= *src++;
+			zs->src = src;
+		}
+		else
+		{
+			zs->zeros = zrun_getlen(&zs->src);
+			zs->lits = zrun_getlen(&zs->src);
 		}
 	}
-	return (nc);
 }
 
 /* Convert undo frame to tiled representation */
-static void mem_undo_tile(undo_item *undo)
+static void mem_undo_tile(undo_item *undo, unsigned char *dirty)
 {
 	unsigned char buf[((MAX_WIDTH + TILE_SIZE - 1) / TILE_SIZE) * 3];
 	unsigned char *tstrip, tmap[MAX_TILEMAP], *tmp = NULL;
+	unsigned char *blks[NUM_CHANNELS];
 	int spans[(MAX_WIDTH + TILE_SIZE - 1) / TILE_SIZE + 3];
 	size_t sz, area = 0, msize = 0;
 	int i, j, k, nt, dw, cc, bpp;
@@ -1267,6 +1454,9 @@ static void mem_undo_tile(undo_item *undo)
 
 		/* Compare strip of image */
 		memset(buf, 0, bw * 3);
+		/* Tiles not marked as dirty are known to be unchanged */
+		if (dirty) for (j = 0; j < bw; j++)
+			buf[j] = (dirty[tstrip - tmap + (j >> 3)] >> (j & 7)) & 1 ? 0 : 2;
 		for (cc = 0; nc >= 1 << cc; cc++)
 		{
 			unsigned char *src, *dest;
@@ -1278,7 +1468,12 @@ static void mem_undo_tile(undo_item *undo)
 			k = i * w;
 			src = undo->img[cc] + k;
 			dest = mem_img[cc] + k;
-			if (!tile_row_compare(src, dest, w, h, buf)) continue;
+			/* Spread the marks to all bytes of pixel */
+			if (dirty && (bpp == 3))
+				for (j = bw - 1 , j2 = j * 3; j >= 0; j-- , j2 -= 3)
+					buf[j2] = buf[j2 + 1] = buf[j2 + 2] = buf[j];
+			if (!tile_row_compare(src, dest, w, h, buf) && !dirty)
+				continue;
 			if (bpp == 1) continue;
 			/* 3 bpp happen only in image channel, which goes first;
 			 * so we can postprocess the results to match 1 bpp */
@@ -1288,11 +1483,11 @@ static void mem_undo_tile(undo_item *undo)
 		/* Fill tilemap row */
 		for (j = nt = 0; j < bw; j++)
 		{
-			nt += (k = buf[j]);
+			nt += (k = buf[j] & 1);
 			tstrip[j >> 3] |= k << (j & 7);
 		}
 		ntiles += nt;
-		area += (nt * TILE_SIZE - buf[bw - 1] * dw) * h;
+		area += (nt * TILE_SIZE - (buf[bw - 1] & 1) * dw) * h;
 	}
 
 	/* Not tileable if tilemap cannot fit in space gained */
@@ -1300,11 +1495,27 @@ static void mem_undo_tile(undo_item *undo)
 	bpp = (nc & CMASK_IMAGE ? mem_img_bpp : 1);
 	if ((sz - area) * bpp <= tsz) return;
 
+	/* Get space for packed channels first, to not fail halfway */
+	memset(blks, 0, sizeof(blks));
+	for (cc = 0; ntiles && (nc >= 1 << cc); cc++)
+	{
+		size_t l;
+
+		if (!(nc & 1 << cc)) continue;
+		l = area * BPP(cc);
+		l += (l >> 8) + 16 + (tmp ? 0 : tsz);
+		if (!(tmp = blks[cc] = malloc(l)))
+		{
+			for (i = 0; i < cc; i++) free(blks[i]);
+			return;
+		}
+	}
+
 	/* Implement tiling */
-	sz = (size_t)mem_width * mem_height;
+	tmp = NULL;
 	for (cc = 0; nc >= 1 << cc; cc++)
 	{
-		unsigned char *src, *dest, *blk;
+		unsigned char *src, *dest, *cur, *blk;
 		size_t l;
 		int i;
 
@@ -1316,23 +1527,13 @@ static void mem_undo_tile(undo_item *undo)
 			continue;
 		}
 
-		/* Try to reduce memory fragmentation - allocate small blocks
-		 * anew when possible, instead of carving up huge ones */
-		src = blk = undo->img[cc];
+		/* Difference of changed tiles to image, collected in place */
+		src = dest = undo->img[cc];
+		cur = mem_img[cc];
 		bpp = BPP(cc);
-		l = area * bpp + (tmp ? 0 : tsz);
-		if (l * 3 <= sz * bpp) /* Small enough */
-		{
-			blk = malloc(l);
-			/* Use original chunk if cannot get new one */
-			if (!blk) blk = src;
-		}
-		dest = blk;
-
-		/* Compress channel */
 		for (i = 0; i < nstrips; i++)
 		{
-			int j, k, *span;
+			int j, k, n, *span;
 
 			mem_undo_spans(spans, tmap + tw * i, mem_width, bpp);
 			k = mem_height - i * TILE_SIZE;
@@ -1342,31 +1543,28 @@ static void mem_undo_tile(undo_item *undo)
 				span = spans;
 				while (TRUE)
 				{
-					src += *span++;
+					src += *span; cur += *span++;
 					if (!*span) break;
-					if (dest != src) memmove(dest, src, *span);
-					src += *span; dest += *span++;
+					for (n = *span++; n > 0; n--)
+						*dest++ = *src++ ^ *cur++;
 				}
 			}
 		}
 
-		/* Resize or free memory block */
-		if (blk == undo->img[cc]) /* Resize old */
-		{
-			dest = realloc(undo->img[cc], l);
-			/* Leave chunk alone if resizing failed */
-			if (!dest) l = sz * bpp;
-			else undo->img[cc] = dest;
-		}
-		else /* Replace with new */
-		{
-			free(undo->img[cc]);
-			undo->img[cc] = blk;
-		}
+		/* Pack it, and let go of the original chunk */
+		blk = blks[cc];
+		l = zrun_pack(blk, undo->img[cc], area * bpp);
+		free(undo->img[cc]);
+		dest = realloc(blk, l + (tmp ? 0 : tsz));
+		undo->img[cc] = dest ? dest : blk;
 		msize += l + 32;
 
 		/* Place tilemap in first chunk */
-		if (!tmp) tmp = undo->img[cc] + area * bpp;
+		if (!tmp)
+		{
+			tmp = undo->img[cc] + l;
+			msize += tsz;
+		}
 	}
 
 	/* Re-label as tiled and store tilemap, if there *are* tiles */
@@ -1382,114 +1580,662 @@ static void mem_undo_tile(undo_item *undo)
 	undo->flags |= UF_SIZED;
 }
 
-/* Compress last undo frame */
-void mem_undo_prepare()
+/* Frames made with UC_COW share channels with the image, and save original
+ * contents of a tile only before it gets changed; the tiles are kept in an
+ * array of pointers in place of tilemap, all channels together per tile */
+
+#define COW_SAVE 0 /* Copy image to tile */
+#define COW_LOAD 1 /* Copy tile to image */
+#define COW_DIFF 2 /* XOR image into tile, report if any difference */
+
+static int cow_tile(undo_item *undo, chanlist img, unsigned char *blk, int k,
+	int mode)
 {
-	undo_item *undo;
+	unsigned char *src;
+	size_t l, ww;
+	int i, j, n, bw, x, y, w, h, bpp = undo->bpp, res = 0;
+
+	bw = (undo->width + TILE_SIZE - 1) / TILE_SIZE;
+	x = (k % bw) * TILE_SIZE;
+	y = (k / bw) * TILE_SIZE;
+	w = undo->width - x;
+	if (w > TILE_SIZE) w = TILE_SIZE;
+	h = undo->height - y;
+	if (h > TILE_SIZE) h = TILE_SIZE;
+	for (i = 0; i < NUM_CHANNELS; i++ , bpp = 1)
+	{
+		if (!undo->img[i] || (undo->img[i] == (void *)(-1))) continue;
+		ww = (size_t)undo->width * bpp;
+		src = img[i] + y * ww + x * bpp;
+		l = w * bpp;
+		for (j = 0; j < h; j++ , src += ww , blk += l)
+		{
+			if (mode == COW_SAVE) memcpy(blk, src, l);
+			else if (mode == COW_LOAD) memcpy(src, blk, l);
+			else for (n = 0; n < l; n++) res |= blk[n] ^= src[n];
+		}
+	}
+	return (res);
+}
 
-	if (!mem_undo_done) return;
-	undo = mem_undo_im_[(mem_undo_pointer ? mem_undo_pointer : mem_undo_max) - 1];
+/* Space for one saved tile */
+static size_t cow_size(undo_item *undo)
+{
+	size_t l = 0;
+	int i, bpp = undo->bpp;
 
-	/* Already processed? */
-	if (undo->flags & (UF_TILED | UF_FLAT)) return;
+	for (i = 0; i < NUM_CHANNELS; i++ , bpp = 1)
+		if (undo->img[i] && (undo->img[i] != (void *)(-1))) l += bpp;
+	return (l * TILE_SIZE * TILE_SIZE);
+}
 
-	/* Cull palette if unchanged */
-	if (undo->pal_ && !memcmp(undo->pal_, mem_pal, SIZEOF_PALETTE))
+/* Allocate memory for the last undo frame, releasing older ones if needed;
+ * fail if the frame itself got released */
+static void *undo_try_malloc(undo_item *undo, size_t size)
+{
+	void *ptr = mem_try_malloc(size);
+
+	if (ptr && (!mem_undo_done || (undo != mem_undo_im_[(mem_undo_pointer ?
+		mem_undo_pointer : mem_undo_max) - 1])))
 	{
-		/* Free new block, reuse old */
-		free(mem_undo_im_[mem_undo_pointer]->pal_);
-		mem_undo_im_[mem_undo_pointer]->pal_ = undo->pal_;
-		undo->pal_ = NULL;
+		free(ptr);
+		ptr = NULL;
 	}
-	/* Tile image */
-	mem_undo_tile(undo);
+	return (ptr);
 }
 
-static size_t mem_undo_size(undo_stack *ustack)
+/* Give frame its own copies of the channels, with map of changed tiles */
+static int undo_cow_flatten(undo_item *undo)
 {
-	undo_item *undo;
-	size_t k, l, total = 0;
-	int i, j, bpp, umax = ustack->max;
+	unsigned char **tiles = (void *)undo->tileptr, *tmap;
+	chanlist img;
+	size_t sz = (size_t)undo->width * undo->height;
+	int i, k, bw, tw, nt, nstrips, bpp = undo->bpp;
 
-	for (i = 0; i < umax; i++)
+	memset(img, 0, sizeof(chanlist));
+	for (i = 0; i < NUM_CHANNELS; i++ , bpp = 1)
 	{
-		/* Anything there? */
-		if (!(undo = ustack->items[i])) continue;
-		/* Not empty and not yet scanned */
-		if (undo->width && !(undo->flags & UF_SIZED))
+		if (!undo->img[i] || (undo->img[i] == (void *)(-1))) continue;
+		if (!(img[i] = undo_try_malloc(undo, sz * bpp)))
 		{
-			k = (size_t)undo->width * undo->height;
-			bpp = undo->bpp;
-			for (j = l = 0; j < NUM_CHANNELS; j++)
-			{
-				if (undo->img[j] && (undo->img[j] != (void *)(-1)))
-					l += k * bpp + 32;
-				bpp = 1;
-			}
-			if (undo->pal_) l += SIZEOF_PALETTE + 32;
-			undo->size = l;
-			undo->flags |= UF_SIZED;
+			mem_free_chanlist(img);
+			return (FALSE);
 		}
-		total += undo->size;
+		memcpy(img[i], undo->img[i], sz * bpp);
 	}
 
-	return (total);
-}
-
-/* Add up sizes of all layers other than current */
-static size_t mem_undo_lsize()
-{
-	undo_stack *ustack;
-	size_t total = 0;
-	int l;
-
-	for (l = 0; l <= layers_total; l++)
+	bw = (undo->width + TILE_SIZE - 1) / TILE_SIZE;
+	nstrips = (undo->height + TILE_SIZE - 1) / TILE_SIZE;
+	tw = (bw + 7) >> 3;
+	nt = bw * nstrips;
+	/* If no memory for the map, all image gets compared anyway */
+	tmap = calloc(tw, nstrips);
+	for (k = 0; k < nt; k++)
 	{
-		if (l == layer_selected) continue;
-		ustack = &layer_table[l].image->image_.undo_;
-// !!! This relies on layer_table items already processed by update_undo()
-		if (!ustack->size) ustack->size = mem_undo_size(ustack);
-		total += ustack->size;
+		if (!tiles[k]) continue;
+		cow_tile(undo, img, tiles[k], k, COW_LOAD);
+		if (tmap) tmap[(k / bw) * tw + ((k % bw) >> 3)] |= 1 << (k % bw & 7);
 	}
+	undo_free_cow(undo);
 
-	return (total);
+	for (i = 0; i < NUM_CHANNELS; i++)
+		if (img[i]) undo->img[i] = img[i];
+	undo->tileptr = tmap;
+	undo->flags = (undo->flags & ~UF_SIZED) | UF_DIRTY;
+	return (TRUE);
 }
 
-/* Free requested amount of undo space */
-static int mem_undo_space(size_t mem_req)
+/* Convert copy-on-write frame to tiled representation */
+static void mem_undo_cow_tile(undo_item *undo)
 {
-	undo_stack *heap[MAX_LAYERS + 2], *wp, *hp;
-	size_t mem_r, mem_lim, mem_max = (size_t)mem_undo_limit * (1024 * 1024);
-	int i, l, l2, h, csz = mem_undo_common * layers_total;
-	
-	/* Layer mem limit including common area */
-	mem_lim = mem_max * (csz * 0.01 + 1) / (layers_total + 1);
+	unsigned char **tiles = (void *)undo->tileptr, *tmap = NULL, *buf;
+	unsigned char *blks[NUM_CHANNELS], *tmp = NULL;
+	size_t l, area = 0, msize = 0;
+	int i, j, k, y, h, w, cc, bpp, bw, tw, tsz, nt, nstrips, ntiles = 0;
 
-	/* Fail if hopeless */
-	if (mem_req > mem_lim) return (2);
 
-	/* Layer mem limit exceeded - drop oldest */
-	mem_r = mem_req + mem_undo_size(&mem_image.undo_);
-	while (mem_r > mem_lim)
+	bw = (undo->width + TILE_SIZE - 1) / TILE_SIZE;
+	nstrips = (undo->height + TILE_SIZE - 1) / TILE_SIZE;
+	tw = (bw + 7) >> 3; tsz = tw * nstrips;
+	nt = bw * nstrips;
+
+	/* Turn saved tiles into differences, dropping unchanged ones */
+	for (k = 0; k < nt; k++)
 	{
-		if (!mem_undo_done) return (1);
-		mem_r -= lose_oldest(&mem_image.undo_);
+		if (!tiles[k]) continue;
+		if (cow_tile(undo, undo->img, tiles[k], k, COW_DIFF))
+		{
+			w = undo->width - (k % bw) * TILE_SIZE;
+			h = undo->height - (k / bw) * TILE_SIZE;
+			area += (w < TILE_SIZE ? w : TILE_SIZE) *
+				(h < TILE_SIZE ? h : TILE_SIZE);
+			ntiles++;
+			continue;
+		}
+		free(tiles[k]);
+		tiles[k] = NULL;
 	}
-	/* All done if no common area */
-	if (!csz) return (0);
-
-	mem_r += mem_undo_lsize();
-	if (mem_r <= mem_max) return (0); // No need to trim other layers yet
-	mem_lim -= mem_max * (mem_undo_common * 0.01); // Reserved space per layer
 
-	/* Build heap of undo stacks */
+	/* Get space for packed channels and a strip of tiles, with tilemap
+	 * going after the first channel */
+	memset(blks, 0, sizeof(blks));
+	buf = NULL;
+	if (ntiles)
+	{
+		bpp = undo->bpp;
+		for (cc = 0; cc < NUM_CHANNELS; cc++ , bpp = 1)
+		{
+			if (!undo->img[cc] || (undo->img[cc] == (void *)(-1)))
+				continue;
+			l = area * bpp;
+			l += (l >> 8) + 16 * nstrips + (tmp ? 0 : tsz);
+			if (!(tmp = blks[cc] = undo_try_malloc(undo, l))) break;
+		}
+		if (tmp) tmp = buf = undo_try_malloc(undo,
+			(size_t)TILE_SIZE * undo->width * undo->bpp);
+		if (!tmp) /* Frame was released to get memory */
+		{
+			for (cc = 0; cc < NUM_CHANNELS; cc++) free(blks[cc]);
+			return;
+		}
+	}
+
+	/* Pack each channel a strip at a time */
+	tmp = NULL;
+	bpp = undo->bpp;
+	for (cc = 0; cc < NUM_CHANNELS; cc++ , bpp = 1)
+	{
+		unsigned char *dest, *blk;
+		size_t ofs;
+		int n;
+
+		if (!undo->img[cc] || (undo->img[cc] == (void *)(-1))) continue;
+		if (!ntiles) /* Channels unchanged */
+		{
+			undo->img[cc] = (void *)(-1);
+			continue;
+		}
+
+		/* Offset of channel in tile data */
+		for (i = ofs = 0; i < cc; i++)
+			if (undo->img[i] && (undo->img[i] != (void *)(-1)))
+				ofs += i ? 1 : undo->bpp;
+
+		blk = dest = blks[cc];
+		for (i = 0; i < nstrips; i++)
+		{
+			unsigned char *d = buf;
+
+			h = undo->height - i * TILE_SIZE;
+			if (h > TILE_SIZE) h = TILE_SIZE;
+			for (y = 0; y < h; y++)
+			for (j = 0; j < bw; j++)
+			{
+				if (!(tmp = tiles[i * bw + j])) continue;
+				w = undo->width - j * TILE_SIZE;
+				if (w > TILE_SIZE) w = TILE_SIZE;
+				n = w * bpp;
+				memcpy(d, tmp + ofs * w * h + y * n, n);
+				d += n;
+			}
+			dest += zrun_pack(dest, buf, d - buf);
+		}
+
+		/* Shrink the chunk to fit */
+		l = dest - blk;
+		dest = realloc(blk, l + (msize ? 0 : tsz));
+		undo->img[cc] = dest ? dest : blk;
+		if (!msize) tmap = undo->img[cc] + l , msize += tsz;
+		msize += l + 32;
+	}
+	free(buf);
+
+	/* Build tilemap, and let go of the tiles */
+	if (msize)
+	{
+		memset(tmap, 0, tsz);
+		for (k = 0; k < nt; k++)
+			if (tiles[k]) tmap[(k / bw) * tw + ((k % bw) >> 3)] |=
+				1 << (k % bw & 7);
+	}
+	undo_free_cow(undo);
+
+	if (msize)
+	{
+		undo->flags |= UF_TILED;
+		undo->tileptr = tmap;
+	}
+	else undo->flags |= UF_FLAT;
+	if (undo->pal_) msize += SIZEOF_PALETTE + 32;
+	undo->size = msize;
+	undo->flags |= UF_SIZED;
+}
+
+/* Mark area as about to change since last undo frame; if the frame was
+ * started with UNDO_TRACK, only tiles marked get compared when it gets tiled.
+ * Must be called before the change, as tiles may need saving first */
+void mem_undo_dirty(int x, int y, int w, int h)
+{
+	undo_item *undo;
+	unsigned char *tmap, **tiles, *blk;
+	size_t l;
+	int i, j, k, bw, x1 = x + w, y1 = y + h;
+
+	if (!mem_undo_done) return;
+	undo = mem_undo_im_[(mem_undo_pointer ? mem_undo_pointer : mem_undo_max) - 1];
+
+	/* Not tracked, or already processed? */
+	if (!(undo->flags & (UF_DIRTY | UF_COW)) ||
+		(undo->flags & (UF_TILED | UF_FLAT))) return;
+	if (!(tmap = undo->tileptr)) return;
+
+	if (x < 0) x = 0;
+	if (y < 0) y = 0;
+	if (x1 > undo->width) x1 = undo->width;
+	if (y1 > undo->height) y1 = undo->height;
+	if ((x >= x1) || (y >= y1)) return;
+	bw = (undo->width + TILE_SIZE - 1) / TILE_SIZE;
+	x >>= TILE_SHIFT; x1 = (x1 - 1) >> TILE_SHIFT;
+	y >>= TILE_SHIFT; y1 = (y1 - 1) >> TILE_SHIFT;
+
+	if (!(undo->flags & UF_COW))
+	{
+		bw = (bw + 7) >> 3;
+		for (i = y; i <= y1; i++)
+		for (j = x; j <= x1; j++)
+			tmap[i * bw + (j >> 3)] |= 1 << (j & 7);
+		return;
+	}
+
+	/* Save tiles not yet saved */
+	tiles = (void *)tmap;
+	l = cow_size(undo);
+	for (i = y; i <= y1; i++)
+	for (j = x; j <= x1; j++)
+	{
+		if (tiles[k = i * bw + j]) continue;
+		/* The changes won't be undoable if it fails */
+		if (!(blk = undo_try_malloc(undo, l))) return;
+		cow_tile(undo, undo->img, tiles[k] = blk, k, COW_SAVE);
+		undo->size += l + 32;
+	}
+}
+
+/* Start or stop tracking changes to last undo frame */
+static void undo_track(int track, int old_pointer)
+{
+	undo_item *undo;
+
+	if (!mem_undo_done) return;
+	undo = mem_undo_im_[(mem_undo_pointer ? mem_undo_pointer : mem_undo_max) - 1];
+	if (undo->flags & (UF_TILED | UF_FLAT)) return; // Failed to get a frame
+
+	/* New frame - track if asked to */
+	if (mem_undo_pointer != old_pointer)
+	{
+		if (!track || (undo->flags & UF_COW)) return;
+		/* If no memory for the map, all image gets compared anyway */
+		undo->tileptr = calloc(((undo->width + TILE_SIZE - 1) /
+			TILE_SIZE + 7) >> 3, (undo->height + TILE_SIZE - 1) /
+			TILE_SIZE);
+		undo->flags |= UF_DIRTY;
+	}
+	/* Continued frame - stop tracking if changes won't be marked */
+	else if (!track)
+	{
+		/* Shared channels need own copies now - if frame survives */
+		if ((undo->flags & UF_COW) && !undo_cow_flatten(undo)) return;
+		if (undo->flags & UF_DIRTY)
+		{
+			free(undo->tileptr);
+			undo->tileptr = NULL;
+		}
+	}
+}
+
+#ifdef U_DEBUG
+/* Report changed tiles which weren't marked by mem_undo_dirty() */
+static void undo_check_dirty(undo_item *undo, unsigned char *dirty)
+{
+	unsigned char *src, *dest;
+	size_t ww;
+	int i, j, k, x, y, w, h, cc, bw, tw, nstrips, bpp;
+
+	if ((undo->width != mem_width) || (undo->height != mem_height) ||
+		(undo->bpp != mem_img_bpp)) return;
+	bw = (mem_width + TILE_SIZE - 1) / TILE_SIZE;
+	nstrips = (mem_height + TILE_SIZE - 1) / TILE_SIZE;
+	tw = (bw + 7) >> 3;
+	for (i = 0; i < nstrips; i++)
+	for (j = 0; j < bw; j++)
+	{
+		if ((dirty[i * tw + (j >> 3)] >> (j & 7)) & 1) continue;
+		x = j * TILE_SIZE;
+		y = i * TILE_SIZE;
+		w = mem_width - x;
+		if (w > TILE_SIZE) w = TILE_SIZE;
+		h = mem_height - y;
+		if (h > TILE_SIZE) h = TILE_SIZE;
+		bpp = mem_img_bpp;
+		for (cc = 0; cc < NUM_CHANNELS; cc++ , bpp = 1)
+		{
+			if (!undo->img[cc] || !mem_img[cc] ||
+				(undo->img[cc] == (void *)(-1))) continue;
+			ww = (size_t)mem_width * bpp;
+			src = undo->img[cc] + y * ww + x * bpp;
+			dest = mem_img[cc] + y * ww + x * bpp;
+			for (k = 0; k < h; k++ , src += ww , dest += ww)
+				if (memcmp(src, dest, w * bpp)) break;
+			if (k < h) fprintf(stderr, "Undo: unmarked change in "
+				"channel %d, tile at %d,%d\n", cc, x, y);
+		}
+	}
+}
+#endif
+
+/* Compress last undo frame */
+void mem_undo_prepare()
+{
+	undo_item *undo;
+	unsigned char *dirty;
+
+	if (!mem_undo_done) return;
+	undo = mem_undo_im_[(mem_undo_pointer ? mem_undo_pointer : mem_undo_max) - 1];
+
+	/* Already processed? */
+	if (undo->flags & (UF_TILED | UF_FLAT)) return;
+
+	/* Cull palette if unchanged */
+	if (undo->pal_ && !memcmp(undo->pal_, mem_pal, SIZEOF_PALETTE))
+	{
+		/* Free new block, reuse old */
+		free(mem_undo_im_[mem_undo_pointer]->pal_);
+		mem_undo_im_[mem_undo_pointer]->pal_ = undo->pal_;
+		undo->pal_ = NULL;
+	}
+	/* Tile image */
+	if (undo->flags & UF_COW)
+	{
+		mem_undo_cow_tile(undo);
+		return;
+	}
+	dirty = undo->flags & UF_DIRTY ? undo->tileptr : NULL;
+	undo->flags &= ~UF_DIRTY;
+	undo->tileptr = NULL;
+#ifdef U_DEBUG
+	if (dirty) undo_check_dirty(undo, dirty);
+#endif
+	mem_undo_tile(undo, dirty);
+	free(dirty);
+}
+
+static size_t mem_undo_size(undo_stack *ustack)
+{
+	undo_item *undo;
+	size_t k, l, total = 0;
+	int i, j, bpp, umax = ustack->max;
+
+	for (i = 0; i < umax; i++)
+	{
+		/* Anything there? */
+		if (!(undo = ustack->items[i])) continue;
+		/* Not empty and not yet scanned */
+		if (undo->width && !(undo->flags & UF_SIZED))
+		{
+			k = (size_t)undo->width * undo->height;
+			bpp = undo->bpp;
+			for (j = l = 0; j < NUM_CHANNELS; j++)
+			{
+				if (undo->img[j] && (undo->img[j] != (void *)(-1)))
+					l += k * bpp + 32;
+				bpp = 1;
+			}
+			if (undo->pal_) l += SIZEOF_PALETTE + 32;
+			undo->size = l;
+			undo->flags |= UF_SIZED;
+		}
+		total += undo->size;
+	}
+
+	return (total);
+}
+
+/* Add up sizes of all layers other than current */
+static size_t mem_undo_lsize()
+{
+	undo_stack *ustack;
+	size_t total = 0;
+	int l;
+
+	for (l = 0; l <= layers_total; l++)
+	{
+		if (l == layer_selected) continue;
+		ustack = &layer_table[l].image->image_.undo_;
+// !!! This relies on layer_table items already processed by update_undo()
+		if (!ustack->size) ustack->size = mem_undo_size(ustack);
+		total += ustack->size;
+	}
+
+	return (total);
+}
+
+/* Get length of packed channel data of tiled undo frame */
+static size_t undo_tiled_len(undo_item *undo, unsigned char *src, int bpp)
+{
+	int spans[(MAX_WIDTH + TILE_SIZE - 1) / TILE_SIZE + 3];
+	unsigned char *tmap = undo->tileptr, *s = src;
+	size_t l = 0, z, n;
+	int i, h, nw = ((undo->width + TILE_SIZE - 1) / TILE_SIZE + 7) >> 3;
+
+	for (i = 0; i < undo->height; i += TILE_SIZE , tmap += nw)
+	{
+		h = undo->height - i;
+		if (h > TILE_SIZE) h = TILE_SIZE;
+		l += (size_t)mem_undo_spans(spans, tmap, undo->width, bpp) * h;
+	}
+	while (l > 0)
+	{
+		z = zrun_getlen(&s);
+		n = zrun_getlen(&s);
+		s += n;
+		l -= z + n;
+	}
+	return (s - src);
+}
+
+/* Move undo frame's data into scratch file */
+static int undo_spill(undo_item *undo)
+{
+	spill_item *sp;
+	unsigned char *img, *first = NULL;
+	size_t l, total = 0;
+	off_t ofs;
+	int i, bpp;
+
+	if (spill_fd < 0)
+	{
+		if (spill_fail) return (FALSE);
+		if ((spill_fd = temp_scratch()) < 0)
+		{
+			spill_fail = TRUE;
+			return (FALSE);
+		}
+	}
+	if (!(sp = calloc(1, sizeof(spill_item)))) return (FALSE);
+
+	/* Measure the chunks; tilemap is stored after the first one */
+	bpp = undo->bpp;
+	for (i = 0; i < NUM_CHANNELS; i++ , bpp = 1)
+	{
+		img = undo->img[i];
+		if (!img || (img == (void *)(-1))) continue;
+		if (!(undo->flags & UF_TILED))
+			l = (size_t)undo->width * undo->height * bpp;
+		else
+		{
+			l = undo_tiled_len(undo, img, bpp);
+			if (!first)
+			{
+				sp->tileofs = l;
+				l += ((undo->width + TILE_SIZE - 1) / TILE_SIZE + 7) /
+					8 * ((undo->height + TILE_SIZE - 1) / TILE_SIZE);
+			}
+		}
+		if (!first) first = img;
+		total += sp->len[i] = l;
+	}
+	if ((sp->pal = !!undo->pal_)) total += SIZEOF_PALETTE;
+
+	/* Write them out */
+	if (!spill_alloc(&sp->ext, total)) goto fail;
+	ofs = sp->ext.ofs;
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!(l = sp->len[i])) continue;
+		if (!spill_io(ofs, undo->img[i], l, TRUE)) goto fail2;
+		ofs += l;
+	}
+	if (sp->pal && !spill_io(ofs, (void *)undo->pal_, SIZEOF_PALETTE, TRUE))
+		goto fail2;
+
+	/* Let go of memory */
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!sp->len[i]) continue;
+		free(undo->img[i]);
+		undo->img[i] = NULL;
+	}
+	free(undo->pal_);
+	undo->pal_ = NULL;
+	undo->tileptr = NULL;
+	undo->spillptr = sp;
+	undo->size = 0;
+	undo->flags |= UF_DISK | UF_SIZED;
+	return (TRUE);
+
+fail2:	spill_release(&sp->ext);
+fail:	free(sp);
+	return (FALSE);
+}
+
+/* Get undo frame's data back from scratch file */
+static int undo_unspill(undo_item *undo)
+{
+	spill_item *sp = undo->spillptr;
+	chanlist img;
+	png_color *pal = NULL;
+	off_t ofs = sp->ext.ofs;
+	size_t l, res = 0;
+	int i, first = -1;
+
+	memset(img, 0, sizeof(chanlist));
+	if (sp->pal && !(pal = malloc(SIZEOF_PALETTE))) return (FALSE);
+	for (i = 0; i < NUM_CHANNELS; i++)
+	{
+		if (!(l = sp->len[i])) continue;
+		if (!(img[i] = malloc(l)) || !spill_io(ofs, img[i], l, FALSE))
+			goto fail;
+		if (first < 0) first = i;
+		ofs += l;
+		res += l + 32;
+	}
+	if (pal && !spill_io(ofs, (void *)pal, SIZEOF_PALETTE, FALSE)) goto fail;
+
+	/* Put data back into frame */
+	for (i = 0; i < NUM_CHANNELS; i++)
+		if (img[i]) undo->img[i] = img[i];
+	if (undo->flags & UF_TILED) undo->tileptr = img[first] + sp->tileofs;
+	if ((undo->pal_ = pal)) res += SIZEOF_PALETTE + 32;
+	undo->size = res;
+	undo_free_spill(undo);
+	return (TRUE);
+
+fail:	free(pal);
+	for (i = 0; i < NUM_CHANNELS; i++) free(img[i]);
+	return (FALSE);
+}
+
+/* Frames moved to disk hold no memory, so dropping them is of use only to get
+ * to the ones which do */
+static int undo_in_memory(undo_stack *ustack)
+{
+	int i;
+
+	for (i = -ustack->done; i <= ustack->redo; i++)
+	{
+		if (!i) continue;
+		if (!(ustack->items[(ustack->pointer + ustack->max + i) %
+			ustack->max]->flags & UF_DISK)) return (TRUE);
+	}
+	return (FALSE);
+}
+
+static size_t lose_oldest(undo_stack *ustack)	// Lose the oldest undo image
+{
+	undo_item *undo;
+	size_t res;
+	int i, idx;
+
+	if (ustack->redo > ustack->done) idx = ustack->redo--;
+	else if (ustack->done)
+	{
+		/* Move oldest frame left in memory to disk, if possible */
+		for (i = ustack->done; mem_undo_disk && (i > 0); i--)
+		{
+			undo = ustack->items[(ustack->pointer + ustack->max - i) %
+				ustack->max];
+			if (undo->flags & UF_DISK) continue;
+			/* Cannot move frames not yet processed */
+			if (!(undo->flags & (UF_TILED | UF_FLAT))) break;
+			res = undo->size;
+			if (undo_spill(undo)) return (res);
+			break;
+		}
+		idx = ustack->max - ustack->done--;
+	}
+	else return (0);
+/* !!! mem_try_malloc() may call this on an unsized undo stack - but it
+ * !!! doesn't need valid sizes anyway - WJ */
+	return (undo_free_x(ustack->items + (ustack->pointer + idx) % ustack->max));
+}
+
+/* Free requested amount of undo space */
+static int mem_undo_space(size_t mem_req)
+{
+	undo_stack *heap[MAX_LAYERS + 2], *wp, *hp;
+	size_t mem_r, mem_lim, mem_max = (size_t)mem_undo_limit * (1024 * 1024);
+	int i, l, l2, h, csz = mem_undo_common * layers_total;
+	
+	/* Layer mem limit including common area */
+	mem_lim = mem_max * (csz * 0.01 + 1) / (layers_total + 1);
+
+	/* Fail if hopeless */
+	if (mem_req > mem_lim) return (2);
+
+	/* Layer mem limit exceeded - drop oldest */
+	mem_r = mem_req + mem_undo_size(&mem_image.undo_);
+	while (mem_r > mem_lim)
+	{
+		if (!mem_undo_done) return (1);
+		// Only frames on disk left - dropping them frees nothing
+		if (!undo_in_memory(&mem_image.undo_)) break;
+		mem_r -= lose_oldest(&mem_image.undo_);
+	}
+	/* All done if no common area */
+	if (!csz) return (0);
+
+	mem_r += mem_undo_lsize();
+	if (mem_r <= mem_max) return (0); // No need to trim other layers yet
+	mem_lim -= mem_max * (mem_undo_common * 0.01); // Reserved space per layer
+
+	/* Build heap of undo stacks */
 	for (i = h = 0; i <= layers_total; i++)
 	{
 		// Skip current layer
 		if (i == layer_selected) continue;
 		wp = &layer_table[i].image->image_.undo_;
-		// Skip layers without extra frames
-		if (!(wp->done + wp->redo)) continue;
+		// Skip layers without extra frames in memory
+		if (!undo_in_memory(wp)) continue;
 		// Skip layers under the memory limit
 		if (wp->size <= mem_lim) continue;
 		// Put undo stack onto heap
@@ -1515,7 +2261,7 @@ static int mem_undo_space(size_t mem_req)
 			wp->size -= res; // Maintain undo stack size
 			mem_r -= res;
 			if (mem_r <= mem_max) return (0);
-			if (!(wp->done + wp->redo) || (wp->size <= mem_lim))
+			if (!undo_in_memory(wp) || (wp->size <= mem_lim))
 				wp = heap[h--];
 			else if (wp->size >= mem_nx) continue;
 			break;
@@ -1542,7 +2288,8 @@ void *mem_try_malloc(size_t size)
 	while (!((ptr = malloc(size))))
 	{
 // !!! Hardcoded to work with mem_image for now
-		if (!mem_undo_done) return (NULL);
+		if (!mem_undo_done || !undo_in_memory(&mem_image.undo_))
+			return (NULL);
 		lose_oldest(&mem_image.undo_);
 	}
 	return (ptr);
@@ -1552,13 +2299,14 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 {
 	png_color *newpal;
 	undo_item *undo;
-	unsigned char *img;
+	unsigned char *img, **tiles = NULL;
 	void *tempfiles = mem_tempfiles;
 	chanlist holder, frame;
 	size_t mem_req, mem_lim, wh;
-	int i, j, k, need_frame;
+	int i, j, k, nt = 0, need_frame;
 
 
+	undo_stamp++;
 	if (pen_down && (mode & UC_PENDOWN)) return (0);
 	pen_down = mode & UC_PENDOWN ? 1 : 0;
 
@@ -1593,6 +2341,13 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 	/* Compress last undo frame */
 	mem_undo_prepare();
 
+	/* Channels can stay shared, with tiles saved as they change */
+	if ((mode & UC_COW) && (new_width == mem_width) &&
+		(new_height == mem_height) && (new_bpp == mem_img_bpp) &&
+		(mem_width + mem_height >= TILE_SIZE * 3))
+		nt = ((mem_width + TILE_SIZE - 1) / TILE_SIZE) *
+			((mem_height + TILE_SIZE - 1) / TILE_SIZE);
+
 	/* Calculate memory requirements */
 	mem_req = SIZEOF_PALETTE + 32;
 	wh = (size_t)new_width * new_height;
@@ -1604,7 +2359,8 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 				(mode & (UC_CREATE | UC_RESET)))) j++;
 		}
 		if (cmask & CMASK_IMAGE) j += new_bpp - 1;
-		mem_req += (wh + 32) * j;
+		if (!j) nt = 0;
+		mem_req += nt ? nt * sizeof(*tiles) : (wh + 32) * j;
 // !!! Must be after update_undo() to get used memory right
 		if (mem_undo_space(mem_req)) return (2);
 	}
@@ -1624,6 +2380,11 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 	/* Allocate new palette */
 	newpal = mem_try_malloc(SIZEOF_PALETTE);
 	if (!newpal) return (1);
+	if (nt && !(tiles = calloc(nt, sizeof(*tiles))))
+	{
+		free(newpal);
+		return (1);
+	}
 
 	/* Duplicate affected channels */
 	for (i = 0; i < NUM_CHANNELS; i++)
@@ -1640,6 +2401,7 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 			continue;
 		}
 		if (!img && !(mode & (UC_CREATE | UC_RESET))) continue;
+		if (tiles) continue; // Shared
 		mem_lim = i == CHN_IMAGE ? wh * new_bpp : wh;
 		img = mem_try_malloc(mem_lim);
 		if (!img) /* Release memory and fail */
@@ -1665,6 +2427,13 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 	/* Commit */
 	if (tempfiles) undo_add_data(undo, UD_TEMPFILES, tempfiles);
 	memcpy(undo->img, frame, sizeof(chanlist));
+	if (tiles)
+	{
+		undo->tileptr = (void *)tiles;
+		undo->size = nt * sizeof(*tiles) +
+			(undo->pal_ ? SIZEOF_PALETTE + 32 : 0);
+		undo->flags |= UF_COW | UF_SIZED;
+	}
 	mem_undo_im_[mem_undo_pointer]->pal_ = newpal;
 	memcpy(mem_img, holder, sizeof(chanlist));
 	mem_width = new_width;
@@ -1681,9 +2450,10 @@ int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cma
 // Call this after a draw event but before any changes to image
 void mem_undo_next(int mode)
 {
-	int cmask = CMASK_ALL, wmode = 0;
+	int cmask = CMASK_ALL, wmode = 0, track = mode & UNDO_TRACK;
+	int up = mem_undo_pointer;
 
-	switch (mode)
+	switch (mode & ~UNDO_TRACK)
 	{
 	case UNDO_TRANS: /* Transparent colour change (cumulative) */
 		wmode = UC_ACCUM;
@@ -1720,16 +2490,21 @@ void mem_undo_next(int mode)
 			(mem_clip_alpha || RGBA_mode) ? CMASK_RGBA : CMASK_CURR;
 		break;
 	}
+#ifndef U_DEBUG /* Own copies of channels let mem_undo_prepare() check marks */
+	/* Shared channels would get copied on first mem_undo_previous() */
+	if (track && !mem_undo_opacity) wmode |= UC_COW;
+#endif
 	undo_next_core(wmode, mem_width, mem_height, mem_img_bpp, cmask);
+	undo_track(track, up);
 }
 
-/* Swap image & undo tiles; in process, normal order translates to reverse and
- * vice versa - in order to do it in same memory with minimum extra copies */
-static void mem_undo_tile_swap(undo_item *undo, int redo)
+/* Swap image & undo tiles - XORing the difference into image does both */
+static void mem_undo_tile_swap(undo_item *undo)
 {
-	unsigned char buf[MAX_WIDTH * 3], *tmap, *src, *dest;
+	zrun_state zs;
+	unsigned char *tmap, *dest;
 	int spans[(MAX_WIDTH + TILE_SIZE - 1) / TILE_SIZE + 3];
-	int i, l, h, cc, nw, bpp, w;
+	int i, j, h, cc, nw, bpp, w, *span;
 
 	nw = ((mem_width + TILE_SIZE - 1) / TILE_SIZE + 7) >> 3;
 	for (cc = 0; cc < NUM_CHANNELS; cc++)
@@ -1739,50 +2514,33 @@ static void mem_undo_tile_swap(undo_item *undo, int redo)
 		tmap = undo->tileptr;
 		bpp = BPP(cc);
 		w = mem_width * bpp;
-		src = undo->img[cc];
+		zs.src = undo->img[cc];
+		zs.zeros = zs.lits = 0;
 		for (i = 0; i < mem_height; i += TILE_SIZE , tmap += nw)
 		{
-			int j, j1, dj;
-
-			if (!(l = mem_undo_spans(spans, tmap, mem_width, bpp)))
+			if (!mem_undo_spans(spans, tmap, mem_width, bpp))
 				continue;
 			dest = mem_img[cc] + w * i;
 			h = mem_height - i;
 			if (h > TILE_SIZE) h = TILE_SIZE;
-
-			/* First row stored after last in redo frames */
-			if (!redo) j = 0 , j1 = h , dj = 1;
-			else
+			for (j = 0; j < h; j++ , dest += w)
 			{
-				j = h - 1; j1 = dj = -1;
-				memcpy(buf, src + j * l, l);
-			}
-			/* Process undo normally, and redo backwards */
-			for (; j != j1; j += dj)
-			{
-				unsigned char *ts, *td, *tm;
-				int *span = spans;
+				unsigned char *td = dest;
 
-				td = dest + j * w;
-				tm = ts = src + j * l;
-				*(redo ? &ts : &tm) = j ? tm - l : buf;
+				span = spans;
 				while (TRUE)
 				{
 					td += *span++;
 					if (!*span) break;
-					memcpy(tm, td, *span);
-					memcpy(td, ts, *span);
-					tm += *span;
-					ts += *span; td += *span++;
+					zrun_xor(&zs, td, *span);
+					td += *span++;
 				}
 			}
-			src += h * l;
-			if (!redo) memcpy(src - l, buf, l);
 		}
 	}
 }
 
-static void mem_undo_swap(undo_item *prev, int redo)
+static void mem_undo_swap(undo_item *prev)
 {
 	undo_item tmp = *prev;
 	png_color pal[256];
@@ -1790,7 +2548,7 @@ static void mem_undo_swap(undo_item *prev, int redo)
 
 	if (prev->flags & UF_TILED)
 	{
-		mem_undo_tile_swap(prev, redo);
+		mem_undo_tile_swap(prev);
 		prev->flags &= ~UF_ORIG;
 	}
 	else
@@ -1831,11 +2589,37 @@ static void mem_undo_swap(undo_item *prev, int redo)
 	mem_changed = !(tmp.flags & UF_ORIG);
 }
 
-void mem_do_undo(int redo)
+/* Keep memory use in limit when undoing from disk, by moving the frames
+ * farthest from current one there in turn */
+static void undo_spill_far()
 {
-	undo_item *curr, *prev;
+	undo_item *undo;
+	size_t mem_r, mem_lim = (size_t)mem_undo_limit * (1024 * 1024) *
+		(mem_undo_common * layers_total * 0.01 + 1) / (layers_total + 1);
 	int i, j;
 
+	mem_r = mem_undo_size(&mem_image.undo_);
+	i = mem_undo_done > mem_undo_redo ? mem_undo_done : mem_undo_redo;
+	for (; i > 0; i--)
+	{
+		for (j = -i; j <= i; j += i + i)
+		{
+			if (mem_r <= mem_lim) return;
+			if (i > (j < 0 ? mem_undo_done : mem_undo_redo)) continue;
+			undo = mem_undo_im_[(mem_undo_pointer + j + mem_undo_max) %
+				mem_undo_max];
+			if (undo->flags & UF_DISK) continue;
+			mem_r -= undo->size;
+			if (!undo_spill(undo)) return;
+		}
+	}
+}
+
+int mem_do_undo(int redo)
+{
+	undo_item *curr, *prev;
+	int i, j, disk, res = 0;
+
 	/* Compress last undo frame */
 	mem_undo_prepare();
 
@@ -1847,7 +2631,13 @@ void mem_do_undo(int redo)
 		/* Swap data */
 		curr = mem_undo_im_[mem_undo_pointer];
 		prev = mem_undo_im_[i];
-		mem_undo_swap(prev, redo);
+		/* Read it back from disk first, if it is there */
+		if ((disk = prev->flags & UF_DISK) && !undo_unspill(prev))
+		{
+			res = 1;
+			goto fail;
+		}
+		mem_undo_swap(prev);
 
 		/* Swap frames */
 		mem_undo_im_[mem_undo_pointer] = prev;
@@ -1858,8 +2648,11 @@ void mem_do_undo(int redo)
 
 		/* Update current */
 		update_undo(&mem_image);
+
+		if (disk) undo_spill_far();
 	}
-	pen_down = 0;
+fail:	pen_down = 0;
+	return (res);
 }
 
 /* Return the number of bytes used in image + undo */
@@ -2189,14 +2982,116 @@ void mem_mask_setall(char val)
 	mem_mask_init();
 }
 
-void mem_get_histogram(int channel)	// Calculate how many of each colour index is on the canvas
+/* Results computed from main image are kept, and reused till it changes */
+
+typedef struct {
+	unsigned char *img;
+	int w, h, bpp;
+	unsigned int stamp;
+} imgkey;
+
+/* Fill in the key for image as it is now, and compare to the old one */
+static int same_image(imgkey *now, imgkey *key, unsigned char *img, int bpp)
+{
+	now->img = img;
+	now->w = mem_width;
+	now->h = mem_height;
+	now->bpp = bpp;
+	now->stamp = undo_stamp;
+	return (img && (key->img == img) && (key->w == now->w) &&
+		(key->h == now->h) && (key->bpp == bpp) &&
+		(key->stamp == now->stamp));
+}
+
+/* Histogram gets counted in one pass for all bytes of a pixel: threads do
+ * rows, each into its own bins, and the bins get added up */
+
+typedef struct {
+	unsigned char *img;
+	int *hist;
+	int w, bpp;
+} histd;
+
+static void hist_row(int *hist, unsigned char *img, int w, int bpp)
+{
+	if (bpp == 3) for (; w > 0; w-- , img += 3)
+	{
+		hist[img[0] * 3]++;
+		hist[img[1] * 3 + 1]++;
+		hist[img[2] * 3 + 2]++;
+	}
+	else for (; w > 0; w--) hist[*img++ * 3]++;
+}
+
+static void hist_rows(tcb *thread)
+{
+	histd *hd = thread->data;
+	int i, ii, cnt = thread->nsteps;
+
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		hist_row(hd->hist, hd->img + (size_t)i * hd->w * hd->bpp,
+			hd->w, hd->bpp);
+		thread_step(thread, ii + 1, cnt, 10);
+	}
+	thread_done(thread);
+}
+
+static struct {
+	imgkey key;
+	int hist[256 * 3]; // Flat, to be added up as one row of bins
+} hist_cache;
+
+/* Count how many of each value every byte of channel's pixels has: R, G and
+ * B for RGB image, value in [i][0] otherwise */
+void mem_get_histogram3(int hist[256][3], int channel)
 {
-	int i, j = mem_width * mem_height;
-	unsigned char *img = mem_img[channel];
+	histd hd;
+	threaddata *tdata;
+	imgkey now;
+	int *th, i, j, bpp = BPP(channel);
+
+	if (same_image(&now, &hist_cache.key, mem_img[channel], bpp))
+		goto done;
+
+	memset(hist_cache.hist, 0, sizeof(hist_cache.hist));
+	if (!now.img) goto done;
+	memset(&hd, 0, sizeof(hd));
+	hd.img = now.img;
+	hd.w = mem_width;
+	hd.bpp = bpp;
+	tdata = talloc(0, 0, &hd, sizeof(hd),
+		NULL,
+		&hd.hist, sizeof(hist_cache.hist),
+		NULL);
+	if (!tdata) /* Count here then */
+	{
+		for (i = 0; i < mem_height; i++)
+			hist_row(hist_cache.hist, now.img +
+				(size_t)i * mem_width * bpp, mem_width, bpp);
+	}
+	else
+	{
+		launch_threads(hist_rows, tdata, NULL, mem_height);
+		for (i = 0; i < tdata->count; i++)
+		{
+			th = ((histd *)tdata->threads[i]->data)->hist;
+			for (j = 0; j < 256 * 3; j++)
+				hist_cache.hist[j] += th[j];
+		}
+		free(tdata);
+	}
+	hist_cache.key = now;
+
+done:	memcpy(hist, hist_cache.hist, sizeof(hist_cache.hist));
+}
 
-	memset(mem_histogram, 0, sizeof(mem_histogram));
+void mem_get_histogram(int channel)	// Calculate how many of each colour index is on the canvas
+{
+	int i, hist[256][3];
 
-	for (i = 0; i < j; i++) mem_histogram[*img++]++;
+	mem_get_histogram3(hist, channel);
+	for (i = 0; i < 256; i++) mem_histogram[i] = hist[i][0];
 }
 
 void do_transform(int start, int step, int cnt, unsigned char *mask,
@@ -2394,23 +3289,48 @@ void do_transform(int start, int step, int cnt, unsigned char *mask,
 	}
 }
 
+/* Hash table of RGB colours, for up to 1024 of them: slots are pairs of
+ * (colour + 1, index), with zero for an empty slot */
+
+#define COLHASH_BITS 12
+#define COLHASH_SIZE (1 << COLHASH_BITS)
+
+/* Find colour's slot, or empty slot to put it in */
+static inline int *colhash_slot(int *hash, int col)
+{
+	guint32 i = ((guint32)col * 0x9E3779B1U) >> (32 - COLHASH_BITS);
+	int *h;
+
+	while ((h = hash + i * 2)[0] && (h[0] != col + 1))
+		i = (i + 1) & (COLHASH_SIZE - 1);
+	return (h);
+}
+
+/* Return index of colour, or add it with given index and return -1 */
+static inline int colhash_add(int *hash, int col, int idx)
+{
+	int *h = colhash_slot(hash, col);
+
+	if (h[0]) return (h[1]);
+	h[0] = col + 1;
+	h[1] = idx;
+	return (-1);
+}
+
 static unsigned char pal_dupes[256];
 
 int scan_duplicates()	// Find duplicate palette colours, return number found
 {
-	int i, j, c, found, pmap[256];
+	int i, j, found, hash[COLHASH_SIZE * 2];
 
-	for (i = 0; i < mem_cols; i++)
-		pmap[i] = PNG_2_INT(mem_pal[i]);
-	/* Transparent color is different from any normal one */
-	if (mem_xpm_trans >= 0) pmap[mem_xpm_trans] = -1;
-
-	for (found = 0 , i = mem_cols - 1; i >= 0; i--)
+	memset(hash, 0, sizeof(hash));
+	for (found = i = 0; i < mem_cols; i++)
 	{
-		c = pmap[i];
-		for (j = 0; pmap[j] != c; j++);
-		pal_dupes[i] = j;
-		found += i != j;
+		/* Transparent color is different from any normal one */
+		j = i == mem_xpm_trans ? -1 :
+			colhash_add(hash, PNG_2_INT(mem_pal[i]), i);
+		pal_dupes[i] = j < 0 ? i : j;
+		found += j >= 0;
 	}
 
 	return (found);
@@ -2545,19 +3465,24 @@ void mem_cols_found(png_color *userpal)
 int mem_convert_indexed()
 {
 	unsigned char *old_image, *new_image;
-	int i, j, k, pix;
+	int i, j, k, pix, last = -1, hash[COLHASH_SIZE * 2];
+
+	/* First of equal colours wins, same as with linear search */
+	memset(hash, 0, sizeof(hash));
+	for (i = 0; i < 256; i++) colhash_add(hash, found[i], i);
 
 	old_image = mem_undo_previous(CHN_IMAGE);
 	new_image = mem_img[CHN_IMAGE];
 	j = mem_width * mem_height;
-	for (i = 0; i < j; i++)
+	for (i = k = 0; i < j; i++)
 	{
 		pix = MEM_2_INT(old_image, 0);
-		for (k = 0; k < 256; k++)	// Find index of this RGB
+		if (pix != last)	// Find index of this RGB
 		{
-			if (found[k] == pix) break;
+			int *h = colhash_slot(hash, last = pix);
+			if (!h[0]) return (1);	// No index found - BAD ERROR!!
+			k = h[1];
 		}
-		if (k > 255) return (1);	// No index found - BAD ERROR!!
 		*new_image++ = k;
 		old_image += 3;
 	}
@@ -2667,7 +3592,24 @@ typedef struct {
 	unsigned short nn, fw, bk, tm, mtm;
 } pnnbin;
 
-static void find_nn(pnnbin *bins, int idx)
+typedef struct {
+	volatile int req, done;	// Last request posted, and last one done
+	int idx, from, to;	// Bin, and the part of order[] to search
+	int nn;
+	double err;
+} pnnscan;
+
+typedef struct {
+	unsigned char *inbuf;
+	pnnbin *bins, *hist;
+	unsigned short *order, *heap;
+	pnnscan *scan;
+	int width, maxbins, quant_to;
+} pnnd;
+
+/* Search for a bin's nearest neighbor among order[from] to order[to - 1] */
+static void find_nn(pnnbin *bins, unsigned short *order, int from, int to,
+	int idx, pnnscan *ps)
 {
 	pnnbin *bin1, *bin2;
 	int i, nn = 0;
@@ -2678,11 +3620,12 @@ static void find_nn(pnnbin *bins, int idx)
 	wr = bin1->rc;
 	wg = bin1->gc;
 	wb = bin1->bc;
-	for (i = bin1->fw; i; i = bin2->fw)
+	for (; from < to; from++)
 	{
 		double nerr, n2;
 
-		bin2 = bins + i;
+		bin2 = bins + (i = order[from]);
+		if (bin2->mtm == 0xFFFF) continue; /* Deleted */
 		nerr = (bin2->rc - wr) * (bin2->rc - wr) +
 			(bin2->gc - wg) * (bin2->gc - wg) +
 			(bin2->bc - wb) * (bin2->bc - wb);
@@ -2692,85 +3635,168 @@ static void find_nn(pnnbin *bins, int idx)
 		err = nerr;
 		nn = i;
 	}
-	bin1->err = err;
-	bin1->nn = nn;
+	ps->err = err;
+	ps->nn = nn;
 }
 
-int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
-	png_color *userpal)
+static void pnn_hist(tcb *thread)
 {
-	unsigned short heap[32769];
-	pnnbin *bins, *tb, *nb;
-	double d, err, n1, n2;
-	int i, j, k, l, l2, h, b1, maxbins, extbins, res = 1;
+	pnnd *pd = thread->data;
+	unsigned char *inbuf;
+	pnnbin *tb;
+	int i, j, k;
 
+	while ((i = thread_row(thread)) >= 0)
+	{
+		inbuf = pd->inbuf + (size_t)i * pd->width * 3;
+		for (j = 0; j < pd->width; j++ , inbuf += 3)
+		{
+// !!! Can throw gamma correction in here, but what to do about perceptual
+// !!! nonuniformity then?
+			k = ((inbuf[0] & 0xF8) << 7) + ((inbuf[1] & 0xF8) << 2) +
+				(inbuf[2] >> 3);
+			tb = pd->hist + k;
+			tb->rc += inbuf[0]; tb->gc += inbuf[1]; tb->bc += inbuf[2];
+			tb->cnt++;
+		}
+	}
+	thread_done(thread);
+}
 
-	heap[0] = 0; // Empty
-	bins = calloc(32768, sizeof(pnnbin));
-	if (!bins) return (-1);
+/* Every bin is independent in the initial search */
+static void pnn_pass1(tcb *thread)
+{
+	pnnd *pd = thread->data;
+	pnnscan ps;
+	int i, ii, cnt = thread->nsteps;
 
-	progress_init(_("Quantize Pass 1"), 1);
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		find_nn(pd->bins, pd->order, i + 1, pd->maxbins, i, &ps);
+		pd->bins[i].err = ps.err;
+		pd->bins[i].nn = ps.nn;
+		if (thread_step(thread, ii + 1, cnt, 50))
+		{
+			thread->stop = TRUE;
+			break;
+		}
+	}
+	thread_done(thread);
+}
+
+/* Below this many bins per thread, a search isn't worth splitting */
+#define PNN_SPLIT 1024
+
+/* While merging, thread 0 hands parts of long searches to the other threads,
+ * which wait for them; parts are combined in order, the nearer bin
+ * winning and the lower-numbered one winning a tie, same as in one search */
+static void pnn_search(tcb *thread, int idx, int olen, int nh, int *nreq)
+{
+	pnnd *pd = thread->data, *td;
+	pnnscan ps, *tps;
+	int i, k, from, n;
 
-	/* Build histogram */
-	k = width * height;
-	for (i = 0; i < k; i++ , inbuf += 3)
+	/* Only bins after this one need be searched */
+	for (from = 0 , k = olen; from < k; )
 	{
-// !!! Can throw gamma correction in here, but what to do about perceptual
-// !!! nonuniformity then?
-		j = ((inbuf[0] & 0xF8) << 7) + ((inbuf[1] & 0xF8) << 2) +
-			(inbuf[2] >> 3);
-		tb = bins + j;
-		tb->rc += inbuf[0]; tb->gc += inbuf[1]; tb->bc += inbuf[2];
-		tb->cnt++;
+		i = (from + k) >> 1;
+		if (pd->order[i] <= idx) from = i + 1;
+		else k = i;
 	}
 
-	/* Cluster nonempty bins at one end of array */
-	tb = bins;
-	for (i = 0; i < 32768; i++)
+	n = olen - from;
+	if (n < PNN_SPLIT * (nh + 1)) nh = 0;
+	if (nh)
 	{
-		if (!bins[i].cnt) continue;
-		*tb = bins[i];
-		d = 1.0 / (double)tb->cnt;
-		tb->rc *= d; tb->gc *= d; tb->bc *= d;
-		if (quan_sqrt) tb->cnt = sqrt(tb->cnt);
-		tb++;
+		(*nreq)++;
+		for (i = k = 1; i < thread->count; i++)
+		{
+			if (thread->threads[i]->stopped) continue;
+			td = thread->threads[i]->data;
+			tps = td->scan;
+			tps->idx = idx;
+			tps->from = from + (n * k) / (nh + 1);
+			tps->to = from + (n * ++k) / (nh + 1);
+			thread_post(&tps->req, *nreq);
+		}
 	}
-	maxbins = tb - bins;
-	for (i = 0; i < maxbins - 1; i++)
+	find_nn(pd->bins, pd->order, from, from + n / (nh + 1), idx, &ps);
+	if (nh) for (i = 1; i < thread->count; i++)
 	{
-		bins[i].fw = i + 1;
-		bins[i + 1].bk = i;
+		if (thread->threads[i]->stopped) continue;
+		td = thread->threads[i]->data;
+		tps = td->scan;
+		thread_wait(thread, &tps->done, *nreq);
+		if (tps->err >= ps.err) continue;
+		ps.err = tps->err;
+		ps.nn = tps->nn;
 	}
-// !!! Already zeroed out by calloc()
-//	bins[0].bk = bins[i].fw = 0;
+	pd->bins[idx].err = ps.err;
+	pd->bins[idx].nn = ps.nn;
+}
 
-	/* Initialize nearest neighbors and build heap of them */
-	for (i = 0; i < maxbins; i++)
+/* Searches can be split only if there are enough bins, and some merging to do;
+ * if not, the other threads need not wait around */
+static int pnn_helped(pnnd *pd)
+{
+	return ((pd->maxbins > pd->quant_to) && (pd->maxbins >= PNN_SPLIT * 2));
+}
+
+/* Let the other threads go */
+static void pnn_release(tcb *thread, int nreq)
+{
+	pnnscan *ps;
+	int i;
+
+	for (i = 1; i < thread->count; i++)
+	{
+		if (thread->threads[i]->stopped) continue;
+		ps = ((pnnd *)thread->threads[i]->data)->scan;
+		ps->idx = -1;
+		thread_post(&ps->req, nreq + 1);
+	}
+}
+
+static void pnn_merge(tcb *thread)
+{
+	pnnd *pd = thread->data;
+	pnnbin *bins = pd->bins, *tb, *nb;
+	unsigned short *heap = pd->heap, *order = pd->order;
+	double d, err, n1, n2;
+	int i, j, l, l2, h, b1, extbins, olen, dead, nh, nreq;
+
+	if (thread->index) /* Serve searches till told to quit */
 	{
-		if (((i * 50) % maxbins >= maxbins - 50))
-			if (progress_update((float)i / maxbins)) goto quit;
+		pnnscan *ps = pd->scan;
 
-		find_nn(bins, i);
-		/* Push slot on heap */
-		err = bins[i].err;
-		for (l = ++heap[0]; l > 1; l = l2)
+		if (pnn_helped(pd))
+		for (i = 1; thread_wait(thread, &ps->req, i); i++)
 		{
-			l2 = l >> 1;
-			if (bins[h = heap[l2]].err <= err) break;
-			heap[l] = h;
+			if (ps->idx < 0) break;
+			find_nn(bins, order, ps->from, ps->to, ps->idx, ps);
+			thread_post(&ps->done, i);
 		}
-		heap[l] = i;
+		thread_done(thread);
+		return;
 	}
 
-	progress_end();
-	progress_init(_("Quantize Pass 2"), 1);
+	nh = 0;
+	if (pnn_helped(pd)) for (i = 1; i < thread->count; i++)
+		nh += !thread->threads[i]->stopped;
+	nreq = 0;
+	olen = pd->maxbins;
+	dead = 0;
 
 	/* Merge bins which increase error the least */
-	extbins = maxbins - quant_to;
+	extbins = pd->maxbins - pd->quant_to;
 	for (i = 0; i < extbins; )
 	{
 		if (((i * 50) % extbins >= extbins - 50))
-			if (progress_update((float)i / extbins)) goto quit;
+			if (progress_update((float)i / extbins))
+			{
+				thread->stop = TRUE;
+				break;
+			}
 
 		/* Use heap to find which bins to merge */
 		while (TRUE)
@@ -2783,7 +3809,7 @@ int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
 				b1 = heap[1] = heap[heap[0]--];
 			else /* Too old error value */
 			{
-				find_nn(bins, b1);
+				pnn_search(thread, b1, olen, nh, &nreq);
 				tb->tm = i;
 			}
 			/* Push slot down */
@@ -2813,8 +3839,113 @@ int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
 		bins[nb->bk].fw = nb->fw;
 		bins[nb->fw].bk = nb->bk;
 		nb->mtm = 0xFFFF;
+
+		/* Drop deleted bins from search order when they get too many */
+		if (++dead * 2 < olen) continue;
+		for (j = l = 0; j < olen; j++)
+			if (bins[order[j]].mtm != 0xFFFF) order[l++] = order[j];
+		olen = l;
+		dead = 0;
+		/* No more searches long enough to split */
+		if (nh && (olen < PNN_SPLIT * (nh + 1)))
+		{
+			pnn_release(thread, nreq);
+			nh = 0;
+		}
+	}
+
+	if (nh) pnn_release(thread, nreq);
+}
+
+int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
+	png_color *userpal)
+{
+	pnnd pd;
+	threaddata *tdata;
+	unsigned short *heap;
+	pnnbin *bins, *tb, *hb;
+	double d, err;
+	int i, j, l, l2, h, maxbins, res = 1;
+
+
+	pd.inbuf = inbuf;
+	pd.width = width;
+	pd.quant_to = quant_to;
+	tdata = talloc(MA_ALIGN_DOUBLE, height,
+		&pd, sizeof(pd),
+		&pd.bins, 32768 * sizeof(pnnbin),
+		&pd.order, 32768 * sizeof(unsigned short),
+		&pd.heap, 32769 * sizeof(unsigned short),
+		NULL,
+		&pd.hist, 32768 * sizeof(pnnbin),
+		&pd.scan, sizeof(pnnscan),
+		NULL);
+	if (!tdata) return (-1);
+	bins = pd.bins;
+	heap = pd.heap;
+	heap[0] = 0; // Empty
+
+	progress_init(_("Quantize Pass 1"), 1);
+
+	/* Build histogram, in parts, then add them up */
+	launch_threads(pnn_hist, tdata, NULL, height);
+	for (i = 0; i < tdata->count; i++)
+	{
+		hb = ((pnnd *)tdata->threads[i]->data)->hist;
+		for (j = 0; j < 32768; j++ , hb++)
+		{
+			if (!hb->cnt) continue;
+			tb = bins + j;
+			tb->rc += hb->rc; tb->gc += hb->gc; tb->bc += hb->bc;
+			tb->cnt += hb->cnt;
+		}
 	}
 
+	/* Cluster nonempty bins at one end of array */
+	tb = bins;
+	for (i = 0; i < 32768; i++)
+	{
+		if (!bins[i].cnt) continue;
+		*tb = bins[i];
+		d = 1.0 / (double)tb->cnt;
+		tb->rc *= d; tb->gc *= d; tb->bc *= d;
+		if (quan_sqrt) tb->cnt = sqrt(tb->cnt);
+		tb++;
+	}
+	maxbins = tb - bins;
+	for (i = 0; i < maxbins - 1; i++)
+	{
+		bins[i].fw = i + 1;
+		bins[i + 1].bk = i;
+	}
+// !!! Already zeroed out by calloc()
+//	bins[0].bk = bins[i].fw = 0;
+	for (i = 0; i < maxbins; i++) pd.order[i] = i;
+	for (i = 0; i < tdata->count; i++)
+		((pnnd *)tdata->threads[i]->data)->maxbins = maxbins;
+
+	/* Initialize nearest neighbors and build heap of them */
+	launch_threads(pnn_pass1, tdata, NULL, maxbins);
+	if (tdata->threads[0]->stop) goto quit;
+	for (i = 0; i < maxbins; i++)
+	{
+		/* Push slot on heap */
+		err = bins[i].err;
+		for (l = ++heap[0]; l > 1; l = l2)
+		{
+			l2 = l >> 1;
+			if (bins[h = heap[l2]].err <= err) break;
+			heap[l] = h;
+		}
+		heap[l] = i;
+	}
+
+	progress_end();
+	progress_init(_("Quantize Pass 2"), 1);
+
+	launch_threads(pnn_merge, tdata, NULL, 1);
+	if (tdata->threads[0]->stop) goto quit;
+
 	/* Fill palette */
 	i = j = 0;
 	while (TRUE)
@@ -2831,7 +3962,7 @@ int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
 	res = 0;
 
 quit:	progress_end();
-	free(bins);
+	free(tdata);
 	return (res);
 }
 
@@ -2882,10 +4013,114 @@ typedef struct {
 	guint32 xcmap[64 * 64 * 2 + 128 * 2]; /* Cache bitmap */
 	guint32 lcmap[64 * 64 * 2]; /* Extension bitmap */
 	unsigned char cmap[64 * 64 * 64 + 128 * 64]; /* Index cache */
+	unsigned char kdidx[256]; /* Palette indices in k-d tree order */
+	unsigned char kdaxis[256]; /* Split axis of each tree node */
 } ctable;
 
 static ctable *ctp;
 
+/* Each thread caches lookups on its own, while ctable stays read-only */
+typedef struct {
+	guint32 xcmap[64 * 64 * 2 + 128 * 2]; /* Cache bitmap */
+	unsigned char cmap[64 * 64 * 64 + 128 * 64]; /* Index cache */
+} ccache;
+
+/* K-d tree over palette is implicit: range [lo, hi) of kdidx[] has its median
+ * element for node, split along kdaxis[] of it, with lower coords to the left
+ * and higher to the right; ranges of KD_LEAF or less are leaves */
+
+#define KD_LEAF 6
+
+static void kd_build(int lo, int hi)
+{
+	double *xyz = ctp->xyz256, v0[3], v1[3];
+	int i, j, k, l, mid, axis;
+
+	while (hi - lo > KD_LEAF)
+	{
+		/* Split along the widest extent */
+		v0[0] = v0[1] = v0[2] = 1000000000.0;
+		v1[0] = v1[1] = v1[2] = -1000000000.0;
+		for (i = lo; i < hi; i++)
+		{
+			double *tmp = xyz + ctp->kdidx[i] * 3;
+			for (j = 0; j < 3; j++)
+			{
+				if (tmp[j] < v0[j]) v0[j] = tmp[j];
+				if (tmp[j] > v1[j]) v1[j] = tmp[j];
+			}
+		}
+		axis = v1[1] - v0[1] > v1[0] - v0[0];
+		if (v1[2] - v0[2] > v1[axis] - v0[axis]) axis = 2;
+
+		/* Sort along it - insertion sort is fast enough for 256 */
+		for (i = lo + 1; i < hi; i++)
+		{
+			k = ctp->kdidx[i];
+			for (j = i; j > lo; j--)
+			{
+				l = ctp->kdidx[j - 1];
+				if (xyz[l * 3 + axis] <= xyz[k * 3 + axis]) break;
+				ctp->kdidx[j] = l;
+			}
+			ctp->kdidx[j] = k;
+		}
+
+		mid = (lo + hi) >> 1;
+		ctp->kdaxis[mid] = axis;
+		kd_build(lo, mid);
+		lo = mid + 1;
+	}
+}
+
+typedef struct {
+	const double *v;
+	distance_func dist;
+	double d;
+	int j;
+} kd_query;
+
+/* Lowest index wins among equally near colours, same as with linear search;
+ * a subtree is skipped only if strictly farther than the best match, and
+ * distance along one axis is never more than full distance even after
+ * rounding, so the result is exactly the same */
+static void kd_search(kd_query *q, int lo, int hi)
+{
+	double td, *xyz = ctp->xyz256;
+	int i, mid;
+
+	while (hi - lo > KD_LEAF)
+	{
+		mid = (lo + hi) >> 1;
+		i = ctp->kdidx[mid];
+		td = q->dist(q->v, xyz + i * 3);
+		if ((td < q->d) || ((td == q->d) && (i < q->j)))
+			q->j = i , q->d = td;
+
+		/* Nearer side first, then the farther one if it can matter */
+		td = q->v[ctp->kdaxis[mid]] - xyz[i * 3 + ctp->kdaxis[mid]];
+		if (td < 0)
+		{
+			kd_search(q, lo, mid);
+			if (-td > q->d) return;
+			lo = mid + 1;
+		}
+		else
+		{
+			kd_search(q, mid + 1, hi);
+			if (td > q->d) return;
+			hi = mid;
+		}
+	}
+	for (; lo < hi; lo++)
+	{
+		i = ctp->kdidx[lo];
+		td = q->dist(q->v, xyz + i * 3);
+		if ((td < q->d) || ((td == q->d) && (i < q->j)))
+			q->j = i , q->d = td;
+	}
+}
+
 /* !!! Beware of GCC misoptimizing this! The two functions below is the result
  * of much trial and error, and hopefully not VERY brittle; but still, after any
  * modification to them, compare the performance to what it was before - WJ */
@@ -2919,20 +4154,18 @@ static int find_nearest(int col[3], int n)
 
 	/* Find nearest colour */
 	{
-		const distance_func dist = distance_3d[ctp->cdist];
-		double d = 1000000000.0, td, *xyz = ctp->xyz256;
-		int i, j, l = ctp->ncols;
+		kd_query q;
 
-		for (i = j = 0; i < l; i++)
-		{
-			td = dist(tmp, xyz + i * 3);
-			if (td < d) j = i , d = td;
-		}
-		return (j);
+		q.v = tmp;
+		q.dist = distance_3d[ctp->cdist];
+		q.d = 1000000000.0;
+		q.j = 0;
+		kd_search(&q, 0, ctp->ncols);
+		return (q.j);
 	}
 }
 
-static int lookup_srgb(double *srgb)
+static int lookup_srgb(ccache *cc, double *srgb)
 {
 	int k, n = 0, col[3];
 
@@ -2949,122 +4182,73 @@ static int lookup_srgb(double *srgb)
 	else n = 256; /* Use posterized values for 6-bit part */
 
 	/* Use colour cache if possible */
-	if (!(ctp->xcmap[k >> 5] & (1 << (k & 31))))
+	if (!(cc->xcmap[k >> 5] & (1 << (k & 31))))
 	{
-		ctp->xcmap[k >> 5] |= 1 << (k & 31);
-		ctp->cmap[k] = find_nearest(col, n);
+		cc->xcmap[k >> 5] |= 1 << (k & 31);
+		cc->cmap[k] = find_nearest(col, n);
 	}
 
-	return (ctp->cmap[k]);
+	return (cc->cmap[k]);
 }
 
-// !!! No support for transparency yet !!!
-/* Damping functions roughly resemble old GIMP's behaviour, but may need some
- * tuning because linear sRGB is just too different from normal RGB */
-int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
-	int dist, int limit, int selc, int serpent, int rgb8b, double emult)
-{
-	int i, j, k, l, kk, j0, j1, dj, rlen, col0, col1, progress;
-	unsigned char *ddata, *src, *dest;
-	double *row0, *row1, *row2, *tmp;
-	double err, intd, extd, *gamma6, *lin6;
-	double tc0[3], tc1[3], color0[3], color1[3];
-	double fdiv = 0, gamut[6] = {1, 1, 1, 0, 0, 0};
-
-	/* Allocate working space */
-	rlen = (mem_width + 4) * 3 * sizeof(double);
-	ddata = multialloc(MA_ALIGN_DOUBLE,
-		&row0, rlen,
-		&row1, rlen,
-		&row2, rlen,
-		&ctp, sizeof(ctable),
-		NULL);
-	if (!ddata) return (1);
-
-	if ((progress = mem_width * mem_height > 1000000))
-		progress_init(_("Converting to Indexed Palette"), 0);
-
-	/* Preprocess palette to find whether to extend precision and where */
-	for (i = 0; i < ncols; i++)
-	{
-		j = ((mem_pal[i].red & 0xFC) << 10) +
-			((mem_pal[i].green & 0xFC) << 4) +
-			(mem_pal[i].blue >> 2);
-		if (!(l = ctp->cmap[j]))
-		{
-			ctp->cmap[j] = l = i + 1;
-			ctp->xcmap[l * 4 + 2] = j;
-		}
-		k = ((mem_pal[i].red & 3) << 4) +
-			((mem_pal[i].green & 3) << 2) +
-			(mem_pal[i].blue & 3);
-		ctp->xcmap[l * 4 + (k & 1)] |= 1 << (k >> 1);
-	}
-	memset(ctp->cmap, 0, 64 * 64 * 64);
-	for (k = 0 , i = 4; i < 256 * 4; i += 4)
-	{
-		guint32 v = ctp->xcmap[i] | ctp->xcmap[i + 1];
-		/* Are 2+ colors there somewhere? */
-		if (!((v & (v - 1)) | (ctp->xcmap[i] & ctp->xcmap[i + 1])))
-			continue;
-		rgb8b = TRUE; /* Force 8-bit precision */
-		j = ctp->xcmap[i + 2];
-		ctp->lcmap[j >> 5] |= 1 << (j & 31);
-		ctp->cmap[j] = k++;
-	}
-	memset(ctp->xcmap, 0, 257 * 4 * sizeof(guint32));
+/* Dithering filters */
+/* Floyd-Steinberg dither */
+short dither_fs[16] =
+	{ 16,  0, 0, 0, 7, 0,  0, 3, 5, 1, 0,  0, 0, 0, 0, 0 };
+/* Stucki dither */
+short dither_stucki[16] =
+	{ 42,  0, 0, 0, 8, 4,  2, 4, 8, 4, 2,  1, 2, 4, 2, 1 };
 
-	/* Prepare tables */
-	for (i = 0; i < 256; i++)
-	{
-		j = (i & 0xFC) + (i >> 6);
-		ctp->gamma[i] = gamma256[i];
-		ctp->gamma[i + 256] = gamma256[j];
-		ctp->lin[i] = i * (1.0 / 255.0);
-		ctp->lin[i + 256] = j * (1.0 / 255.0);
-	}
-	/* Keep all 8 bits of input or posterize to 6 bits? */
-	i = rgb8b ? 0 : 256;
-	gamma6 = ctp->gamma + i; lin6 = ctp->lin + i;
-	tmp = ctp->xyz256;
-	for (i = 0; i < ncols; i++ , tmp += 3)
+typedef struct {
+	unsigned char *old;
+	short *dither;
+	double *gamma6, *rows;
+	double fdiv, emult, gamut[6];
+	volatile int *done;
+	int limit, selc, serpent, nrows, rlen;
+	ccache *cc;
+} ditherd;
+
+/* Pixels done in a row are posted in steps of this, for the next row to see */
+#define DITHER_POST 32
+
+static int dither_next;
+DEF_MUTEX(dither_lock);
+
+/* Rows are handed out in order, and each row runs behind the one before it as
+ * a wavefront: a pixel is processed when the pixels within 4 columns of it in
+ * the previous row are done, so every error cell gets its contributions summed
+ * in exactly the same order as with one thread; in serpentine mode, a row
+ * starts where the previous one ends, so waits for all of it */
+static void dither_rows(tcb *thread)
+{
+	ditherd *dd = thread->data;
+	ccache *cc = dd->cc;
+	short *dither = dd->dither;
+	unsigned char *src, *dest;
+	double *row0, *row1, *row2, *gamma6 = dd->gamma6;
+	double err, intd, extd, emult = dd->emult, fdiv = dd->fdiv;
+	double tc0[3], tc1[3], color0[3], color1[3], gamut[6];
+	int i, ii, j, k, l, kk, p, j0, j1, dj, col0, col1, cnt;
+	int limit = dd->limit, selc = dd->selc, rlen = dd->rlen;
+	int need, avail, same = !dd->serpent || !dither;
+
+	memcpy(gamut, dd->gamut, sizeof(gamut));
+	cnt = thread->nsteps;
+	for (ii = 0; TRUE; ii++)
 	{
-		/* Update gamut limits */
-		tmp[0] = gamma6[mem_pal[i].red];
-		tmp[1] = gamma6[mem_pal[i].green];
-		tmp[2] = gamma6[mem_pal[i].blue];
-		for (j = 0; j < 3; j++)
-		{
-			if (tmp[j] < gamut[j]) gamut[j] = tmp[j];
-			if (tmp[j] > gamut[j + 3]) gamut[j + 3] = tmp[j];
-		}
-		/* Store colour coords */
-		switch (cspace)
-		{
-		default:
-		case CSPACE_RGB:
-			tmp[0] = lin6[mem_pal[i].red];
-			tmp[1] = lin6[mem_pal[i].green];
-			tmp[2] = lin6[mem_pal[i].blue];
-			break;
-		case CSPACE_SRGB:
-			break; /* Done already */
-		case CSPACE_LXN:
-			rgb2LXN(tmp, tmp[0], tmp[1], tmp[2]);
-			break;
-		}
-	}
-	ctp->cspace = cspace; ctp->cdist = dist; ctp->ncols = ncols;
-	serpent = serpent ? 0 : 2;
-	if (dither) fdiv = 1.0 / *dither++;
+		LOCK_MUTEX(dither_lock);
+		i = dither_next++;
+		UNLOCK_MUTEX(dither_lock);
+		if (i >= mem_height) break;
 
-	/* Process image */
-	for (i = 0; i < mem_height; i++)
-	{
-		src = old + i * mem_width * 3;
+		row0 = dd->rows + (i % dd->nrows) * rlen;
+		row1 = dd->rows + ((i + 1) % dd->nrows) * rlen;
+		row2 = dd->rows + ((i + 2) % dd->nrows) * rlen;
+		src = dd->old + i * mem_width * 3;
 		dest = mem_img[CHN_IMAGE] + i * mem_width;
-		memset(row2, 0, rlen);
-		if (serpent ^= 1)
+		memset(row2, 0, rlen * sizeof(double));
+		if (!dd->serpent || !(i & 1))
 		{
 			j0 = 0; j1 = mem_width * 3; dj = 1;
 		}
@@ -3073,8 +4257,21 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 			j0 = (mem_width - 1) * 3; j1 = -3; dj = -1;
 			dest += mem_width - 1;
 		}
-		for (j = j0; j != j1; j += dj * 3)
+		/* No error diffusion means no waiting */
+		avail = !i || !dither ? mem_width : 0;
+		for (j = j0 , p = 0; j != j1; j += dj * 3 , p++)
 		{
+			if (!(p & (DITHER_POST - 1))) thread_post(dd->done + i, p);
+			/* Wait for the previous row to get far enough */
+			need = (same ? p : mem_width - 1 - p) + 5;
+			if (need > mem_width) need = mem_width;
+			if (need > avail)
+			{
+				if (!thread_wait(thread, dd->done + i - 1, need))
+					goto quit;
+				avail = dd->done[i - 1];
+			}
+
 			for (k = 0; k < 3; k++)
 			{
 				/* Posterize to 6 bits as natural for palette */
@@ -3099,7 +4296,7 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 				if (color1[k] > gamut[k + 3]) color1[k] = gamut[k + 3];
 			}
 			/* Output best colour */
-			col1 = lookup_srgb(color1);
+			col1 = lookup_srgb(cc, color1);
 			*dest = col1;
 			dest += dj;
 			if (!dither) continue;
@@ -3109,7 +4306,7 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 			tc1[2] = gamma6[mem_pal[col1].blue];
 			if (selc) /* Selective error damping */
 			{
-				col0 = lookup_srgb(color0);
+				col0 = lookup_srgb(cc, color0);
 				tc0[0] = gamma6[mem_pal[col0].red];
 				tc0[1] = gamma6[mem_pal[col0].green];
 				tc0[2] = gamma6[mem_pal[col0].blue];
@@ -3172,13 +4369,149 @@ int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 				}
 			}
 		}
-		tmp = row0; row0 = row1; row1 = row2; row2 = tmp;
-		if (progress && (i * 10) % mem_height >= mem_height - 10)
-			progress_update((float)(i + 1) / mem_height);
+		thread_post(dd->done + i, mem_width);
+		if (thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+quit:	thread_done(thread);
+}
+
+// !!! No support for transparency yet !!!
+/* Damping functions roughly resemble old GIMP's behaviour, but may need some
+ * tuning because linear sRGB is just too different from normal RGB */
+int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
+	int dist, int limit, int selc, int serpent, int rgb8b, double emult)
+{
+	ditherd dd;
+	threaddata *tdata;
+	int i, j, k, l, progress;
+	unsigned char *ddata;
+	double *tmp, *gamma6, *lin6, *gamut = dd.gamut;
+
+	/* Allocate working space; rows can run in parallel only where one
+	 * need not wait for the previous to finish */
+	dd.old = old;
+	dd.rlen = (mem_width + 4) * 3;
+	tdata = talloc(0, serpent && dither ? 1 : 0, &dd, sizeof(dd),
+		NULL,
+		&dd.cc, sizeof(ccache),
+		NULL);
+	if (!tdata) return (1);
+	/* 2 rows ahead of those in progress are getting errors added */
+	dd.nrows = tdata->count + 3;
+	ddata = multialloc(MA_ALIGN_DOUBLE,
+		&dd.rows, dd.nrows * dd.rlen * sizeof(double),
+		&dd.done, mem_height * sizeof(int),
+		&ctp, sizeof(ctable),
+		NULL);
+	if (!ddata)
+	{
+		free(tdata);
+		return (1);
+	}
+
+	gamut[0] = gamut[1] = gamut[2] = 1.0;
+	gamut[3] = gamut[4] = gamut[5] = 0.0;
+
+	if ((progress = mem_width * mem_height > 1000000))
+		progress_init(_("Converting to Indexed Palette"), 0);
+
+	/* Preprocess palette to find whether to extend precision and where */
+	for (i = 0; i < ncols; i++)
+	{
+		j = ((mem_pal[i].red & 0xFC) << 10) +
+			((mem_pal[i].green & 0xFC) << 4) +
+			(mem_pal[i].blue >> 2);
+		if (!(l = ctp->cmap[j]))
+		{
+			ctp->cmap[j] = l = i + 1;
+			ctp->xcmap[l * 4 + 2] = j;
+		}
+		k = ((mem_pal[i].red & 3) << 4) +
+			((mem_pal[i].green & 3) << 2) +
+			(mem_pal[i].blue & 3);
+		ctp->xcmap[l * 4 + (k & 1)] |= 1 << (k >> 1);
+	}
+	memset(ctp->cmap, 0, 64 * 64 * 64);
+	for (k = 0 , i = 4; i < 256 * 4; i += 4)
+	{
+		guint32 v = ctp->xcmap[i] | ctp->xcmap[i + 1];
+		/* Are 2+ colors there somewhere? */
+		if (!((v & (v - 1)) | (ctp->xcmap[i] & ctp->xcmap[i + 1])))
+			continue;
+		rgb8b = TRUE; /* Force 8-bit precision */
+		j = ctp->xcmap[i + 2];
+		ctp->lcmap[j >> 5] |= 1 << (j & 31);
+		ctp->cmap[j] = k++;
+	}
+	memset(ctp->xcmap, 0, 257 * 4 * sizeof(guint32));
+
+	/* Prepare tables */
+	for (i = 0; i < 256; i++)
+	{
+		j = (i & 0xFC) + (i >> 6);
+		ctp->gamma[i] = gamma256[i];
+		ctp->gamma[i + 256] = gamma256[j];
+		ctp->lin[i] = i * (1.0 / 255.0);
+		ctp->lin[i + 256] = j * (1.0 / 255.0);
+	}
+	/* Keep all 8 bits of input or posterize to 6 bits? */
+	i = rgb8b ? 0 : 256;
+	gamma6 = ctp->gamma + i; lin6 = ctp->lin + i;
+	tmp = ctp->xyz256;
+	for (i = 0; i < ncols; i++ , tmp += 3)
+	{
+		/* Update gamut limits */
+		tmp[0] = gamma6[mem_pal[i].red];
+		tmp[1] = gamma6[mem_pal[i].green];
+		tmp[2] = gamma6[mem_pal[i].blue];
+		for (j = 0; j < 3; j++)
+		{
+			if (tmp[j] < gamut[j]) gamut[j] = tmp[j];
+			if (tmp[j] > gamut[j + 3]) gamut[j + 3] = tmp[j];
+		}
+		/* Store colour coords */
+		switch (cspace)
+		{
+		default:
+		case CSPACE_RGB:
+			tmp[0] = lin6[mem_pal[i].red];
+			tmp[1] = lin6[mem_pal[i].green];
+			tmp[2] = lin6[mem_pal[i].blue];
+			break;
+		case CSPACE_SRGB:
+			break; /* Done already */
+		case CSPACE_LXN:
+			rgb2LXN(tmp, tmp[0], tmp[1], tmp[2]);
+			break;
+		}
+	}
+	ctp->cspace = cspace; ctp->cdist = dist; ctp->ncols = ncols;
+	/* Index the palette for nearest colour search */
+	for (i = 0; i < ncols; i++) ctp->kdidx[i] = i;
+	kd_build(0, ncols);
+	dd.gamma6 = gamma6;
+	dd.dither = dither;
+	dd.fdiv = 0.0;
+	if (dither) dd.fdiv = 1.0 / *dd.dither++;
+	dd.emult = emult;
+	dd.limit = limit;
+	dd.selc = selc;
+	dd.serpent = serpent;
+
+	/* Process image */
+	for (i = 0; i < tdata->count; i++)
+	{
+		ditherd *tdd = tdata->threads[i]->data;
+		ccache *cc = tdd->cc;
+		*tdd = dd;
+		tdd->cc = cc;
 	}
+	dither_next = 0;
+	launch_threads(dither_rows, tdata, NULL, mem_height);
 
 	if (progress) progress_end();
 	free(ddata);
+	free(tdata);
 	return (0);
 }
 
@@ -5222,10 +6555,7 @@ static double BH(double x)
 
 static const double Aarray[4] = {-0.5, -2.0 / 3.0, -0.75, -1.0};
 
-/* !!! Filter as a whole must be perfectly symmetric, and "idx" of step 0
- * must be <= 0; these natural properties are relied on when allocating and
- * extending horizontal temp arrays for BOUND_TILE mode.
- * 2 extra steps at end hold end pointer & index, and terminating NULL. */
+/* 2 extra steps at end hold end pointer & index, and terminating NULL. */
 static fstep *make_filter(int l0, int l1, int type, int sharp, int bound)
 {
 	fstep *res, *buf;
@@ -5343,34 +6673,96 @@ static fstep *make_filter(int l0, int l1, int type, int sharp, int bound)
 		/* Normalize */
 		if ((sum != 0.0) && (sum != 1.0))
 		{
-			__typeof__(*kp) *tp = buf->k;
-			sum = 1.0 / sum;
-			while (tp != kp) *tp++ *= sum;
+			__typeof__(*kp) *tp = buf->k;
+			sum = 1.0 / sum;
+			while (tp != kp) *tp++ *= sum;
+		}
+	}
+	/* Finalize */
+	buf->idx = k0; // The rightmost extent
+	buf->k = kp;
+
+	return (res);
+}
+
+/* Recently used filter tables are kept for reuse, most recent first; as they
+ * are only made in main thread, and the least recent one gets replaced, both
+ * tables of a scaling operation stay valid till it ends */
+
+#define FILTER_CACHE 8
+
+typedef struct {
+	fstep *filter;
+	int l0, l1, type, sharp, bound;
+} filter_slot;
+
+static filter_slot filter_cache[FILTER_CACHE];
+
+static fstep *get_filter(int l0, int l1, int type, int sharp, int bound)
+{
+	filter_slot tmp = { NULL, l0, l1, type, sharp, bound };
+	int i;
+
+	for (i = 0; i < FILTER_CACHE; i++)
+	{
+		filter_slot *fs = filter_cache + i;
+
+		if (!fs->filter) break;
+		if ((fs->l0 == l0) && (fs->l1 == l1) && (fs->type == type) &&
+			(fs->sharp == sharp) && (fs->bound == bound))
+		{
+			tmp = *fs;
+			break;
 		}
 	}
-	/* Finalize */
-	buf->idx = k0; // The rightmost extent
-	buf->k = kp;
-
-	return (res);
+	if (!tmp.filter) /* Not found - make a new one */
+	{
+		tmp.filter = make_filter(l0, l1, type, sharp, bound);
+		if (!tmp.filter) return (NULL);
+		/* Replace the least recent one if no free slot */
+		if (i == FILTER_CACHE) free(filter_cache[--i].filter);
+	}
+	/* Move it to front */
+	memmove(filter_cache + 1, filter_cache, i * sizeof(filter_slot));
+	filter_cache[0] = tmp;
+	return (tmp.filter);
 }
 
+/* Column bands are sized for their work area to stay in L2 cache */
+#define SCALE_WORKSET (128 * 1024)
+
 typedef struct {
 	int tmask, gcor, progress;
 	int ow, oh, nw, nh, bpp;
+	int tw, bands, span;	// Band width & count, work area length
 	unsigned char **src, **dest;
-	double *rgb;
+	float *rgb, *lut;
 	fstep *hfilter, *vfilter;
 	threaddata *tdata; // For simplicity
 } scale_context;
 
+/* Filter tables belong to the cache, so aren't freed here */
 static void clear_scale(scale_context *ctx)
 {
-	free(ctx->hfilter);
-	free(ctx->vfilter);
 	free(ctx->tdata);
 }
 
+/* Source columns needed for destination columns from x0 to x1-1: returns
+ * their count, and stores the first one */
+static int scale_span(fstep *hfilter, int x0, int x1, int *start)
+{
+	int s = hfilter[x0].idx, e = s;
+
+	for (; x0 < x1; x0++)
+	{
+		int i = hfilter[x0].idx, l = i + (hfilter[x0 + 1].k - hfilter[x0].k);
+		if (s > i) s = i;
+		if (e < l) e = l;
+	}
+	*start = s;
+	return (e - s);
+}
+
 static int prepare_scale(scale_context *ctx, int type, int sharp, int bound)
 {
 	ctx->hfilter = ctx->vfilter = NULL;
@@ -5379,28 +6771,41 @@ static int prepare_scale(scale_context *ctx, int type, int sharp, int bound)
 	/* We don't use threading for NN */
 	if (!type || (ctx->bpp == 1)) return (TRUE);
 
-	if ((ctx->hfilter = make_filter(ctx->ow, ctx->nw, type, sharp, bound)) &&
-		(ctx->vfilter = make_filter(ctx->oh, ctx->nh, type, sharp, bound)))
+	if ((ctx->hfilter = get_filter(ctx->ow, ctx->nw, type, sharp, bound)) &&
+		(ctx->vfilter = get_filter(ctx->oh, ctx->nh, type, sharp, bound)))
 	{
-		int l = (ctx->ow - ctx->hfilter[0].idx * 2) * sizeof(double);
+		int i, j, l, n = ctx->tmask ? 7 : 3;
+
+		/* Split destination into bands of columns */
+		l = SCALE_WORKSET / (n * sizeof(float));
+		i = ceil_div(scale_span(ctx->hfilter, 0, ctx->nw, &j), l);
+		ctx->tw = ceil_div(ctx->nw, i);
+		ctx->bands = ceil_div(ctx->nw, ctx->tw);
+		for (ctx->span = i = 0; i < ctx->nw; i += ctx->tw)
+		{
+			l = scale_span(ctx->hfilter, i, i + ctx->tw > ctx->nw ?
+				ctx->nw : i + ctx->tw, &j);
+			if (ctx->span < l) ctx->span = l;
+		}
+		/* One extra float, for 4-float reads of RGB at the end */
 		if ((ctx->tdata = talloc(MA_ALIGN_DOUBLE,
 			image_threads(ctx->nw, ctx->nh), ctx, sizeof(*ctx),
+			&ctx->lut, (ctx->gcor ? 256 : 0) * sizeof(float),
 			NULL,
 			// !!! No space for RGBAS for now
-			&ctx->rgb, l * (ctx->tmask ? 7 : 3),
-			NULL))) return (TRUE);
+			&ctx->rgb, (ctx->span * n + 1) * sizeof(float),
+			NULL)))
+		{
+			if (ctx->gcor) for (i = 0; i < 256; i++)
+				ctx->lut[i] = gamma256[i];
+			return (TRUE);
+		}
 	}
 
 	clear_scale(ctx);
 	return (FALSE);
 }
 
-static void tile_extend(double *temp, int w, int l)
-{
-	memcpy(temp - l, temp + w - l, l * sizeof(*temp));
-	memcpy(temp + w, temp, l * sizeof(*temp));
-}
-
 typedef void REGPARM2 (*istore_func)(unsigned char *img, const double *sum);
 
 static void REGPARM2 istore_gc(unsigned char *img, const double *sum)
@@ -5427,190 +6832,306 @@ static void REGPARM2 istore_1(unsigned char *img, const double *sum)
 	img[0] = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
 }
 
-/* !!! Once again, beware of GCC misoptimization! The two functions below
- * should not be both inlineable at once, otherwise poor code wasting both
- * time and space will be produced - WJ */
+/* SSE2 versions process 16 bytes or 4 pixels per step, and 3 channels at
+ * once when scaling horizontally */
 
-static void scale_row(fstep *tmpy, fstep *hfilter, double *work_area,
-	int bpp, int gc, int ow, int oh, int nw, int i,
-	unsigned char *src, unsigned char *dest)
+#ifdef SSE2_FUNC
+
+static SSE2_FUNC int scale_add_sse2(float *dest, unsigned char *src, int len,
+	float k)
 {
-	/* !!! Protect from possible stack misalignment */
-	unsigned char sum_[4 * sizeof(double)];
-	double *sum = ALIGNED(sum_, sizeof(double));
-	istore_func istore;
-	unsigned char *img;
-	fstep *tmpx;
-	__typeof__(*tmpy->k) *kp = tmpy->k - tmpy->idx;
-	int j, y, h = tmpy[1].k - kp, ll = hfilter[0].idx;
+	__m128 kk = _mm_set1_ps(k);
+	__m128i z = _mm_setzero_si128();
+	int j;
 
+	for (j = 0; j + 16 <= len; j += 16)
+	{
+		__m128i v = _mm_loadu_si128((__m128i *)(src + j));
+		__m128i lo = _mm_unpacklo_epi8(v, z), hi = _mm_unpackhi_epi8(v, z);
+		__m128 f[4];
+		int i;
 
-	work_area -= ll * bpp;
-	ow *= bpp;
-	memset(work_area, 0, ow * sizeof(double));
-	/* Build one vertically-scaled row */
-	for (y = tmpy->idx; y < h; y++)
+		f[0] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, z));
+		f[1] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, z));
+		f[2] = _mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, z));
+		f[3] = _mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, z));
+		for (i = 0; i < 4; i++) _mm_storeu_ps(dest + j + i * 4,
+			_mm_add_ps(_mm_loadu_ps(dest + j + i * 4),
+			_mm_mul_ps(f[i], kk)));
+	}
+	return (j);
+}
+
+static SSE2_FUNC int scale_adda_sse2(float *dest, float *desta,
+	unsigned char *src, unsigned char *srca, int len, float k)
+{
+	__m128 kk = _mm_set1_ps(k);
+	__m128i z = _mm_setzero_si128();
+	int j;
+
+	for (j = 0; j + 4 <= len; j += 4)
+	{
+		__m128i v, vl, vh;
+		__m128 a, f[3];
+		unsigned int tv;
+		int i;
+
+		memcpy(&tv, srca + j, 4);
+		a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(
+			_mm_cvtsi32_si128(tv), z), z)), kk);
+		_mm_storeu_ps(desta + j, _mm_add_ps(_mm_loadu_ps(desta + j), a));
+		memcpy(&tv, src + j * 3 + 8, 4);
+		v = _mm_unpacklo_epi64(_mm_loadl_epi64((__m128i *)(src + j * 3)),
+			_mm_cvtsi32_si128(tv));
+		vl = _mm_unpacklo_epi8(v, z); vh = _mm_unpackhi_epi8(v, z);
+		f[0] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(vl, z)),
+			_mm_shuffle_ps(a, a, _MM_SHUFFLE(1, 0, 0, 0)));
+		f[1] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(vl, z)),
+			_mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 2, 1, 1)));
+		f[2] = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(vh, z)),
+			_mm_shuffle_ps(a, a, _MM_SHUFFLE(3, 3, 3, 2)));
+		for (i = 0; i < 3; i++) _mm_storeu_ps(dest + j * 3 + i * 4,
+			_mm_add_ps(_mm_loadu_ps(dest + j * 3 + i * 4), f[i]));
+	}
+	return (j);
+}
+
+/* Sum up n RGB pixels times coefficients */
+static SSE2_FUNC void scale_dot3_sse2(float *sum, float *wrk, float *k, int n)
+{
+	__m128 s = _mm_setzero_ps();
+
+	for (; n > 0; n-- , wrk += 3)
+		s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(wrk),
+			_mm_set1_ps(*k++)));
+	_mm_storeu_ps(sum, s);
+}
+
+/* Scale a row of RGB pixels horizontally, and store them rounded, the same
+ * way istore_3() does */
+static SSE2_FUNC void scale_hor3_sse2(fstep *tmpx, int n, float *wrk, int l,
+	unsigned char *img)
+{
+	for (; n > 0; n-- , tmpx++ , img += 3)
+	{
+		__typeof__(*tmpx->k) *tp = tmpx->k, *kp = tmpx[1].k;
+		float *tw = wrk + (tmpx->idx - l) * 3;
+		__m128 s = _mm_setzero_ps();
+		__m128i v;
+		int tv;
+
+		for (; tp != kp; tw += 3) s = _mm_add_ps(s,
+			_mm_mul_ps(_mm_loadu_ps(tw), _mm_set1_ps(*tp++)));
+		v = _mm_cvtps_epi32(s);
+		v = _mm_packs_epi32(v, v);
+		tv = _mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+		img[0] = tv; img[1] = tv >> 8; img[2] = tv >> 16;
+	}
+}
+
+#endif
+
+/* Add a row of values times coefficient to work area, through gamma table if
+ * one is given */
+static void scale_add(float *dest, unsigned char *src, int len, float k,
+	float *lut)
+{
+	int j = 0;
+
+	if (lut) for (; j < len; j++) dest[j] += lut[src[j]] * k;
+#ifdef SSE2_FUNC
+	else if (have_sse2()) j = scale_add_sse2(dest, src, len, k);
+#endif
+	for (; j < len; j++) dest[j] += src[j] * k;
+}
+
+/* Same for alpha-weighted RGB, and alpha itself */
+static void scale_adda(float *dest, float *desta, unsigned char *src,
+	unsigned char *srca, int len, float k, float *lut)
+{
+	int j = 0;
+
+#ifdef SSE2_FUNC
+	if (!lut && have_sse2())
+		j = scale_adda_sse2(dest, desta, src, srca, len, k);
+#endif
+	for (src += j * 3; j < len; j++ , src += 3)
 	{
-		const double tk = kp[y];
-		double *wrk = work_area;
-		/* Only simple tiling isn't built into filter */
-		img = src + ((y + oh) % oh) * ow;
-		if (gc) /* Gamma-correct */
+		float kk = srca[j] * k;
+
+		desta[j] += kk;
+		if (lut)
 		{
-			for (j = 0; j < ow; j++)
-				*wrk++ += gamma256[*img++] * tk;
+			dest[j * 3 + 0] += lut[src[0]] * kk;
+			dest[j * 3 + 1] += lut[src[1]] * kk;
+			dest[j * 3 + 2] += lut[src[2]] * kk;
 		}
-		else /* Leave as is */
+		else
 		{
-			for (j = 0; j < ow; j++)
-				*wrk++ += *img++ * tk;
+			dest[j * 3 + 0] += src[0] * kk;
+			dest[j * 3 + 1] += src[1] * kk;
+			dest[j * 3 + 2] += src[2] * kk;
 		}
 	}
-	tile_extend(work_area, ow, -ll * bpp);
-	/* Scale it horizontally */
-	istore = gc ? istore_gc : bpp == 1 ? istore_1 : istore_3;
-	img = dest + i * nw * bpp;
-	for (tmpx = hfilter; tmpx[1].k; tmpx++ , img += bpp)
+}
+
+static void scale_dot3(float *sum, float *wrk, float *k, int n)
+{
+	float sum0, sum1, sum2;
+
+#ifdef SSE2_FUNC
+	if (have_sse2())
 	{
-		__typeof__(*tmpx->k) *tp, *kp = tmpx[1].k;
-		double *wrk = work_area + tmpx->idx * bpp;
-		double sum0, sum1, sum2;
+		scale_dot3_sse2(sum, wrk, k, n);
+		return;
+	}
+#endif
+	sum0 = sum1 = sum2 = 0.0;
+	for (; n > 0; n-- , wrk += 3)
+	{
+		const float kk = *k++;
+		sum0 += wrk[0] * kk;
+		sum1 += wrk[1] * kk;
+		sum2 += wrk[2] * kk;
+	}
+	sum[0] = sum0; sum[1] = sum1; sum[2] = sum2;
+}
 
-		sum0 = sum1 = sum2 = 0.0;
-		tp = tmpx->k;
-		while (tp != kp)
+/* Build one vertically-scaled row segment in work area; source columns are
+ * wrapped around for BOUND_TILE, as only simple tiling isn't built into filter.
+ * Alpha-weighted RGB and alpha go after RGB, if "srca" is set */
+static void scale_vert(scale_context *ctx, fstep *tmpy, int x0, int l,
+	int bpp, int gc, unsigned char *src, unsigned char *srca)
+{
+	__typeof__(*tmpy->k) *kp = tmpy->k - tmpy->idx;
+	float *wrk = ctx->rgb, *wrkc = wrk + ctx->span * 3,
+		*wrka = wrk + ctx->span * 6, *lut = gc ? ctx->lut : NULL;
+	int j, x, y, ow = ctx->ow, oh = ctx->oh, h = tmpy[1].k - kp;
+
+	memset(wrk, 0, ctx->span * (srca ? 7 : bpp) * sizeof(float));
+	for (y = tmpy->idx; y < h; y++)
+	{
+		int iy = (y + oh) % oh;
+
+		for (x = x0; x < x0 + l; x += j)
 		{
-			const double kk = *tp++;
-			sum0 += *wrk++ * kk;
-			if (bpp == 1) continue;
-			sum1 += *wrk++ * kk;
-			sum2 += *wrk++ * kk;
+			int ix = (x % ow + ow) % ow, d = x - x0;
+
+			j = x0 + l - x;
+			if (j > ow - ix) j = ow - ix;
+			scale_add(wrk + d * bpp, src + (iy * ow + ix) * bpp,
+				j * bpp, kp[y], lut);
+			if (!srca) continue;
+			scale_adda(wrkc + d * 3, wrka + d, src + (iy * ow + ix) * 3,
+				srca + iy * ow + ix, j, kp[y], lut);
 		}
-		sum[0] = sum0; sum[1] = sum1; sum[2] = sum2;
-		istore(img, sum);
 	}
 }
 
-static void scale_rgba(fstep *tmpy, fstep *hfilter, double *work_area,
-	int bpp, int gc, int ow, int oh, int nw, int i,
-	unsigned char *src, unsigned char *dest,
-	unsigned char *srca, unsigned char *dsta)
+static void scale_row(scale_context *ctx, int i, int x0, int x1, int bpp,
+	int gc, unsigned char *src, unsigned char *dest)
 {
 	/* !!! Protect from possible stack misalignment */
 	unsigned char sum_[4 * sizeof(double)];
 	double *sum = ALIGNED(sum_, sizeof(double));
+	float fsum[4];
 	istore_func istore;
-	unsigned char *img, *imga;
+	unsigned char *img;
 	fstep *tmpx;
-	__typeof__(*tmpy->k) *kp = tmpy->k - tmpy->idx;
-	int j, y, h = tmpy[1].k - kp, ll = hfilter[0].idx;
-	double *wrka = work_area + ow * 6 - ll * 13;
-
+	int l, n = scale_span(ctx->hfilter, x0, x1, &l);
 
-	work_area -= ll * 6;
-	memset(work_area, 0, (ow - ll) * 7 * sizeof(double));
-	for (y = tmpy->idx; y < h; y++)
+	scale_vert(ctx, ctx->vfilter + i, l, n, bpp, gc, src, NULL);
+	/* Scale it horizontally */
+	img = dest + (i * ctx->nw + x0) * bpp;
+#ifdef SSE2_FUNC
+	if ((bpp == 3) && !gc && have_sse2())
 	{
-		double *wrk = work_area;
-		unsigned char *img, *imga;
-		int ix = (y + oh) % oh;
+		scale_hor3_sse2(ctx->hfilter + x0, x1 - x0, ctx->rgb, l, img);
+		return;
+	}
+#endif
+	istore = gc ? istore_gc : bpp == 1 ? istore_1 : istore_3;
+	for (tmpx = ctx->hfilter + x0; x0 < x1; x0++ , tmpx++ , img += bpp)
+	{
+		__typeof__(*tmpx->k) *tp = tmpx->k, *kp = tmpx[1].k;
+		float *wrk = ctx->rgb + (tmpx->idx - l) * bpp;
 
-		img = src + ix * ow * 3;
-		imga = srca + ix * ow;
-		if (gc) /* Gamma-correct */
+		if (bpp == 1)
 		{
-			const double tk = kp[y];
-			for (j = 0; j < ow; j++)
-			{
-				const double kk = imga[j] * tk;
-				double tv;
-
-				wrka[j] += kk;
-				wrk[0] += (tv = gamma256[img[0]]) * tk;
-				wrk[3] += tv * kk;
-				wrk[1] += (tv = gamma256[img[1]]) * tk;
-				wrk[4] += tv * kk;
-				wrk[2] += (tv = gamma256[img[2]]) * tk;
-				wrk[5] += tv * kk;
-				wrk += 6; img += 3;
-			}
+			float sum0 = 0.0;
+			while (tp != kp) sum0 += *wrk++ * *tp++;
+			sum[0] = sum0;
 		}
-		else /* Leave as is */
+		else
 		{
-			const double tk = kp[y];
-			for (j = 0; j < ow; j++)
-			{
-				const double kk = imga[j] * tk;
-				double tv;
-
-				wrka[j] += kk;
-				wrk[0] += (tv = img[0]) * tk;
-				wrk[3] += tv * kk;
-				wrk[1] += (tv = img[1]) * tk;
-				wrk[4] += tv * kk;
-				wrk[2] += (tv = img[2]) * tk;
-				wrk[5] += tv * kk;
-				wrk += 6; img += 3;
-			}
+			scale_dot3(fsum, wrk, tp, kp - tp);
+			sum[0] = fsum[0]; sum[1] = fsum[1]; sum[2] = fsum[2];
 		}
+		istore(img, sum);
 	}
-	tile_extend(work_area, ow * 6, -ll * 6);
-	tile_extend(wrka, ow, -ll);
+}
+
+static void scale_rgba(scale_context *ctx, int i, int x0, int x1, int gc,
+	unsigned char *src, unsigned char *dest,
+	unsigned char *srca, unsigned char *dsta)
+{
+	/* !!! Protect from possible stack misalignment */
+	unsigned char sum_[4 * sizeof(double)];
+	double *sum = ALIGNED(sum_, sizeof(double));
+	float fsum[4];
+	istore_func istore;
+	unsigned char *img, *imga;
+	fstep *tmpx;
+	int j, l, n = scale_span(ctx->hfilter, x0, x1, &l);
+
+	scale_vert(ctx, ctx->vfilter + i, l, n, 3, gc, src, srca);
 	/* Scale it horizontally */
-	istore = gc ? istore_gc : bpp == 1 ? istore_1 : istore_3;
-	img = dest + i * nw * 3;
-	imga = dsta + i * nw;
-	for (tmpx = hfilter; tmpx[1].k; tmpx++)
+	istore = gc ? istore_gc : istore_3;
+	img = dest + (i * ctx->nw + x0) * 3;
+	imga = dsta + i * ctx->nw + x0;
+	for (tmpx = ctx->hfilter + x0; x0 < x1; x0++ , tmpx++ , img += 3)
 	{
-		__typeof__(*tmpx->k) *tp, *kp = tmpx[1].k;
-		double *wrk;
-		double sum0, sum1, sum2, mult;
+		__typeof__(*tmpx->k) *tp = tmpx->k, *kp = tmpx[1].k;
+		float *wrk = ctx->rgb + ctx->span * 6 + tmpx->idx - l;
+		double mult = 1.0;
+		float sum0 = 0.0;
 
-		sum0 = 0.0;
-		wrk = wrka + tmpx->idx;
-		tp = tmpx->k;
 		while (tp != kp) sum0 += *wrk++ * *tp++;
 		j = (int)rint(sum0);
 		*imga = j < 0 ? 0 : j > 0xFF ? 0xFF : j;
-		wrk = work_area + tmpx->idx * 6;
-		mult = 1.0;
+		wrk = ctx->rgb + (tmpx->idx - l) * 3;
 		if (*imga++)
 		{
-			wrk += 3;
+			wrk += ctx->span * 3;
 			mult /= sum0;
 		}
-		sum0 = sum1 = sum2 = 0.0;
 		tp = tmpx->k;
-		while (tp != kp)
-		{
-			const double kk = *tp++;
-			sum0 += wrk[0] * kk;
-			sum1 += wrk[1] * kk;
-			sum2 += wrk[2] * kk;
-			wrk += 6;
-		}
-		sum[0] = sum0 * mult; sum[1] = sum1 * mult; sum[2] = sum2 * mult;
+		scale_dot3(fsum, wrk, tp, kp - tp);
+		sum[0] = fsum[0] * mult;
+		sum[1] = fsum[1] * mult;
+		sum[2] = fsum[2] * mult;
 		istore(img, sum);
-		img += 3;
 	}
 }
 
+/* Work is split into tiles: each band of columns goes row by row */
 static void do_scale(tcb *thread)
 {
 	scale_context ctx = *(scale_context *)thread->data;
-	fstep *tmpy;
-	int i, ii, cc, cnt = thread->nsteps;
+	int i, ii, cc, x0, x1, cnt = thread->nsteps;
 
 
-	/* For each destination line */
-	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	/* For each destination line segment */
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
 	{
-		tmpy = ctx.vfilter + i;
+		x0 = (i / ctx.nh) * ctx.tw;
+		x1 = x0 + ctx.tw > ctx.nw ? ctx.nw : x0 + ctx.tw;
+		i %= ctx.nh;
 		if (ctx.dest[CHN_IMAGE]) // Chanlist may contain, e.g., only mask
 		{
-			(ctx.tmask == CMASK_NONE ? (__typeof__(&scale_rgba))scale_row :
-				scale_rgba)(tmpy, ctx.hfilter, ctx.rgb,
-				3, ctx.gcor, ctx.ow, ctx.oh, ctx.nw, i,
+			if (ctx.tmask == CMASK_NONE) scale_row(&ctx, i, x0, x1,
+				3, ctx.gcor, ctx.src[CHN_IMAGE], ctx.dest[CHN_IMAGE]);
+			else scale_rgba(&ctx, i, x0, x1, ctx.gcor,
 				ctx.src[CHN_IMAGE], ctx.dest[CHN_IMAGE],
 				ctx.src[CHN_ALPHA], ctx.dest[CHN_ALPHA]);
 		}
@@ -5618,8 +7139,7 @@ static void do_scale(tcb *thread)
 		for (cc = CHN_IMAGE + 1; cc < NUM_CHANNELS; cc++)
 		{
 			if (ctx.dest[cc] && !(ctx.tmask & CMASK_FOR(cc)))
-				scale_row(tmpy, ctx.hfilter, ctx.rgb,
-					1, FALSE, ctx.ow, ctx.oh, ctx.nw, i,
+				scale_row(&ctx, i, x0, x1, 1, FALSE,
 					ctx.src[cc], ctx.dest[cc]);
 		}
 
@@ -5685,9 +7205,10 @@ int mem_image_scale_real(chanlist old_img, int ow, int oh, int bpp,
 		return (1);	// Not enough memory
 
 	if (type && (bpp == 3))
-		launch_threads(do_scale, ctx.tdata, NULL, nh);
+		launch_threads(do_scale, ctx.tdata, NULL, nh * ctx.bands);
 	else do_scale_nn(old_img, new_img, bpp, type, ow, oh, nw, nh, gcor, FALSE);
 
+	clear_scale(&ctx);
 	return (0);
 }
 
@@ -5719,7 +7240,8 @@ int mem_image_scale(int nw, int nh, int type, int gcor, int sharp, int bound)	//
 	{
 		progress_init(_("Scaling Image"), 0);
 		if (type && (mem_img_bpp == 3))
-			launch_threads(do_scale, ctx.tdata, NULL, mem_height);
+			launch_threads(do_scale, ctx.tdata, NULL,
+				mem_height * ctx.bands);
 		else do_scale_nn(old_img, mem_img, mem_img_bpp, type,
 			ctx.ow, ctx.oh, nw, nh, gcor, TRUE);
 		progress_end();
@@ -6514,6 +8036,7 @@ void put_pixel_def(int x, int y)	/* Combined */
 		cset[2] = mem_col_pat24[i + 2];
 	}
 
+	mem_undo_dirty(x, y, 1, 1);
 	old_image = mem_undo_opacity ? mem_undo_previous(mem_channel) :
 		mem_img[mem_channel];
 	if ((mem_channel == CHN_IMAGE) && RGBA_mode)
@@ -6601,6 +8124,7 @@ void put_pixel_row_def(int x, int y, int len, unsigned char *xsel)
 
 
 	if (len <= 0) return;
+	mem_undo_dirty(x, y, len, 1);
 
 	old_image = mem_undo_opacity ? mem_undo_previous(mem_channel) :
 		mem_img[mem_channel];
@@ -6897,34 +8421,144 @@ void copy_area(image_info *dest, image_info *src, int x, int y)
 
 int mem_count_all_cols()				// Count all colours - Using main image
 {
-	return mem_count_all_cols_real(mem_img[CHN_IMAGE], mem_width, mem_height);
+	static imgkey key;
+	static int cols;
+	imgkey now;
+
+	if (!same_image(&now, &key, mem_img[CHN_IMAGE], mem_img_bpp))
+	{
+		cols = mem_count_all_cols_real(mem_img[CHN_IMAGE],
+			mem_width, mem_height);
+		if (cols >= 0) key = now; // Do not keep a failure
+	}
+	return (cols);
+}
+
+/* Colours get counted by sorting them in small images, and in a bitset of
+ * all 16M colours otherwise; a thread fills its own bitset, and they get
+ * merged. Colours up to a limit get listed, in order of first appearance,
+ * with hash tables: image is cut in bands, a thread lists colours of a band
+ * till it has as many as the limit, and the lists get merged in order */
+
+#define COLS_SORTED 65536 /* Bitset is cheaper to clear than to sort more */
+#define COLS_BITSET (0x1000000 / 32)
+#define COLS_BANDS 64
+
+typedef struct {
+	unsigned char *img;
+	guint32 *bits;
+	int *lists, *hash;
+	int w, h, max;
+} colsd;
+
+static void cols_bitset(tcb *thread)
+{
+	colsd *cd = thread->data;
+	unsigned char *im;
+	guint32 *bits = cd->bits;
+	int i, j, ii, cnt = thread->nsteps;
+
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		im = cd->img + (size_t)i * cd->w * 3;
+		for (j = cd->w; j > 0; j-- , im += 3)
+			bits[(im[0] >> 5) + (im[1] << 3) + (im[2] << 11)] |=
+				1 << (im[0] & 31);
+		thread_step(thread, ii + 1, cnt, 10);
+	}
+	thread_done(thread);
 }
 
-int mem_count_all_cols_real(unsigned char *im, int w, int h)	// Count all colours - very memory greedy
+static int cols_sorted(unsigned char *im, int cnt)
 {
-	guint32 *tab;
-	int i, j, k, ix;
+	guint32 *buf, *src, *dest, *tmp;
+	int i, n, shift, res, idx[256];
 
-	j = 0x80000;
-	tab = calloc(j, sizeof(guint32));	// HUGE colour cube
-	if (!tab) return -1;			// Not enough memory Mr Greedy ;-)
+	if (cnt < 2) return (cnt);
+	if (!(buf = malloc(cnt * 2 * sizeof(guint32)))) return (-1);
+	for (i = 0; i < cnt; i++ , im += 3) buf[i] = MEM_2_INT(im, 0);
 
-	k = w * h;
-	for (i = 0; i < k; i++)			// Scan each pixel
+	/* LSD radix sort, 8 bits at a time */
+	src = buf; dest = buf + cnt;
+	for (shift = 0; shift < 24; shift += 8)
 	{
-		ix = (im[0] >> 5) + (im[1] << 3) + (im[2] << 11);
-		tab[ix] |= 1 << (im[0] & 31);
-		im += 3;
+		memset(idx, 0, sizeof(idx));
+		for (i = 0; i < cnt; i++) idx[(src[i] >> shift) & 0xFF]++;
+		for (i = n = 0; i < 256; i++)
+		{
+			int k = idx[i];
+			idx[i] = n;
+			n += k;
+		}
+		for (i = 0; i < cnt; i++)
+			dest[idx[(src[i] >> shift) & 0xFF]++] = src[i];
+		tmp = src; src = dest; dest = tmp;
 	}
 
-	// Count each colour
-	for (i = k = 0; i < j; i++) k += bitcount(tab[i]);
+	for (i = res = 1; i < cnt; i++) res += src[i] != src[i - 1];
+	free(buf);
+	return (res);
+}
+
+int mem_count_all_cols_real(unsigned char *im, int w, int h)	// Count all colours
+{
+	colsd cd;
+	threaddata *tdata;
+	guint32 *bits, *tb;
+	int i, j, k;
+
+	if (w * h <= COLS_SORTED) return (cols_sorted(im, w * h));
+
+	memset(&cd, 0, sizeof(cd));
+	cd.img = im;
+	cd.w = w;
+	tdata = talloc(0, h, &cd, sizeof(cd),
+		NULL,
+		&cd.bits, COLS_BITSET * sizeof(guint32),
+		NULL);
+	if (!tdata) return (-1);		// Not enough memory
+	launch_threads(cols_bitset, tdata, NULL, h);
+
+	/* Merge bitsets, and count each colour */
+	bits = cd.bits;
+	for (i = 1; i < tdata->count; i++)
+	{
+		tb = ((colsd *)tdata->threads[i]->data)->bits;
+		for (j = 0; j < COLS_BITSET; j++) bits[j] |= tb[j];
+	}
+	for (i = k = 0; i < COLS_BITSET; i++) k += bitcount(bits[i]);
 
-	free(tab);
+	free(tdata);
 
 	return k;
 }
 
+static void cols_list(tcb *thread)
+{
+	colsd *cd = thread->data;
+	unsigned char *im;
+	int i, l, ii, pix, last, cnt, *list, tcnt = thread->nsteps;
+
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		list = cd->lists + i * (cd->max + 1);
+		memset(cd->hash, 0, COLHASH_SIZE * 2 * sizeof(int));
+		l = (cd->h * (i + 1)) / COLS_BANDS - (cd->h * i) / COLS_BANDS;
+		l *= cd->w;
+		im = cd->img + (size_t)((cd->h * i) / COLS_BANDS) * cd->w * 3;
+		for (cnt = 0 , last = -1; (l > 0) && (cnt < cd->max);
+			l-- , im += 3)
+		{
+			if ((pix = MEM_2_INT(im, 0)) == last) continue;
+			if (colhash_add(cd->hash, last = pix, cnt) < 0)
+				list[++cnt] = pix;
+		}
+		list[0] = cnt;
+		thread_step(thread, ii + 1, tcnt, 10);
+	}
+	thread_done(thread);
+}
+
 int mem_cols_used(int max_count)			// Count colours used in main RGB image
 {
 	if ( mem_img_bpp == 1 ) return -1;			// RGB only
@@ -6936,30 +8570,41 @@ int mem_cols_used(int max_count)			// Count colours used in main RGB image
 int mem_cols_used_real(unsigned char *im, int w, int h, int max_count, int prog)
 			// Count colours used in RGB chunk
 {
-	int i, j = w * h * 3, k, res = 1, pix;
-
-	found[0] = MEM_2_INT(im, 0);
+	colsd cd;
+	threaddata *tdata;
+	int i, j, res, *list;
+
+	if (max_count > 1024) max_count = 1024; // Size of found[]
+	memset(&cd, 0, sizeof(cd));
+	cd.img = im;
+	cd.w = w;
+	cd.h = h;
+	cd.max = max_count;
+	tdata = talloc(0, h, &cd, sizeof(cd),
+		&cd.lists, COLS_BANDS * (max_count + 1) * sizeof(int),
+		NULL,
+		&cd.hash, COLHASH_SIZE * 2 * sizeof(int),
+		NULL);
+	if (!tdata) return (max_count); // Cannot tell, so too many
 	if (prog) progress_init(_("Counting Unique RGB Pixels"), 0);
-	for (i = 3; (i < j) && (res < max_count); i += 3) // Skim all pixels
+	launch_threads(cols_list, tdata, NULL, COLS_BANDS);
+	if (prog) progress_end();
+
+	/* Merge the bands' lists */
+	memset(cd.hash, 0, COLHASH_SIZE * 2 * sizeof(int));
+	for (i = res = 0; (i < COLS_BANDS) && (res < max_count); i++)
 	{
-		pix = MEM_2_INT(im, i);
-		for (k = 0; k < res; k++)
-		{
-			if (found[k] == pix) break;
-		}
-		if (k >= res)	// New colour so add to list
-		{
-			found[res++] = pix;
-			if (!prog || (res & 7)) continue;
-			if (progress_update((float)res / max_count)) break;
-		}
+		list = cd.lists + i * (max_count + 1);
+		for (j = 1; (j <= list[0]) && (res < max_count); j++)
+			if (colhash_add(cd.hash, list[j], res) < 0)
+				found[res++] = list[j];
 	}
-	if (prog) progress_end();
+
+	free(tdata);
 
 	return (res);
 }
 
-
 ////	EFFECTS
 
 static inline double dist(int n1, int n2)
@@ -6967,152 +8612,397 @@ static inline double dist(int n1, int n2)
 	return (sqrt(n1 * n1 + n2 * n2));
 }
 
+typedef struct {
+	unsigned char *mask;
+	int type, param;
+} effectd;
+
+/* Process bytes from j0 to j1 of a row; "ops" holds opacity per byte */
+static void effect_row(int type, int param, unsigned char *src,
+	unsigned char *dest, unsigned char *ops, int j0, int j1, int ll,
+	int bpp, int dym1, int dyp1)
+{
+	int j, k = 0, k1, k2, op, dxp1, dxm1;
+	double blur = (double)param / 200.0;
+
+	src += j0; dest += j0;
+	for (j = j0; j < j1; j++ , src++ , dest++)
+	{
+		if ((op = ops[j]) == 255) continue;
+		dxp1 = j < ll - bpp ? bpp : -bpp;
+		dxm1 = j >= bpp ? -bpp : bpp;
+		switch (type)
+		{
+		case FX_EDGE: /* Edge detect */
+			k = *src;
+			k = abs(k - src[dym1]) + abs(k - src[dyp1]) +
+				abs(k - src[dxm1]) + abs(k - src[dxp1]);
+			k += k >> 1;
+			break;
+		case FX_EMBOSS: /* Emboss */
+			k = src[dym1] + src[dxm1] +
+				src[dxm1 + dym1] + src[dxp1 + dym1];
+			k = k / 4 - *src + 127;
+			break;
+		case FX_SHARPEN: /* Edge sharpen */
+			k = src[dym1] + src[dyp1] +
+				src[dxm1] + src[dxp1] - 4 * src[0];
+			k = *src - blur * k;
+			break;
+		case FX_SOFTEN: /* Edge soften */
+			k = src[dym1] + src[dyp1] +
+				src[dxm1] + src[dxp1] - 4 * src[0];
+			k = *src + (5 * k) / (125 - param);
+			break;
+		case FX_SOBEL: /* Another edge detector */
+			k = dist((src[dxp1] - src[dxm1]) * 2 +
+				src[dym1 + dxp1] - src[dym1 + dxm1] +
+				src[dyp1 + dxp1] - src[dyp1 + dxm1],
+				(src[dyp1] - src[dym1]) * 2 +
+				src[dyp1 + dxm1] + src[dyp1 + dxp1] -
+				src[dym1 + dxm1] - src[dym1 + dxp1]);
+			break;
+		case FX_PREWITT: /* Yet another edge detector */
+/* Actually, the filter kernel used is "Robinson"; what is attributable to
+ * Prewitt is "compass filtering", which can be done with other filter
+ * kernels too - WJ */
+		case FX_KIRSCH: /* Compass detector with another kernel */
+/* Optimized compass detection algorithm: I calculate three values (compass,
+ * plus and minus) and then mix them according to filter type - WJ */
+			k = 0;
+			k1 = src[dyp1 + dxm1] - src[dxp1];
+			if (k < k1) k = k1;
+			k1 += src[dyp1] - src[dym1 + dxp1];
+			if (k < k1) k = k1;
+			k1 += src[dyp1 + dxp1] - src[dym1];
+			if (k < k1) k = k1;
+			k1 += src[dxp1] - src[dym1 + dxm1];
+			if (k < k1) k = k1;
+			k1 += src[dym1 + dxp1] - src[dxm1];
+			if (k < k1) k = k1;
+			k1 += src[dym1] - src[dyp1 + dxm1];
+			if (k < k1) k = k1;
+			k1 += src[dym1 + dxm1] - src[dyp1];
+			if (k < k1) k = k1;
+			k1 = src[dym1 + dxm1] + src[dym1] + src[dym1 + dxp1] +
+				src[dxm1] + src[dxp1];
+			k2 = src[dyp1 + dxm1] + src[dyp1] + src[dyp1 + dxp1];
+			if (type == FX_PREWITT)
+				k = k * 2 + k1 - k2 - src[0] * 2;
+			else /* if (type == FX_KIRSCH) */
+				k = (k * 8 + k1 * 3 - k2 * 5) / 4;
+				// Division is for equalizing weight of edge
+			break;
+		case FX_GRADIENT: /* Still another edge detector */
+			k = 4.0 * dist(src[dxp1] - src[0],
+				src[dyp1] - src[0]);
+			break;
+		case FX_ROBERTS: /* One more edge detector */
+			k = 4.0 * dist(src[dyp1 + dxp1] - src[0],
+				src[dxp1] - src[dyp1]);
+			break;
+		case FX_LAPLACE: /* The last edge detector... I hope */
+			k = src[dym1 + dxm1] + src[dym1] + src[dym1 + dxp1] +
+				src[dxm1] - 8 * src[0] + src[dxp1] +
+				src[dyp1 + dxm1] + src[dyp1] + src[dyp1 + dxp1];
+			break;
+		case FX_MORPHEDGE: /* Morphological edge detection */
+		case FX_ERODE: /* Greyscale erosion */
+			k = src[0];
+			if (k > src[dym1 + dxm1]) k = src[dym1 + dxm1];
+			if (k > src[dym1]) k = src[dym1];
+			if (k > src[dym1 + dxp1]) k = src[dym1 + dxp1];
+			if (k > src[dxm1]) k = src[dxm1];
+			if (k > src[dxp1]) k = src[dxp1];
+			if (k > src[dyp1 + dxm1]) k = src[dyp1 + dxm1];
+			if (k > src[dyp1]) k = src[dyp1];
+			if (k > src[dyp1 + dxp1]) k = src[dyp1 + dxp1];
+			if (type == FX_MORPHEDGE)
+				k = (src[0] - k) * 2;
+			break;
+		case FX_DILATE: /* Greyscale dilation */
+			k = src[0];
+			if (k < src[dym1 + dxm1]) k = src[dym1 + dxm1];
+			if (k < src[dym1]) k = src[dym1];
+			if (k < src[dym1 + dxp1]) k = src[dym1 + dxp1];
+			if (k < src[dxm1]) k = src[dxm1];
+			if (k < src[dxp1]) k = src[dxp1];
+			if (k < src[dyp1 + dxm1]) k = src[dyp1 + dxm1];
+			if (k < src[dyp1]) k = src[dyp1];
+			if (k < src[dyp1 + dxp1]) k = src[dyp1 + dxp1];
+			break;
+		}
+		k = k < 0 ? 0 : k > 0xFF ? 0xFF : k;
+		k = 255 * k + (*src - k) * op;
+		*dest = (k + (k >> 8) + 1) >> 8;
+	}
+}
+
+/* SSE2 version processes 16 bytes per step, away from the left and right
+ * edges. The results are exactly the same as from effect_row() */
+
+#ifdef SSE2_FUNC
+
+/* Truncate 4 doubles to ints */
+static SSE2_FUNC __m128i trunc4(__m128d d0, __m128d d1)
+{
+	return (_mm_unpacklo_epi64(_mm_cvttpd_epi32(d0), _mm_cvttpd_epi32(d1)));
+}
+
+/* (int)(c - b * l) for 4 ints */
+static SSE2_FUNC __m128i sharp4(__m128i c, __m128i l, __m128d b)
+{
+	return (trunc4(_mm_sub_pd(_mm_cvtepi32_pd(c),
+		_mm_mul_pd(b, _mm_cvtepi32_pd(l))),
+		_mm_sub_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(c, 0x0E)),
+		_mm_mul_pd(b, _mm_cvtepi32_pd(_mm_shuffle_epi32(l, 0x0E))))));
+}
+
+/* l / q for 4 ints; exact in doubles */
+static SSE2_FUNC __m128i quot4(__m128i l, __m128d q)
+{
+	return (trunc4(_mm_div_pd(_mm_cvtepi32_pd(l), q),
+		_mm_div_pd(_mm_cvtepi32_pd(_mm_shuffle_epi32(l, 0x0E)), q)));
+}
+
+/* (int)(f * sqrt(l)) for 4 ints */
+static SSE2_FUNC __m128i sqrt4(__m128i l, __m128d f)
+{
+	return (trunc4(_mm_mul_pd(_mm_sqrt_pd(_mm_cvtepi32_pd(l)), f),
+		_mm_mul_pd(_mm_sqrt_pd(_mm_cvtepi32_pd(
+		_mm_shuffle_epi32(l, 0x0E))), f)));
+}
+
+/* Neighbours, as 8 words each: 0-2 above, 3-5 same row, 6-8 below */
+static SSE2_FUNC __m128i effect_sse2(int type, int param, const __m128i *v)
+{
+	__m128i z = _mm_setzero_si128(), k, k1, k2;
+	__m128d f;
+
+	switch (type)
+	{
+	case FX_EDGE:
+#define ABSD(A,B) _mm_max_epi16(_mm_sub_epi16(A, B), _mm_sub_epi16(B, A))
+		k = _mm_add_epi16(_mm_add_epi16(ABSD(v[4], v[1]),
+			ABSD(v[4], v[7])), _mm_add_epi16(ABSD(v[4], v[3]),
+			ABSD(v[4], v[5])));
+#undef ABSD
+		return (_mm_add_epi16(k, _mm_srai_epi16(k, 1)));
+	case FX_EMBOSS:
+		k = _mm_add_epi16(_mm_add_epi16(v[1], v[3]),
+			_mm_add_epi16(v[0], v[2]));
+		k = _mm_sub_epi16(_mm_srai_epi16(k, 2), v[4]);
+		return (_mm_add_epi16(k, _mm_set1_epi16(127)));
+	case FX_SHARPEN:
+	case FX_SOFTEN:
+		k = _mm_add_epi16(_mm_add_epi16(v[1], v[7]),
+			_mm_add_epi16(v[3], v[5]));
+		k = _mm_sub_epi16(k, _mm_slli_epi16(v[4], 2));
+		if (type == FX_SOFTEN) k = _mm_mullo_epi16(k, _mm_set1_epi16(5));
+		/* Sign-extend to 32 bits */
+		k1 = _mm_srai_epi32(_mm_unpacklo_epi16(k, k), 16);
+		k2 = _mm_srai_epi32(_mm_unpackhi_epi16(k, k), 16);
+		if (type == FX_SHARPEN)
+		{
+			f = _mm_set1_pd((double)param / 200.0);
+			k1 = sharp4(_mm_unpacklo_epi16(v[4], z), k1, f);
+			k2 = sharp4(_mm_unpackhi_epi16(v[4], z), k2, f);
+		}
+		else
+		{
+			f = _mm_set1_pd(125 - param);
+			k1 = _mm_add_epi32(_mm_unpacklo_epi16(v[4], z),
+				quot4(k1, f));
+			k2 = _mm_add_epi32(_mm_unpackhi_epi16(v[4], z),
+				quot4(k2, f));
+		}
+		return (_mm_packs_epi32(k1, k2));
+	case FX_SOBEL:
+		k1 = _mm_add_epi16(_mm_slli_epi16(_mm_sub_epi16(v[5], v[3]), 1),
+			_mm_sub_epi16(_mm_add_epi16(v[2], v[8]),
+			_mm_add_epi16(v[0], v[6])));
+		k2 = _mm_add_epi16(_mm_slli_epi16(_mm_sub_epi16(v[7], v[1]), 1),
+			_mm_sub_epi16(_mm_add_epi16(v[6], v[8]),
+			_mm_add_epi16(v[0], v[2])));
+		f = _mm_set1_pd(1.0);
+		break;
+	case FX_GRADIENT:
+		k1 = _mm_sub_epi16(v[5], v[4]);
+		k2 = _mm_sub_epi16(v[7], v[4]);
+		f = _mm_set1_pd(4.0);
+		break;
+	case FX_ROBERTS:
+		k1 = _mm_sub_epi16(v[8], v[4]);
+		k2 = _mm_sub_epi16(v[5], v[7]);
+		f = _mm_set1_pd(4.0);
+		break;
+	case FX_PREWITT:
+	case FX_KIRSCH:
+#define STEP(A,B) k = _mm_max_epi16(k, k1 = _mm_add_epi16(k1, _mm_sub_epi16(A, B)))
+		k = k1 = z;
+		STEP(v[6], v[5]);
+		STEP(v[7], v[2]);
+		STEP(v[8], v[1]);
+		STEP(v[5], v[0]);
+		STEP(v[2], v[3]);
+		STEP(v[1], v[6]);
+		STEP(v[0], v[7]);
+#undef STEP
+		k1 = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(v[0], v[1]),
+			_mm_add_epi16(v[2], v[3])), v[5]);
+		k2 = _mm_add_epi16(_mm_add_epi16(v[6], v[7]), v[8]);
+		if (type == FX_PREWITT) return (_mm_sub_epi16(_mm_add_epi16(
+			_mm_slli_epi16(_mm_sub_epi16(k, v[4]), 1), k1), k2));
+		k = _mm_sub_epi16(_mm_add_epi16(_mm_slli_epi16(k, 3),
+			_mm_mullo_epi16(k1, _mm_set1_epi16(3))),
+			_mm_mullo_epi16(k2, _mm_set1_epi16(5)));
+		/* Division must round toward zero */
+		k = _mm_add_epi16(k, _mm_and_si128(_mm_srai_epi16(k, 15),
+			_mm_set1_epi16(3)));
+		return (_mm_srai_epi16(k, 2));
+	case FX_LAPLACE:
+		k = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(v[0], v[1]),
+			_mm_add_epi16(v[2], v[3])), _mm_add_epi16(_mm_add_epi16(v[5],
+			v[6]), _mm_add_epi16(v[7], v[8])));
+		return (_mm_sub_epi16(k, _mm_slli_epi16(v[4], 3)));
+	case FX_MORPHEDGE:
+	case FX_ERODE:
+		k = _mm_min_epi16(_mm_min_epi16(_mm_min_epi16(v[0], v[1]),
+			_mm_min_epi16(v[2], v[3])), _mm_min_epi16(_mm_min_epi16(v[4],
+			v[5]), _mm_min_epi16(_mm_min_epi16(v[6], v[7]), v[8])));
+		if (type == FX_ERODE) return (k);
+		return (_mm_slli_epi16(_mm_sub_epi16(v[4], k), 1));
+	case FX_DILATE:
+		return (_mm_max_epi16(_mm_max_epi16(_mm_max_epi16(v[0], v[1]),
+			_mm_max_epi16(v[2], v[3])), _mm_max_epi16(_mm_max_epi16(v[4],
+			v[5]), _mm_max_epi16(_mm_max_epi16(v[6], v[7]), v[8]))));
+	default: return (v[4]); // Not reached
+	}
+
+	/* Distance-based detectors: scaled root of sum of squares */
+	k = _mm_unpacklo_epi16(k1, k2);
+	k = sqrt4(_mm_madd_epi16(k, k), f);
+	k1 = _mm_unpackhi_epi16(k1, k2);
+	k1 = sqrt4(_mm_madd_epi16(k1, k1), f);
+	return (_mm_packs_epi32(k, k1));
+}
+
+/* Returns where it stopped */
+static SSE2_FUNC int effect_row_sse2(int type, int param, unsigned char *src,
+	unsigned char *dest, unsigned char *ops, int ll, int bpp,
+	int dym1, int dyp1)
+{
+	__m128i v[9], w[9], z = _mm_setzero_si128();
+	int i, j;
+
+	if ((type != FX_EDGE) && ((type < FX_EMBOSS) || (type > FX_MORPHEDGE)))
+		return (bpp); // Not an effect
+#if !defined(__x86_64__) && !defined(__SSE2_MATH__)
+	/* x87 math can round differently from SSE2 here */
+	if (type == FX_SHARPEN) return (bpp);
+#endif
+	for (j = bpp; j + 16 <= ll - bpp; j += 16)
+	{
+		__m128i k, s, op, t, th, m;
+
+		for (i = 0; i < 9; i++)
+		{
+			unsigned char *tmp = src + j + (i / 3 == 0 ? dym1 :
+				i / 3 == 2 ? dyp1 : 0) + (i % 3 - 1) * bpp;
+			s = _mm_loadu_si128((__m128i *)tmp);
+			v[i] = _mm_unpacklo_epi8(s, z);
+			w[i] = _mm_unpackhi_epi8(s, z);
+		}
+		k = _mm_packus_epi16(effect_sse2(type, param, v),
+			effect_sse2(type, param, w));
+		/* Mix in the original as per opacity */
+		s = _mm_loadu_si128((__m128i *)(src + j));
+		op = _mm_loadu_si128((__m128i *)(ops + j));
+		m = _mm_set1_epi16(255);
+#define MIX(K) _mm_add_epi16(_mm_mullo_epi16(_mm_unpack##K##_epi8(k, z), \
+	_mm_sub_epi16(m, _mm_unpack##K##_epi8(op, z))), \
+	_mm_mullo_epi16(_mm_unpack##K##_epi8(s, z), _mm_unpack##K##_epi8(op, z)))
+		t = MIX(lo); th = MIX(hi);
+#undef MIX
+		m = _mm_set1_epi16(1);
+		t = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(t,
+			_mm_srli_epi16(t, 8)), m), 8);
+		th = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(th,
+			_mm_srli_epi16(th, 8)), m), 8);
+		k = _mm_packus_epi16(t, th);
+		/* Fully protected bytes stay as they were */
+		m = _mm_cmpeq_epi8(op, _mm_set1_epi8(-1));
+		t = _mm_loadu_si128((__m128i *)(dest + j));
+		k = _mm_or_si128(_mm_and_si128(m, t), _mm_andnot_si128(m, k));
+		_mm_storeu_si128((__m128i *)(dest + j), k);
+	}
+	return (j);
+}
+
+#endif
+
+static void effect_filter(tcb *thread)
+{
+	effectd *ed = thread->data;
+	unsigned char *src, *dest, *chan, *mask = ed->mask;
+	int i, ii, j, bpp, ll, dyp1, dym1, cnt;
+
+	cnt = thread->nsteps;
+	bpp = MEM_BPP;
+	ll = mem_width * bpp;
+	chan = mem_undo_previous(mem_channel);
+
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		src = chan + i * ll;
+		dest = mem_img[mem_channel] + i * ll;
+		row_protected(0, i, mem_width, mask);
+		if (bpp == 3) /* Expand opacity to per-byte, in place */
+		{
+			for (j = mem_width - 1; j >= 0; j--)
+				mask[j * 3] = mask[j * 3 + 1] =
+					mask[j * 3 + 2] = mask[j];
+		}
+		dyp1 = i < mem_height - 1 ? ll : -ll;
+		dym1 = i ? -ll : ll;
+		j = 0;
+#ifdef SSE2_FUNC
+		if (have_sse2())
+		{
+			effect_row(ed->type, ed->param, src, dest, mask,
+				0, bpp, ll, bpp, dym1, dyp1);
+			j = effect_row_sse2(ed->type, ed->param, src, dest,
+				mask, ll, bpp, dym1, dyp1);
+		}
+#endif
+		effect_row(ed->type, ed->param, src, dest, mask, j, ll,
+			ll, bpp, dym1, dyp1);
+		if (thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
 void do_effect(int type, int param)
 {
-	unsigned char *src, *dest, *tmp, *mask;
-	int i, j, k = 0, k1, k2, bpp, ll, dxp1, dxm1, dyp1, dym1;
-	int op, md, ms;
-	double blur = (double)param / 200.0;
-
-	bpp = MEM_BPP;
-	ll = mem_width * bpp;
-	ms = bpp == 3 ? 1 : 4;
+	effectd ed;
+	threaddata *tdata;
 
-	src = mem_undo_previous(mem_channel);
-	dest = mem_img[mem_channel];
-	mask = malloc(mem_width);
-	if (!mask)
+	ed.type = type;
+	ed.param = param;
+	tdata = talloc(0, 0, &ed, sizeof(ed),
+		NULL,
+		&ed.mask, mem_width * MEM_BPP,
+		NULL);
+	if (!tdata)
 	{
 		memory_errors(1);
 		return;
 	}
-	progress_init(_("Applying Effect"), 1);
 
-	for (i = 0; i < mem_height; i++)
-	{
-		row_protected(0, i, mem_width, tmp = mask);
-		dyp1 = i < mem_height - 1 ? ll : -ll;
-		dym1 = i ? -ll : ll;
-		for (md = j = 0; j < ll; j++ , src++ , dest++)
-		{
-			op = *tmp;
-			/* One step for 1 or 3 bytes */
-			md += ms + (md >> 1);
-			tmp += md >> 2;
-			md &= 3;
-			if (op == 255) continue;
-			dxp1 = j < ll - bpp ? bpp : -bpp;
-			dxm1 = j >= bpp ? -bpp : bpp;
-			switch (type)
-			{
-			case FX_EDGE: /* Edge detect */
-				k = *src;
-				k = abs(k - src[dym1]) + abs(k - src[dyp1]) +
-					abs(k - src[dxm1]) + abs(k - src[dxp1]);
-				k += k >> 1;
-				break;
-			case FX_EMBOSS: /* Emboss */
-				k = src[dym1] + src[dxm1] +
-					src[dxm1 + dym1] + src[dxp1 + dym1];
-				k = k / 4 - *src + 127;
-				break;
-			case FX_SHARPEN: /* Edge sharpen */
-				k = src[dym1] + src[dyp1] +
-					src[dxm1] + src[dxp1] - 4 * src[0];
-				k = *src - blur * k;
-				break;
-			case FX_SOFTEN: /* Edge soften */
-				k = src[dym1] + src[dyp1] +
-					src[dxm1] + src[dxp1] - 4 * src[0];
-				k = *src + (5 * k) / (125 - param);
-				break;
-			case FX_SOBEL: /* Another edge detector */
-				k = dist((src[dxp1] - src[dxm1]) * 2 +
-					src[dym1 + dxp1] - src[dym1 + dxm1] +
-					src[dyp1 + dxp1] - src[dyp1 + dxm1],
-					(src[dyp1] - src[dym1]) * 2 +
-					src[dyp1 + dxm1] + src[dyp1 + dxp1] -
-					src[dym1 + dxm1] - src[dym1 + dxp1]);
-				break;
-			case FX_PREWITT: /* Yet another edge detector */
-/* Actually, the filter kernel used is "Robinson"; what is attributable to
- * Prewitt is "compass filtering", which can be done with other filter
- * kernels too - WJ */
-			case FX_KIRSCH: /* Compass detector with another kernel */
-/* Optimized compass detection algorithm: I calculate three values (compass,
- * plus and minus) and then mix them according to filter type - WJ */
-				k = 0;
-				k1 = src[dyp1 + dxm1] - src[dxp1];
-				if (k < k1) k = k1;
-				k1 += src[dyp1] - src[dym1 + dxp1];
-				if (k < k1) k = k1;
-				k1 += src[dyp1 + dxp1] - src[dym1];
-				if (k < k1) k = k1;
-				k1 += src[dxp1] - src[dym1 + dxm1];
-				if (k < k1) k = k1;
-				k1 += src[dym1 + dxp1] - src[dxm1];
-				if (k < k1) k = k1;
-				k1 += src[dym1] - src[dyp1 + dxm1];
-				if (k < k1) k = k1;
-				k1 += src[dym1 + dxm1] - src[dyp1];
-				if (k < k1) k = k1;
-				k1 = src[dym1 + dxm1] + src[dym1] + src[dym1 + dxp1] +
-					src[dxm1] + src[dxp1];
-				k2 = src[dyp1 + dxm1] + src[dyp1] + src[dyp1 + dxp1];
-				if (type == FX_PREWITT)
-					k = k * 2 + k1 - k2 - src[0] * 2;
-				else /* if (type == FX_KIRSCH) */
-					k = (k * 8 + k1 * 3 - k2 * 5) / 4;
-					// Division is for equalizing weight of edge
-				break;
-			case FX_GRADIENT: /* Still another edge detector */
-				k = 4.0 * dist(src[dxp1] - src[0],
-					src[dyp1] - src[0]);
-				break;
-			case FX_ROBERTS: /* One more edge detector */
-				k = 4.0 * dist(src[dyp1 + dxp1] - src[0],
-					src[dxp1] - src[dyp1]);
-				break;
-			case FX_LAPLACE: /* The last edge detector... I hope */
-				k = src[dym1 + dxm1] + src[dym1] + src[dym1 + dxp1] +
-					src[dxm1] - 8 * src[0] + src[dxp1] +
-					src[dyp1 + dxm1] + src[dyp1] + src[dyp1 + dxp1];
-				break;
-			case FX_MORPHEDGE: /* Morphological edge detection */
-			case FX_ERODE: /* Greyscale erosion */
-				k = src[0];
-				if (k > src[dym1 + dxm1]) k = src[dym1 + dxm1];
-				if (k > src[dym1]) k = src[dym1];
-				if (k > src[dym1 + dxp1]) k = src[dym1 + dxp1];
-				if (k > src[dxm1]) k = src[dxm1];
-				if (k > src[dxp1]) k = src[dxp1];
-				if (k > src[dyp1 + dxm1]) k = src[dyp1 + dxm1];
-				if (k > src[dyp1]) k = src[dyp1];
-				if (k > src[dyp1 + dxp1]) k = src[dyp1 + dxp1];
-				if (type == FX_MORPHEDGE)
-					k = (src[0] - k) * 2;
-				break;
-			case FX_DILATE: /* Greyscale dilation */
-				k = src[0];
-				if (k < src[dym1 + dxm1]) k = src[dym1 + dxm1];
-				if (k < src[dym1]) k = src[dym1];
-				if (k < src[dym1 + dxp1]) k = src[dym1 + dxp1];
-				if (k < src[dxm1]) k = src[dxm1];
-				if (k < src[dxp1]) k = src[dxp1];
-				if (k < src[dyp1 + dxm1]) k = src[dyp1 + dxm1];
-				if (k < src[dyp1]) k = src[dyp1];
-				if (k < src[dyp1 + dxp1]) k = src[dyp1 + dxp1];
-				break;
-			}
-			k = k < 0 ? 0 : k > 0xFF ? 0xFF : k;
-			k = 255 * k + (*src - k) * op;
-			*dest = (k + (k >> 8) + 1) >> 8;
-		}
-		if ((i * 10) % mem_height >= mem_height - 10)
-			if (progress_update((float)(i + 1) / mem_height)) break;
-	}
-	free(mask);
+	progress_init(_("Applying Effect"), 1);
+	launch_threads(effect_filter, tdata, NULL, mem_height);
 	progress_end();
+	free(tdata);
 }
 
 /* Apply vertical filter */
@@ -7160,6 +9050,13 @@ static void vert_gauss(unsigned char *chan, int w, int h, int y, double *temp,
 	}
 }
 
+typedef struct {
+	double a, w;	// Weight of the 2 outer pixels, and of whole box
+	int l;		// Radius of the box proper
+	int n;		// Length of lines it is applied to
+	int ofs;	// Offset of its mirror indices in the index array
+} ebox;
+
 typedef struct {
 	double *gaussX, *gaussY, *temp;
 	unsigned char *mask;
@@ -7169,6 +9066,12 @@ typedef struct {
 	// For unsharp mask
 	int threshold;
 	double amount;
+	// For fast mode
+	ebox box[4];	// X & Y boxes for each intermediate image
+	float *fimg[2];	// Intermediate images
+	double *frow, *fsum; // Source row and running sums
+	int nimg, lanes; // Intermediate images, and values per pixel in them
+	int pad, flen;	// Line buffer extension & full length, in values
 } gaussd;
 
 /* Extend horizontal array, using precomputed indices */
@@ -7255,6 +9158,539 @@ static void pack_row3(unsigned char *dest, const double *src, int w, int gcor,
 	}
 }
 
+/* Apply 1-bpp horizontal filter */
+static void hor_gauss1(double *temp, int w, double *gaussX, int lenX,
+	unsigned char *mask)
+{
+	int j, k;
+	double sum;
+
+	for (j = 0; j < w; j++)
+	{
+		if (mask[j] == 255) continue;
+		sum = temp[j] * gaussX[0];
+		for (k = 1; k < lenX; k++)
+		{
+			sum += (temp[j - k] + temp[j + k]) * gaussX[k];
+		}
+		temp[j - lenX + 1] = sum;
+	}
+}
+
+static void pack_row1(unsigned char *dest, const double *src, int w,
+	unsigned char *mask)
+{
+	int j, k;
+
+	for (j = 0; j < w; j++)
+	{
+		k = rint(src[j]);
+		k = k * 255 + (dest[j] - k) * mask[j];
+		dest[j] = (k + (k >> 8) + 1) >> 8;
+	}
+}
+
+/* Sharpen row using its blurred version */
+static void unsharp_row(unsigned char *dest, const double *src, int w, int bpp,
+	unsigned char *mask, gaussd *gd)
+{
+	int threshold = gd->threshold, gcor = gd->gcor;
+	double sum, sum1, sum2, amount = gd->amount;
+
+	if (bpp == 3)
+	{
+		int j, jj, k, k1, k2;
+
+		for (j = jj = 0; jj < w; jj++ , j += 3)
+		{
+			if (mask[jj] == 255) continue;
+			sum = src[j];
+			sum1 = src[j + 1];
+			sum2 = src[j + 2];
+			if (gcor) /* Reverse gamma correction */
+			{
+				k = UNGAMMA256(sum);
+				k1 = UNGAMMA256(sum1);
+				k2 = UNGAMMA256(sum2);
+			}
+			else /* Simply round to nearest */
+			{
+				k = rint(sum);
+				k1 = rint(sum1);
+				k2 = rint(sum2);
+			}
+			/* Threshold */
+	/* !!! GIMP has an apparent bug which I won't reproduce - so mtPaint's
+	 * threshold value means _actual_ difference, not half of it - WJ */
+			if ((abs(k - dest[j]) < threshold) &&
+				(abs(k1 - dest[j + 1]) < threshold) &&
+				(abs(k2 - dest[j + 2]) < threshold))
+				continue;
+			if (gcor) /* Involve gamma *AGAIN* */
+			{
+				sum = gamma256[dest[j]] + amount *
+					(gamma256[dest[j]] - sum);
+				sum1 = gamma256[dest[j + 1]] + amount *
+					(gamma256[dest[j + 1]] - sum1);
+				sum2 = gamma256[dest[j + 2]] + amount *
+					(gamma256[dest[j + 2]] - sum2);
+				k = UNGAMMA256X(sum);
+				k1 = UNGAMMA256X(sum1);
+				k2 = UNGAMMA256X(sum2);
+			}
+			else /* Combine values as linear */
+			{
+				k = rint(dest[j] + amount *
+					(dest[j] - sum));
+				k = k < 0 ? 0 : k > 255 ? 255 : k;
+				k1 = rint(dest[j + 1] + amount *
+					(dest[j + 1] - sum1));
+				k1 = k1 < 0 ? 0 : k1 > 255 ? 255 : k1;
+				k2 = rint(dest[j + 2] + amount *
+					(dest[j + 2] - sum2));
+				k2 = k2 < 0 ? 0 : k2 > 255 ? 255 : k2;
+			}
+			/* Store the result */
+			k = k * 255 + (dest[j] - k) * mask[jj];
+			dest[j] = (k + (k >> 8) + 1) >> 8;
+			k1 = k1 * 255 + (dest[j + 1] - k1) * mask[jj];
+			dest[j + 1] = (k1 + (k1 >> 8) + 1) >> 8;
+			k2 = k2 * 255 + (dest[j + 2] - k2) * mask[jj];
+			dest[j + 2] = (k2 + (k2 >> 8) + 1) >> 8;
+		}
+	}
+	else /* 1-bpp - no gamma here */
+	{
+		int j, k;
+
+		for (j = 0; j < w; j++)
+		{
+			if (mask[j] == 255) continue;
+			sum = src[j];
+			k = rint(sum);
+			/* Threshold */
+			/* !!! Same non-bug as above */
+			if (abs(k - dest[j]) < threshold) continue;
+			/* Combine values */
+			k = rint(dest[j] + amount * (dest[j] - sum));
+			k = k < 0 ? 0 : k > 255 ? 255 : k;
+			/* Store the result */
+			k = k * 255 + (dest[j] - k) * mask[j];
+			dest[j] = (k + (k >> 8) + 1) >> 8;
+		}
+	}
+}
+
+/* Store difference of gaussians, "len" values of it */
+static void dog_row(unsigned char *dest, const double *src, int len, int gcor)
+{
+	int j, k;
+
+	for (j = 0; j < len; j++)
+	{
+		if (gcor)
+		{
+#if 1 /* Reverse gamma - but does it make sense? */
+			k = UNGAMMA256X(src[j]);
+#else /* Let values remain linear */
+			k = rint(src[j] * 255.0);
+			k = k < 0 ? 0 : k;
+#endif
+		}
+		else
+		{
+			k = rint(src[j]);
+			k = k < 0 ? 0 : k;
+		}
+		dest[j] = k;
+	}
+}
+
+/* Constant-time approximation of gaussian: 3 passes of extended box filter,
+ * with the same variance as the kernel init_gauss() builds. As described in:
+ * P. Gwosdek, S. Grewenig, A. Bruhn, J. Weickert "Theoretical Foundations of
+ * Gaussian Convolution by Extended Box Filtering" (2011).
+ * The image is filtered horizontally into an intermediate float image, that one
+ * vertically in column strips, and then it gets packed back into the channel */
+
+#define EBOX_PASSES 3
+#define EBOX_STRIP 16 /* Values per column strip in vertical pass */
+
+static void ebox_init(ebox *eb, double radius, int n)
+{
+	double s, a;
+	int l;
+
+	/* Variance per pass */
+	s = (radius + 1.0) * (radius + 1.0) / (2.0 * log(255.0) * EBOX_PASSES);
+	eb->l = l = floor(0.5 * sqrt(12.0 * s + 1.0) - 0.5);
+	eb->a = a = (2 * l + 1) * (l * (l + 1) - 3.0 * s) /
+		(6.0 * (s - (l + 1) * (l + 1)));
+	eb->w = 1.0 / (2 * l + 1 + 2.0 * a);
+	eb->n = n;
+}
+
+/* Prepare indices for extending lines, assuming mirror boundary */
+static void ebox_index(ebox *eb, int *idx)
+{
+	int i, j, k, n = eb->n;
+
+	idx += eb->ofs + eb->l + 1; // To simplify indexing
+	k = 2 * n - 2;
+	for (i = 1; i <= eb->l + 1; i++)
+	{
+		if (n < 2) idx[-i] = idx[i - 1] = 0;
+		else
+		{
+			j = i % k;
+			idx[-i] = j < n ? j : k - j;
+			j = (n + i - 1) % k;
+			idx[i - 1] = j < n ? j : k - j;
+		}
+	}
+}
+
+/* Filter a line of "m" interleaved values per point; "buf" and "tmp" need room
+ * for (l + 1) points before and after the line. Returns where the result is */
+static double *ebox_line(double *buf, double *tmp, double *sum, int m,
+	ebox *eb, int *idx)
+{
+	double a = eb->a, w = eb->w, *src = buf, *dest = tmp, *t;
+	int i, k, p, n = eb->n, l = eb->l, ml = (l + 1) * m;
+
+	idx += eb->ofs + l + 1;
+	for (p = 0; p < EBOX_PASSES; p++)
+	{
+		/* Extend the line */
+		for (i = 1; i <= l + 1; i++)
+		{
+			memcpy(src - i * m, src + idx[-i] * m, m * sizeof(double));
+			memcpy(src + (n + i - 1) * m, src + idx[i - 1] * m,
+				m * sizeof(double));
+		}
+
+		/* Sum up the box for the first point */
+		for (k = 0; k < m; k++) sum[k] = 0.0;
+		for (t = src - l * m; t != src + ml; t += m)
+		{
+			for (k = 0; k < m; k++) sum[k] += t[k];
+		}
+
+		/* Slide it along the line */
+		for (i = 0 , t = dest; i < n; i++ , t += m)
+		{
+			double *s0 = src + i * m;
+
+			for (k = 0; k < m; k++)
+			{
+				double v0 = s0[k - ml], v1 = s0[k + ml];
+
+				t[k] = (sum[k] + (v0 + v1) * a) * w;
+				sum[k] += v1 - s0[k - ml + m];
+			}
+		}
+
+		t = src; src = dest; dest = t;
+	}
+
+	return (src);
+}
+
+static void fast_gauss_hor(tcb *thread)
+{
+	gaussd *gd = thread->data;
+	int i, ii, j, k, cnt, m = gd->lanes, wl = mem_width * m;
+	int gcor = gd->gcor;
+	double *buf, *tmp, *res, *row = gd->frow;
+	unsigned char *chan, *alpha = NULL;
+	float *dest;
+
+	cnt = thread->nsteps;
+	chan = mem_undo_previous(gd->channel);
+	if (m == 7) alpha = mem_undo_previous(CHN_ALPHA);
+	buf = gd->temp + gd->pad;
+	tmp = buf + gd->flen;
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		if (alpha) /* Alpha, premultiplied RGB, then plain RGB */
+		{
+			unsigned char *src = chan + i * mem_width * 3;
+			unsigned char *alf = alpha + i * mem_width;
+			double *dp = row, r, g, b, a;
+
+			for (j = 0; j < mem_width; j++ , src += 3 , dp += 7)
+			{
+				if (gcor)
+				{
+					r = gamma256[src[0]];
+					g = gamma256[src[1]];
+					b = gamma256[src[2]];
+				}
+				else r = src[0] , g = src[1] , b = src[2];
+				dp[0] = a = alf[j];
+				dp[1] = r * a;
+				dp[2] = g * a;
+				dp[3] = b * a;
+				dp[4] = r;
+				dp[5] = g;
+				dp[6] = b;
+			}
+		}
+		else
+		{
+			unsigned char *src = chan + i * wl;
+
+			if (gcor) for (j = 0; j < wl; j++) row[j] = gamma256[src[j]];
+			else for (j = 0; j < wl; j++) row[j] = src[j];
+		}
+		for (k = 0; k < gd->nimg; k++)
+		{
+			memcpy(buf, row, wl * sizeof(double));
+			res = ebox_line(buf, tmp, gd->fsum, m, gd->box + k * 2,
+				gd->idx);
+			dest = gd->fimg[k] + (size_t)i * wl;
+			for (j = 0; j < wl; j++) dest[j] = res[j];
+		}
+		if (thread_step(thread, ii + 1, cnt, 10))
+		{
+			thread->stop = TRUE; /* Tell the caller */
+			break;
+		}
+	}
+	thread_done(thread);
+}
+
+static void fast_gauss_vert(tcb *thread)
+{
+	gaussd *gd = thread->data;
+	int i, ii, j, k, y, x0, sw, cnt, wl = mem_width * gd->lanes;
+	double *buf, *tmp, *res, *dp;
+	float *fp;
+
+	cnt = thread->nsteps;
+	buf = gd->temp + gd->pad;
+	tmp = buf + gd->flen;
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		x0 = i * EBOX_STRIP;
+		sw = wl - x0 < EBOX_STRIP ? wl - x0 : EBOX_STRIP;
+		for (k = 0; k < gd->nimg; k++)
+		{
+			fp = gd->fimg[k] + x0;
+			for (y = 0 , dp = buf; y < mem_height; y++ , fp += wl)
+			{
+				for (j = 0; j < sw; j++) *dp++ = fp[j];
+			}
+			res = ebox_line(buf, tmp, gd->fsum, sw, gd->box + k * 2 + 1,
+				gd->idx);
+			fp = gd->fimg[k] + x0;
+			for (y = 0; y < mem_height; y++ , fp += wl)
+			{
+				for (j = 0; j < sw; j++) fp[j] = *res++;
+			}
+		}
+		if (thread_step(thread, ii + 1, cnt, 10))
+		{
+			thread->stop = TRUE;
+			break;
+		}
+	}
+	thread_done(thread);
+}
+
+/* Read a row of intermediate image into line buffer */
+static double *fast_gauss_row(gaussd *gd, int k, int y)
+{
+	int j, wl = mem_width * gd->lanes;
+	float *src = gd->fimg[k] + (size_t)y * wl;
+	double *dest = gd->temp;
+
+	for (j = 0; j < wl; j++) dest[j] = src[j];
+	return (dest);
+}
+
+static void fast_gauss_pack(tcb *thread)
+{
+	gaussd *gd = thread->data;
+	int i, ii, cnt, bpp = BPP(gd->channel);
+	unsigned char *dest, *mask = gd->mask;
+	double *temp;
+
+	cnt = thread->nsteps;
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		temp = fast_gauss_row(gd, 0, i);
+		row_protected(0, i, mem_width, mask);
+		dest = mem_img[gd->channel] + i * mem_width * bpp;
+		if (bpp == 3) pack_row3(dest, temp, mem_width, gd->gcor, mask);
+		else pack_row1(dest, temp, mem_width, mask);
+		if (thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+static void fast_gauss_rgba_pack(tcb *thread)
+{
+	gaussd *gd = thread->data;
+	int i, ii, j, jj, k, kk, cnt;
+	unsigned char *dest, *dsta, *mask = gd->mask;
+	double sum, mult, *temp = gd->temp;
+	float *src, *fp;
+
+	cnt = thread->nsteps;
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		fp = gd->fimg[0] + (size_t)i * mem_width * 7;
+		row_protected(0, i, mem_width, mask);
+		dest = mem_img[CHN_IMAGE] + i * mem_width * 3;
+		dsta = mem_img[CHN_ALPHA] + i * mem_width;
+		for (j = jj = 0; j < mem_width; j++ , jj += 3 , fp += 7)
+		{
+			if (mask[j] == 255) continue;
+
+			sum = fp[0];
+			k = rint(sum);
+			src = fp + 4;
+			mult = 1.0;
+			if (k)
+			{
+				src = fp + 1;
+				mult /= sum;
+			}
+			kk = mask[j];
+			k = k * 255 + (dsta[j] - k) * kk;
+			if (k) mask[j] = (255 * kk * dsta[j]) / k;
+			dsta[j] = (k + (k >> 8) + 1) >> 8;
+
+			temp[jj] = src[0] * mult;
+			temp[jj + 1] = src[1] * mult;
+			temp[jj + 2] = src[2] * mult;
+		}
+		pack_row3(dest, temp, mem_width, gd->gcor, mask);
+		if (thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+static void fast_unsharp_pack(tcb *thread)
+{
+	gaussd *gd = thread->data;
+	int i, ii, cnt, bpp = BPP(gd->channel);
+	unsigned char *dest, *mask = gd->mask;
+	double *temp;
+
+	cnt = thread->nsteps;
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		temp = fast_gauss_row(gd, 0, i);
+		row_protected(0, i, mem_width, mask);
+		dest = mem_img[gd->channel] + i * mem_width * bpp;
+		unsharp_row(dest, temp, mem_width, bpp, mask, gd);
+		if (thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+static void fast_dog_pack(tcb *thread)
+{
+	gaussd *gd = thread->data;
+	int i, ii, j, cnt, wl = mem_width * gd->lanes;
+	double *temp = gd->temp;
+	float *f1, *f2;
+
+	cnt = thread->nsteps;
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		f1 = gd->fimg[0] + (size_t)i * wl;
+		f2 = gd->fimg[1] + (size_t)i * wl;
+		for (j = 0; j < wl; j++) temp[j] = (double)f1[j] - f2[j];
+		dog_row(mem_img[gd->channel] + i * wl, temp, wl, gd->gcor);
+		if (thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
+/* Modes: 0 - normal, 1 - RGBA, 2 - DoG */
+static threaddata *init_fast_gauss(gaussd *gd, double radiusX, double radiusY,
+	int mode)
+{
+	threaddata *tdata;
+	double fsz, ram;
+	size_t sz;
+	int i, l, n, m, mm, bpp = MEM_BPP;
+
+
+	gd->nimg = mode == 2 ? 2 : 1;
+	gd->lanes = m = mode == 1 ? 7 : bpp;
+	mm = m > EBOX_STRIP ? m : EBOX_STRIP;
+
+	/* In DoG mode, radii are for the two images, not the two directions */
+	ebox_init(gd->box + 0, radiusX, mem_width);
+	ebox_init(gd->box + 1, mode == 2 ? radiusX : radiusY, mem_height);
+	ebox_init(gd->box + 2, radiusY, mem_width);
+	ebox_init(gd->box + 3, radiusY, mem_height);
+	for (i = n = l = 0; i < gd->nimg * 2; i++)
+	{
+		gd->box[i].ofs = n;
+		n += (gd->box[i].l + 1) * 2;
+		if (gd->box[i].l >= l) l = gd->box[i].l + 1;
+	}
+	gd->pad = l * mm;
+	gd->flen = (mem_width > mem_height ? mem_width : mem_height) * mm +
+		gd->pad * 2;
+
+	/* Intermediate images may not fit into int-sized talloc() buffers, or
+	 * take too much of RAM to be worth it - exact mode needs next to none */
+	fsz = (double)mem_width * mem_height * m * gd->nimg * sizeof(float);
+	if (fsz > (double)(size_t)(-1)) return (NULL);
+	ram = sys_ram();
+	if (ram && (fsz * 2 > ram)) return (NULL);
+	sz = (size_t)mem_width * mem_height * m;
+	if (!(gd->fimg[0] = malloc(sz * gd->nimg * sizeof(float))))
+		return (NULL);
+	gd->fimg[1] = gd->fimg[0] + sz;
+
+	tdata = talloc(MA_ALIGN_DOUBLE, 0, gd, sizeof(gaussd),
+		&gd->idx, n * sizeof(int),
+		NULL,
+		&gd->temp, gd->flen * 2 * sizeof(double),
+		&gd->frow, mem_width * m * sizeof(double),
+		&gd->fsum, mm * sizeof(double),
+		&gd->mask, mem_width,
+		NULL);
+	if (!tdata)
+	{
+		free(gd->fimg[0]);
+		return (NULL);
+	}
+
+	for (i = 0; i < gd->nimg * 2; i++) ebox_index(gd->box + i, gd->idx);
+	return (tdata);
+}
+
+/* Run the filtering passes, then the packing one; all of them together are
+ * "part" out of "nparts" of the job, for progressbar */
+static void fast_gauss(threaddata *tdata, thread_func pack, int part, int nparts)
+{
+	gaussd *gd = tdata->threads[0]->data;
+	int n = (mem_width * gd->lanes + EBOX_STRIP - 1) / EBOX_STRIP;
+	float l = 1.0 / (nparts * 3), l0 = part * 3 * l;
+
+	thread_range(tdata, l0, l);
+	launch_threads(fast_gauss_hor, tdata, NULL, mem_height);
+	if (!tdata->threads[0]->stop)
+	{
+		thread_range(tdata, l0 + l, l);
+		launch_threads(fast_gauss_vert, tdata, NULL, n);
+	}
+	if (!tdata->threads[0]->stop)
+	{
+		thread_range(tdata, l0 + l * 2, l);
+		launch_threads(pack, tdata, NULL, mem_height);
+	}
+	thread_range(tdata, 0.0, 0.0);
+}
+
 /* Most-used variables are local to inner blocks to shorten their live ranges -
  * otherwise stupid compilers might allocate them to memory */
 static void gauss_filter(tcb *thread)
@@ -7262,7 +9698,7 @@ static void gauss_filter(tcb *thread)
 	gaussd *gd = thread->data;
 	int lenX = gd->lenX, gcor = gd->gcor, channel = gd->channel;
 	int i, ii, cnt, wid, bpp;
-	double sum, *temp, *gaussX = gd->gaussX;
+	double *temp, *gaussX = gd->gaussX;
 	unsigned char *chan, *dest, *mask = gd->mask;
 
 	cnt = thread->nsteps;
@@ -7270,7 +9706,7 @@ static void gauss_filter(tcb *thread)
 	wid = mem_width * bpp;
 	chan = mem_undo_previous(channel);
 	temp = gd->temp + (lenX - 1) * bpp;
-	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
 	{
 		vert_gauss(chan, wid, mem_height, i, temp, gd->gaussY, gd->lenY, gcor);
 		gauss_extend(gd, temp, mem_width, bpp);
@@ -7283,20 +9719,8 @@ static void gauss_filter(tcb *thread)
 		}
 		else /* Run 1-bpp horizontal filter - no gamma here */
 		{
-			int j, k, k0;
-
-			for (j = 0; j < mem_width; j++)
-			{
-				if (mask[j] == 255) continue;
-				sum = temp[j] * gaussX[0];
-				for (k = 1; k < lenX; k++)
-				{
-					sum += (temp[j - k] + temp[j + k]) * gaussX[k];
-				}
-				k0 = rint(sum);
-				k0 = k0 * 255 + (dest[j] - k0) * mask[j];
-				dest[j] = (k0 + (k0 >> 8) + 1) >> 8;
-			}
+			hor_gauss1(temp, mem_width, gaussX, lenX, mask);
+			pack_row1(dest, gd->temp, mem_width, mask);
 		}
 		if (thread_step(thread, ii + 1, cnt, 10)) break;
 	}
@@ -7323,7 +9747,7 @@ static void gauss_filter_rgba(tcb *thread)
 	/* Set up the main row buffer and process the image */
 	tmpa = temp + mem_width * 3 + (lenX - 1) * (3 + 3);
 	atmp = tmpa + mem_width * 3 + (lenX - 1) * (3 + 1);
-	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
 	{
 		/* Apply vertical filter */
 		{
@@ -7556,11 +9980,11 @@ static threaddata *init_gauss(gaussd *gd, double radiusX, double radiusY, int mo
 }
 
 /* Gaussian blur */
-void mem_gauss(double radiusX, double radiusY, int gcor)
+void mem_gauss(double radiusX, double radiusY, int gcor, int method)
 {
 	gaussd gd;
-	threaddata *tdata;
-	int rgba, rgbb;
+	threaddata *tdata = NULL;
+	int rgba, rgbb, fast;
 
 	/* RGBA or not? */
 	rgba = (mem_channel == CHN_IMAGE) && mem_img[CHN_ALPHA] && RGBA_mode;
@@ -7570,7 +9994,15 @@ void mem_gauss(double radiusX, double radiusY, int gcor)
 	if (mem_channel != CHN_IMAGE) gcor = FALSE;
 	gd.gcor = gcor;
 	gd.channel = mem_channel;
-	tdata = init_gauss(&gd, radiusX, radiusY, rgbb);
+	fast = (method == GAUSS_FAST) || ((method == GAUSS_AUTO) &&
+		(radiusX > GAUSS_FAST_RADIUS) && (radiusY > GAUSS_FAST_RADIUS));
+	if (fast) tdata = init_fast_gauss(&gd, radiusX, radiusY, rgbb);
+	/* Exact mode needs much less memory */
+	if (!tdata)
+	{
+		fast = FALSE;
+		tdata = init_gauss(&gd, radiusX, radiusY, rgbb);
+	}
 	if (!tdata)
 	{
 		memory_errors(1);
@@ -7579,10 +10011,14 @@ void mem_gauss(double radiusX, double radiusY, int gcor)
 
 	progress_init(_("Gaussian Blur"), 1);
 	if (rgbb) /* Coupled RGBA */
-		launch_threads(gauss_filter_rgba, tdata, NULL, mem_height);
+	{
+		if (fast) fast_gauss(tdata, fast_gauss_rgba_pack, 0, 1);
+		else launch_threads(gauss_filter_rgba, tdata, NULL, mem_height);
+	}
 	else /* One channel, or maybe two */
 	{
-		launch_threads(gauss_filter, tdata, NULL, mem_height);
+		if (fast) fast_gauss(tdata, fast_gauss_pack, 0, rgba ? 2 : 1);
+		else launch_threads(gauss_filter, tdata, NULL, mem_height);
 		if (rgba) /* Need to process alpha too */
 		{
 #ifdef U_THREADS
@@ -7593,26 +10029,29 @@ void mem_gauss(double radiusX, double radiusY, int gcor)
 				gaussd *gp = tdata->threads[i]->data;
 				gp->channel = CHN_ALPHA;
 				gp->gcor = FALSE;
+				gp->lanes = 1;
 			}
 #else
 			gaussd *gp = tdata->threads[0]->data;
 			gp->channel = CHN_ALPHA;
 			gp->gcor = FALSE;
+			gp->lanes = 1;
 #endif
-			launch_threads(gauss_filter, tdata, NULL, mem_height);
+			if (fast) fast_gauss(tdata, fast_gauss_pack, 1, 2);
+			else launch_threads(gauss_filter, tdata, NULL, mem_height);
 		}
 	}
 	progress_end();
+	if (fast) free(gd.fimg[0]);
 	free(tdata);
 }
 
 static void unsharp_filter(tcb *thread)
 {
 	gaussd *gd = thread->data;
-	int lenX = gd->lenX, threshold = gd->threshold, channel = gd->channel;
+	int lenX = gd->lenX, channel = gd->channel;
 	int i, ii, cnt, wid, bpp, gcor = gd->gcor;
 	double *temp, *gaussX = gd->gaussX;
-	double sum, sum1, sum2, amount = gd->amount;
 	unsigned char *chan, *dest, *mask = gd->mask;
 
 	cnt = thread->nsteps;
@@ -7620,117 +10059,29 @@ static void unsharp_filter(tcb *thread)
 	wid = mem_width * bpp;
 	chan = mem_undo_previous(channel);
 	temp = gd->temp + (lenX - 1) * bpp;
-	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
 	{
 		vert_gauss(chan, wid, mem_height, i, temp, gd->gaussY, gd->lenY, gcor);
 		gauss_extend(gd, temp, mem_width, bpp);
 		row_protected(0, i, mem_width, mask);
 		dest = mem_img[channel] + i * wid;
 		if (bpp == 3) /* Run 3-bpp horizontal filter */
-		{
-			int j, jj, k, k1, k2, x1, x2;
-
-			for (j = jj = 0; jj < mem_width; jj++ , j += 3)
-			{
-				if (mask[jj] == 255) continue;
-				sum = temp[j] * gaussX[0];
-				sum1 = temp[j + 1] * gaussX[0];
-				sum2 = temp[j + 2] * gaussX[0];
-				x1 = x2 = j;
-				for (k = 1; k < lenX; k++)
-				{
-					double gv = gaussX[k];
-					x1 -= 3; x2 += 3;
-					sum += (temp[x1] + temp[x2]) * gv;
-					sum1 += (temp[x1 + 1] + temp[x2 + 1]) * gv;
-					sum2 += (temp[x1 + 2] + temp[x2 + 2]) * gv;
-				}
-				if (gcor) /* Reverse gamma correction */
-				{
-					k = UNGAMMA256(sum);
-					k1 = UNGAMMA256(sum1);
-					k2 = UNGAMMA256(sum2);
-				}
-				else /* Simply round to nearest */
-				{
-					k = rint(sum);
-					k1 = rint(sum1);
-					k2 = rint(sum2);
-				}
-				/* Threshold */
-	/* !!! GIMP has an apparent bug which I won't reproduce - so mtPaint's
-	 * threshold value means _actual_ difference, not half of it - WJ */
-				if ((abs(k - dest[j]) < threshold) &&
-					(abs(k1 - dest[j + 1]) < threshold) &&
-					(abs(k2 - dest[j + 2]) < threshold))
-					continue;
-				if (gcor) /* Involve gamma *AGAIN* */
-				{
-					sum = gamma256[dest[j]] + amount *
-						(gamma256[dest[j]] - sum);
-					sum1 = gamma256[dest[j + 1]] + amount *
-						(gamma256[dest[j + 1]] - sum1);
-					sum2 = gamma256[dest[j + 2]] + amount *
-						(gamma256[dest[j + 2]] - sum2);
-					k = UNGAMMA256X(sum);
-					k1 = UNGAMMA256X(sum1);
-					k2 = UNGAMMA256X(sum2);
-				}
-				else /* Combine values as linear */
-				{
-					k = rint(dest[j] + amount *
-						(dest[j] - sum));
-					k = k < 0 ? 0 : k > 255 ? 255 : k;
-					k1 = rint(dest[j + 1] + amount *
-						(dest[j + 1] - sum1));
-					k1 = k1 < 0 ? 0 : k1 > 255 ? 255 : k1;
-					k2 = rint(dest[j + 2] + amount *
-						(dest[j + 2] - sum2));
-					k2 = k2 < 0 ? 0 : k2 > 255 ? 255 : k2;
-				}
-				/* Store the result */
-				k = k * 255 + (dest[j] - k) * mask[jj];
-				dest[j] = (k + (k >> 8) + 1) >> 8;
-				k1 = k1 * 255 + (dest[j + 1] - k1) * mask[jj];
-				dest[j + 1] = (k1 + (k1 >> 8) + 1) >> 8;
-				k2 = k2 * 255 + (dest[j + 2] - k2) * mask[jj];
-				dest[j + 2] = (k2 + (k2 >> 8) + 1) >> 8;
-			}
-		}
-		else /* Run 1-bpp horizontal filter - no gamma here */
-		{
-			int j, k;
-
-			for (j = 0; j < mem_width; j++)
-			{
-				if (mask[j] == 255) continue;
-				sum = temp[j] * gaussX[0];
-				for (k = 1; k < lenX; k++)
-				{
-					sum += (temp[j - k] + temp[j + k]) * gaussX[k];
-				}
-				k = rint(sum);
-				/* Threshold */
-				/* !!! Same non-bug as above */
-				if (abs(k - dest[j]) < threshold) continue;
-				/* Combine values */
-				k = rint(dest[j] + amount * (dest[j] - sum));
-				k = k < 0 ? 0 : k > 255 ? 255 : k;
-				/* Store the result */
-				k = k * 255 + (dest[j] - k) * mask[j];
-				dest[j] = (k + (k >> 8) + 1) >> 8;
-			}
-		}
+			hor_gauss3(temp, mem_width, gaussX, lenX, mask);
+		else /* Run 1-bpp horizontal filter */
+			hor_gauss1(temp, mem_width, gaussX, lenX, mask);
+		unsharp_row(dest, gd->temp, mem_width, bpp, mask, gd);
 		if (thread_step(thread, ii + 1, cnt, 10)) break;
 	}
 	thread_done(thread);
 }
 
 /* Unsharp mask */
-void mem_unsharp(double radius, double amount, int threshold, int gcor)
+void mem_unsharp(double radius, double amount, int threshold, int gcor,
+	int method)
 {
 	gaussd gd;
-	threaddata *tdata;
+	threaddata *tdata = NULL;
+	int fast;
 
 	/* Create arrays */
 	if (mem_channel != CHN_IMAGE) gcor = 0;
@@ -7738,15 +10089,29 @@ void mem_unsharp(double radius, double amount, int threshold, int gcor)
 	gd.channel = mem_channel;
 	gd.amount = amount;
 	gd.threshold = threshold;
+	fast = (method == GAUSS_FAST) ||
+		((method == GAUSS_AUTO) && (radius > GAUSS_FAST_RADIUS));
 // !!! No RGBA mode for now
-	tdata = init_gauss(&gd, radius, radius, 0);
+	if (fast) tdata = init_fast_gauss(&gd, radius, radius, 0);
+	if (!tdata)
+	{
+		fast = FALSE;
+		tdata = init_gauss(&gd, radius, radius, 0);
+	}
 	if (!tdata)
 	{
 		memory_errors(1);
 		return;
 	}
 	/* Run filter */
-	launch_threads(unsharp_filter, tdata, _("Unsharp Mask"), mem_height);
+	if (fast)
+	{
+		progress_init(_("Unsharp Mask"), 1);
+		fast_gauss(tdata, fast_unsharp_pack, 0, 1);
+		progress_end();
+		free(gd.fimg[0]);
+	}
+	else launch_threads(unsharp_filter, tdata, _("Unsharp Mask"), mem_height);
 	free(tdata);
 }	
 
@@ -7809,7 +10174,7 @@ static void dog_filter(tcb *thread)
 	chan = mem_undo_previous(channel);
 	tmp1 = gd->temp + (lenW - 1) * bpp;
 	tmp2 = tmp1 + wid + (lenW - 1) * bpp * 2;
-	for (i = thread->step0 , ii = 0; ii < cnt; i++ , ii++)
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
 	{
 		vert_gauss(chan, wid, mem_height, i, tmp1, gaussW, lenW, gcor);
 		vert_gauss(chan, wid, mem_height, i, tmp2, gaussN, lenN, gcor);
@@ -7818,7 +10183,7 @@ static void dog_filter(tcb *thread)
 		dest = mem_img[channel] + i * wid;
 		if (bpp == 3) /* Run 3-bpp horizontal filter */
 		{
-			int j, jj, k, k1, k2;
+			int j, jj, k;
 
 			for (j = jj = 0; jj < mem_width; jj++ , j += 3)
 			{
@@ -7845,34 +10210,10 @@ static void dog_filter(tcb *thread)
 					sum1 -= (tmp2[x3 + 1] + tmp2[x4 + 1]) * gv;
 					sum2 -= (tmp2[x3 + 2] + tmp2[x4 + 2]) * gv;
 				}
-				if (gcor)
-				{
-#if 1 /* Reverse gamma - but does it make sense? */
-					k = UNGAMMA256X(sum);
-					k1 = UNGAMMA256X(sum1);
-					k2 = UNGAMMA256X(sum2);
-#else /* Let values remain linear */
-					k = rint(sum * 255.0);
-					k = k < 0 ? 0 : k;
-					k1 = rint(sum1 * 255.0);
-					k1 = k1 < 0 ? 0 : k1;
-					k2 = rint(sum2 * 255.0);
-					k2 = k2 < 0 ? 0 : k2;
-#endif
-				}
-				else
-				{
-					k = rint(sum);
-					k = k < 0 ? 0 : k;
-					k1 = rint(sum1);
-					k1 = k1 < 0 ? 0 : k1;
-					k2 = rint(sum2);
-					k2 = k2 < 0 ? 0 : k2;
-				}
 				/* Store the result */
-				dest[j] = k;
-				dest[j + 1] = k1;
-				dest[j + 2] = k2;
+				tmp1[x1] = sum;
+				tmp1[x1 + 1] = sum1;
+				tmp1[x1 + 2] = sum2;
 			}
 		}
 		else /* Run 1-bpp horizontal filter - no gamma here */
@@ -7890,27 +10231,35 @@ static void dog_filter(tcb *thread)
 				{
 					sum -= (tmp2[j - k] + tmp2[j + k]) * gaussN[k];
 				}
-				k = rint(sum);
-				dest[j] = k < 0 ? 0 : k;
+				tmp1[j - lenW + 1] = sum;
 			}
 		}
+		dog_row(dest, gd->temp, wid, gcor);
 		if (thread_step(thread, ii + 1, cnt, 10)) break;
 	}
 	thread_done(thread);
 }
 
 /* Difference of Gaussians */
-void mem_dog(double radiusW, double radiusN, int norm, int gcor)
+void mem_dog(double radiusW, double radiusN, int norm, int gcor, int method)
 {
 	gaussd gd;
-	threaddata *tdata;
+	threaddata *tdata = NULL;
+	int fast;
 
 	/* Create arrays */
 	if (mem_channel != CHN_IMAGE) gcor = 0;
 	gd.gcor = gcor;
 	gd.channel = mem_channel;
+	fast = (method == GAUSS_FAST) || ((method == GAUSS_AUTO) &&
+		(radiusN > GAUSS_FAST_RADIUS)); /* Inner is the smaller one */
 // !!! No RGBA mode for ever - DoG mode instead
-	tdata = init_gauss(&gd, radiusW, radiusN, 2);
+	if (fast) tdata = init_fast_gauss(&gd, radiusW, radiusN, 2);
+	if (!tdata)
+	{
+		fast = FALSE;
+		tdata = init_gauss(&gd, radiusW, radiusN, 2);
+	}
 	if (!tdata)
 	{
 		memory_errors(1);
@@ -7919,7 +10268,12 @@ void mem_dog(double radiusW, double radiusN, int norm, int gcor)
 
 	/* Run filter */
 	progress_init(_("Difference of Gaussians"), 1);
-	launch_threads(dog_filter, tdata, NULL, mem_height);
+	if (fast)
+	{
+		fast_gauss(tdata, fast_dog_pack, 0, 1);
+		free(gd.fimg[0]);
+	}
+	else launch_threads(dog_filter, tdata, NULL, mem_height);
 
 	/* Normalize values (expand to full 0..255) */
 	while (norm)
@@ -7951,139 +10305,165 @@ void mem_dog(double radiusW, double radiusN, int norm, int gcor)
 }
 
 
-/* !!! Kuwahara-Nagao filter's radius is limited to 255, to use byte offsets */
+/* !!! Kuwahara-Nagao filter's radius is limited to 180, for sums of squared
+ * values over a square to fit into int */
 typedef struct {
 	int *idx;	// Index array
-	double *rs;	// Sum of gamma-corrected RGB if using gamma
-	int *avg;	// Sum of pixel values (for average)
-	int *dis;	// Sum of pixel values squared (for variance)
-	unsigned char *min;	// Offset to minimum-variance square
+	float *fg;	// Gamma table rounded to float
+	int *cs;	// Column sums of pixel values (for average)
+	int *cq;	// Column sums of pixel values squared (for variance)
+	double *cg;	// Column sums of gamma-corrected RGB if using gamma
+	double *sv;	// Variance of each square in a row
+	unsigned char *srgb;	// Average RGB of each square in a row
+	int *dq;	// Deque for horizontal minimum
+	double *hv;	// Ring of rows of minimum variance squares' variance
+	unsigned char *hrgb;	// and RGB
+	int *vdq;	// Deques for vertical minimum, r + 1 values per column
+	int *vht;	// Their heads and lengths
+	unsigned char *mask, *timg;	// Mask & row buffer
 	double r2i;	// 1/r^2 to multiply things with
-	int w, r;	// Row width & filter radius
+	int r;		// Filter radius
 	int gcor;	// Gamma correction toggle
-	int l, rl;	// Row array lengths
+	int detail;	// Detail protection toggle
 } kuwahara_info;
 
+/* Add or subtract a row to/from column sums */
 /* This function uses running sums, which gives x87 FPU's "precision jitter"
  * a chance to accumulate; to avoid, reduced-precision gamma is used - WJ */
-static void kuwahara_row(unsigned char *src, int base, int add, kuwahara_info *info)
-{
-	double rs0 = 0.0, rs1 = 0.0, rs2 = 0.0;
-	int avg[3] = { 0, 0, 0 }, dis[3] = { 0, 0, 0 };
-	int i, w, r = info->r, gc = info->gcor, *idx = info->idx;
-
-	w = info->w + r++;
-	for (i = -r; i < w; i++)
-	{
-		unsigned char *tvv;
-		int tv, i3, *iavg, *idis;
-
-		tvv = src + idx[i];
-		avg[0] += (tv = tvv[0]);
-		dis[0] += tv * tv;
-		avg[1] += (tv = tvv[1]);
-		dis[1] += tv * tv;
-		avg[2] += (tv = tvv[2]);
-		dis[2] += tv * tv;
+/* With float gamma values, sums over up to 361x361 squares are exact in double,
+ * so results do not depend on summation order, or on number of threads */
+static void kuwahara_row(unsigned char *src, int add, kuwahara_info *info)
+{
+	int i, l = mem_width + info->r * 2, d = add ? 1 : -1;
+	int *cs = info->cs, *cq = info->cq, *idx = info->idx;
+	double *cg = info->cg;
+	float *fg = info->fg;
+
+	for (i = 0; i < l; i++ , cs += 3 , cq += 3)
+	{
+		unsigned char *tvv = src + idx[i];
+		int tv;
+
+		cs[0] += (tv = tvv[0]) * d;
+		cq[0] += tv * tv * d;
+		cs[1] += (tv = tvv[1]) * d;
+		cq[1] += tv * tv * d;
+		cs[2] += (tv = tvv[2]) * d;
+		cq[2] += tv * tv * d;
+		if (!info->gcor) continue;
+		cg[0] += fg[tvv[0]] * d;
+		cg[1] += fg[tvv[1]] * d;
+		cg[2] += fg[tvv[2]] * d;
+		cg += 3;
+	}
+}
+
+/* Calculate variance & average RGB of each square in a row of them */
+static void kuwahara_square(kuwahara_info *info)
+{
+	double r2i = info->r2i, g0 = 0.0, g1 = 0.0, g2 = 0.0;
+	double *sv = info->sv, *cg = info->cg;
+	unsigned char *srgb = info->srgb;
+	int s0 = 0, s1 = 0, s2 = 0, q0 = 0, q1 = 0, q2 = 0;
+	int i, r = info->r, l = mem_width + r, gc = info->gcor;
+	int *cs = info->cs, *cq = info->cq;
+
+	/* Sum up the columns left of the first square */
+	for (i = 0; i < r * 3; i += 3)
+	{
+		s0 += cs[i]; s1 += cs[i + 1]; s2 += cs[i + 2];
+		q0 += cq[i]; q1 += cq[i + 1]; q2 += cq[i + 2];
+		if (!gc) continue;
+		g0 += cg[i]; g1 += cg[i + 1]; g2 += cg[i + 2];
+	}
+	/* Slide along the row */
+	for (i = 0; i < l; i++ , cs += 3 , cq += 3 , srgb += 3)
+	{
+		int j = r * 3;
+
+		s0 += cs[j]; s1 += cs[j + 1]; s2 += cs[j + 2];
+		q0 += cq[j]; q1 += cq[j + 1]; q2 += cq[j + 2];
+		// !!! Multiplication is done this way to avoid integer overflow
+		sv[i] = q0 + q1 + q2 - ((r2i * s0) * s0 + (r2i * s1) * s1 +
+			(r2i * s2) * s2);
 		if (gc)
 		{
-			rs0 += Fgamma256[tvv[0]];
-			rs1 += Fgamma256[tvv[1]];
-			rs2 += Fgamma256[tvv[2]];
-		}
-		if (i < 0) continue;
-
-		tvv = src + idx[i - r];
-		avg[0] -= (tv = tvv[0]);
-		dis[0] -= tv * tv;
-		avg[1] -= (tv = tvv[1]);
-		dis[1] -= tv * tv;
-		avg[2] -= (tv = tvv[2]);
-		dis[2] -= tv * tv;
-		i3 = (base + i) * 3;
-		iavg = info->avg + i3;
-		idis = info->dis + i3;
-		if (add)
-		{
-			iavg[0] += avg[0];
-			iavg[1] += avg[1];
-			iavg[2] += avg[2];
-			idis[0] += dis[0];
-			idis[1] += dis[1];
-			idis[2] += dis[2];
+			g0 += cg[j]; g1 += cg[j + 1]; g2 += cg[j + 2];
+			srgb[0] = UNGAMMA256(g0 * r2i);
+			srgb[1] = UNGAMMA256(g1 * r2i);
+			srgb[2] = UNGAMMA256(g2 * r2i);
+			g0 -= cg[0]; g1 -= cg[1]; g2 -= cg[2];
+			cg += 3;
 		}
 		else
 		{
-			iavg[0] -= avg[0];
-			iavg[1] -= avg[1];
-			iavg[2] -= avg[2];
-			idis[0] -= dis[0];
-			idis[1] -= dis[1];
-			idis[2] -= dis[2];
-		}
-		if (gc)
-		{
-			double *irs = info->rs + i3;
-
-			rs0 -= Fgamma256[tvv[0]];
-			rs1 -= Fgamma256[tvv[1]];
-			rs2 -= Fgamma256[tvv[2]];
-			if (add)
-			{
-				irs[0] += rs0;
-				irs[1] += rs1;
-				irs[2] += rs2;
-			}
-			else
-			{
-				irs[0] -= rs0;
-				irs[1] -= rs1;
-				irs[2] -= rs2;
-			}
+			srgb[0] = rint(s0 * r2i);
+			srgb[1] = rint(s1 * r2i);
+			srgb[2] = rint(s2 * r2i);
 		}
+		s0 -= cs[0]; s1 -= cs[1]; s2 -= cs[2];
+		q0 -= cq[0]; q1 -= cq[1]; q2 -= cq[2];
 	}
 }
 
-static void kuwahara_copy(int dest, int src, kuwahara_info *info)
+/* For each X, locate the square with minimum variance & store it in ring slot;
+ * of equal ones, the rightmost wins */
+static void kuwahara_min(int slot, kuwahara_info *info)
 {
-	src *= 3; dest *= 3;
-	memcpy(info->rs + dest, info->rs + src, info->rl * 3 * sizeof(double));
-	memcpy(info->avg + dest, info->avg + src, info->l * 3 * sizeof(int));
-	memcpy(info->dis + dest, info->dis + src, info->l * 3 * sizeof(int));
-}
+	double *sv = info->sv, *hv = info->hv + slot * mem_width;
+	unsigned char *hrgb = info->hrgb + slot * mem_width * 3;
+	int i, j, h = 0, t = 0, r = info->r, *dq = info->dq;
 
-static double kuwahara_square(int idx, kuwahara_info *info)
-{
-	double r2i = info->r2i;
-	int *dp = info->dis + idx * 3, *ap = info->avg + idx * 3;
-	// !!! Multiplication is done this way to avoid integer overflow
-	return (dp[0] + dp[1] + dp[2] - ((r2i * ap[0]) * ap[0] +
-		(r2i * ap[1]) * ap[1] + (r2i * ap[2]) * ap[2]));
+	for (i = 0; i < mem_width + r; i++)
+	{
+		while ((t > h) && (sv[dq[t - 1]] >= sv[i])) t--;
+		dq[t++] = i;
+		if ((j = i - r) < 0) continue;
+		if (dq[h] < j) h++;
+		hv[j] = sv[dq[h]];
+		memcpy(hrgb + j * 3, info->srgb + dq[h] * 3, 3);
+	}
 }
 
-/* For each X, locate the square with minimum variance & store its offset */
-static void kuwahara_min(int base, kuwahara_info *info)
+/* Add square row "e" to per-column deques, and for each X, store RGB of the
+ * minimum variance square among the last r + 1 rows; of equal ones, the one in
+ * the lowest ring slot wins */
+static void kuwahara_vmin(int e, unsigned char *dest, kuwahara_info *info)
 {
-	double da[256];
-	int i, j, j1, w = info->w, r = info->r, min = -1;
+	double *hv = info->hv;
+	unsigned char *hrgb = info->hrgb;
+	int j, r1 = info->r + 1, w = mem_width, s = e % r1;
+	int *dq = info->vdq, *ht = info->vht;
 
-	for (i = 0; i < r; i++) da[i] = kuwahara_square(base + i, info);
-	for (i = 0; i < w; i++)
+	for (j = 0; j < w; j++ , dq += r1 , ht += 2)
 	{
-		j1 = (i + r) & 255;
-		da[j1] = kuwahara_square(base + (i + r), info);
-		if (min > i) // Old minimum still valid
+		double v = hv[s * w + j];
+		int k, h = ht[0], n = ht[1];
+
+		/* Drop the row which went out of range */
+		if (n && (dq[h] == e - r1))
 		{
-			if (da[j1] <= da[min & 255]) min = i + r;
+			if (++h == r1) h = 0;
+			n--;
 		}
-		else // Forced to find a new one
+		/* Drop the rows which cannot win anymore */
+		while (n)
 		{
-			min = i;
-			for (j = 1; j <= r; j++)
-				if (da[(i + j) & 255] <= da[min & 255])
-					min = i + j;
+			double vb;
+			int bs;
+
+			k = h + n - 1;
+			if (k >= r1) k -= r1;
+			bs = dq[k] % r1;
+			vb = hv[bs * w + j];
+			if ((vb < v) || ((vb == v) && (bs < s))) break;
+			n--;
 		}
-		info->min[base + i] = min - i;
+		k = h + n;
+		if (k >= r1) k -= r1;
+		dq[k] = e;
+		ht[0] = h; ht[1] = n + 1;
+		if (dest) memcpy(dest + j * 3, hrgb + ((dq[h] % r1) * w + j) * 3, 3);
 	}
 }
 
@@ -8172,156 +10552,136 @@ static int idx2row(int idx)
 	return (j);
 }
 
+/* Each run of consecutive rows is processed using running sums, so the cost per
+ * pixel does not depend on radius */
+static void kuwahara_filter(tcb *thread)
+{
+	kuwahara_info *info = thread->data;
+	unsigned char *src, *buf, *tmp, *timg = info->timg, *mask = info->mask;
+	int i, ii, e, y, cnt, need, fstart = 0, fy = 0, last = -2;
+	int r = info->r, r1 = r + 1, detail = info->detail, gcor = info->gcor;
+	int w = mem_width * 3, wbuf = w + 3 * 2;
+
+	cnt = thread->nsteps;
+	src = mem_undo_previous(CHN_IMAGE);
+	e = 0;
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		if (i != last + 1) /* Start a new run */
+		{
+			memset(info->cs, 0, (mem_width + r * 2) * 3 * sizeof(int));
+			memset(info->cq, 0, (mem_width + r * 2) * 3 * sizeof(int));
+			if (gcor) memset(info->cg, 0,
+				(mem_width + r * 2) * 3 * sizeof(double));
+			memset(info->vht, 0, mem_width * 2 * sizeof(int));
+			/* Detail mode needs the row above too */
+			fstart = detail && i ? i - 1 : i;
+			fy = fstart - 1;
+			for (e = fstart - r; e < fstart; e++)
+				kuwahara_row(src + idx2row(e) * w, TRUE, info);
+		}
+		last = i;
+
+		/* Prepare the filtered rows this one needs */
+		need = detail && (i < mem_height - 1) ? i + 1 : i;
+		while (fy < need)
+		{
+			if (e > fstart)
+				kuwahara_row(src + idx2row(e - r1) * w, FALSE, info);
+			kuwahara_row(src + idx2row(e) * w, TRUE, info);
+			kuwahara_square(info);
+			kuwahara_min(e % r1, info);
+// !!! Only the all-or-nothing mode for now - weighted mode not implemented yet
+			y = e - r;
+			buf = y < fstart ? NULL : timg + (detail ? wbuf * (y % 3) : 0);
+			kuwahara_vmin(e++, buf ? buf + 3 : NULL, info);
+			if (!buf) continue;
+			fy = y;
+			if (!detail) continue;
+			/* Copy-extend the row on both ends */
+			memcpy(buf, buf + 3, 3);
+			memcpy(buf + w + 3, buf + w, 3);
+			/* Copy-extend the top row */
+			if (!y) memcpy(timg + wbuf * 2, buf, wbuf);
+		}
+
+		if (detail)
+		{
+			/* Copy-extend the bottom row */
+			if (i == mem_height - 1) memcpy(timg + wbuf * (mem_height % 3),
+				timg + wbuf * (i % 3), wbuf);
+			/* Build and mask-merge the row */
+			kuwahara_detailed(timg, mask, i, gcor);
+		}
+		else
+		{
+			/* Mask-merge the row */
+			row_protected(0, i, mem_width, mask);
+			tmp = mem_img[CHN_IMAGE] + i * w;
+			do_alpha_blend(tmp, timg + 3, tmp, mask, w, 3);
+		}
+		if (thread_step(thread, ii + 1, cnt, 10)) break;
+	}
+	thread_done(thread);
+}
+
 /* RGB only - cannot be generalized without speed loss */
 void mem_kuwahara(int r, int gcor, int detail)
 {
 	kuwahara_info info;
-	unsigned char *mem, *src, *buf, *mask, *tmp, *timg;
-	int i, j, k, l, ir, len, rl, r1 = r + 1;
-	int w = mem_width * 3, wbuf = w + 3 * 2, ch = mem_channel;
-	double r2i = 1.0 / (double)(r1 * r1);
-
+	threaddata *tdata;
+	int i, j, k, l, r1 = r + 1, ch = mem_channel;
+	int wbuf = mem_width * 3 + 3 * 2;
 
 	if (mem_img_bpp != 3) return; // Sanity check
 
-	len = mem_width + r + r + 1;
-	info.l = l = mem_width + r;
-	info.rl = rl = gcor ? l : 0;
-	mem = multialloc(MA_ALIGN_DOUBLE,
-		&info.rs, rl * r1 * 3 * sizeof(double),
-		&info.avg, l * r1 * 3 * sizeof(int),
-		&info.dis, l * r1 * 3 * sizeof(int),
-		&info.idx, len * sizeof(int),
-		&info.min, l * r1,
-		&mask, mem_width,
-		&timg, wbuf * 3,
+	l = mem_width + r + r;
+	info.r2i = 1.0 / (double)(r1 * r1);
+	info.r = r; info.gcor = gcor; info.detail = detail;
+	tdata = talloc(MA_ALIGN_DOUBLE, 0, &info, sizeof(info),
+		&info.idx, l * sizeof(int),
+		&info.fg, 256 * sizeof(float),
+		NULL,
+		&info.cg, (gcor ? l : 0) * 3 * sizeof(double),
+		&info.sv, (mem_width + r) * sizeof(double),
+		&info.hv, mem_width * r1 * sizeof(double),
+		&info.cs, l * 3 * sizeof(int),
+		&info.cq, l * 3 * sizeof(int),
+		&info.dq, (mem_width + r) * sizeof(int),
+		&info.vdq, mem_width * r1 * sizeof(int),
+		&info.vht, mem_width * 2 * sizeof(int),
+		&info.srgb, (mem_width + r) * 3,
+		&info.hrgb, mem_width * r1 * 3,
+		&info.mask, mem_width,
+		&info.timg, wbuf * 3,
 		NULL);
-	if (!mem)
+	if (!tdata)
 	{
 		memory_errors(1);
 		return;
 	}
-	info.r2i = r2i; info.w = mem_width; info.r = r; info.gcor = gcor;
 
-	progress_init(_("Kuwahara-Nagao Filter"), 1);
-	info.idx += r1;
+	/* Column indices, from -r to mem_width + r - 1 */
 	if (mem_width > 1) // All indices remain zero otherwise
 	{
 		k = mem_width + mem_width - 2;
-		for (i = -(r + 1); i < mem_width + r; i++)
+		for (i = -r; i < mem_width + r; i++)
 		{
 			j = abs(i) % k;
 			if (j >= mem_width) j = k - j;
-			info.idx[i] = j * 3;
+			info.idx[i + r] = j * 3;
 		}
 	}
+	else memset(info.idx, 0, l * sizeof(int));
+	for (i = 0; i < 256; i++) info.fg[i] = gamma256[i];
 
 	mem_channel = CHN_IMAGE; // For row_protected()
-	src = mem_undo_previous(CHN_IMAGE);
-	/* Initialize the bottom sum */
-	for (i = -r; i <= 0; i++)
-		kuwahara_row(src + idx2row(i) * w, 0, TRUE, &info);
-	kuwahara_min(0, &info);
-	/* Initialize the rest of sums */
-	for (i = 1; i <= r; i++)
-	{
-		int j = l * i;
-		kuwahara_copy(j, j - l, &info);
-		kuwahara_row(src + idx2row(i - r1) * w, j, FALSE, &info);
-		kuwahara_row(src + idx2row(i) * w, j, TRUE, &info);
-		kuwahara_min(j, &info);
-	}
-	/* Actually process image */
-	ir = i = 0;
-	while (TRUE)
-	{
-		int j, k, jp;
-
-		if ((i * 10) % mem_height >= mem_height - 10)
-			if (progress_update((float)(i + 1) / mem_height)) break;
-
-		/* Process a pixel row */
-		if (!detail) row_protected(0, i, mem_width, mask);
-		tmp = buf = timg + wbuf * (i % 3);
-		for (j = 0; j < mem_width; j++)
-		{
-			double dis;
-			int jj, jk;
-
-			tmp += 3;
-			if (!detail && (mask[j] == 255)) continue;
-			/* Select minimum variance square from covered rows */
-			jj = j + l;
-			jk = j + info.min[j];
-			dis = kuwahara_square(jk, &info);
-// !!! Only the all-or-nothing mode for now - weighted mode not implemented yet
-			for (k = 1; k < r1; k++ , jj += l)
-			{
-				int jv = jj + info.min[jj];
-				double dv = kuwahara_square(jv, &info);
-				if (dv < dis) jk = jv , dis = dv;
-			}
-			/* Calculate & store new RGB */
-			jk *= 3;
-			if (gcor)
-			{
-				double *wr = info.rs + jk;
-				tmp[0] = UNGAMMA256(wr[0] * r2i);
-				tmp[1] = UNGAMMA256(wr[1] * r2i);
-				tmp[2] = UNGAMMA256(wr[2] * r2i);
-			}
-			else
-			{
-				int *ar = info.avg + jk;
-				tmp[0] = rint(*ar++ * r2i);
-				tmp[1] = rint(*ar++ * r2i);
-				tmp[2] = rint(*ar * r2i);
-			}
-		}
-
-		if (detail)
-		{
-			/* Copy-extend the row on both ends */
-			memcpy(buf, buf + 3, 3);
-			memcpy(tmp + 3, tmp, 3);
-			/* Copy-extend the top row */
-			if (!i) memcpy(timg + wbuf * 2, buf, wbuf);
-			/* Build and mask-merge the previous row */
-			else kuwahara_detailed(timg, mask, i - 1, gcor);
-		}
-		else
-		{
-			/* Mask-merge current row */
-			tmp = mem_img[CHN_IMAGE] + i * w;
-			do_alpha_blend(tmp, buf + 3, tmp, mask, w, 3);
-		}
-
-		if (++i < mem_height)
-		{
-			/* Update sums for a new row */
-			jp = ir * l;
-			kuwahara_copy(jp, ((ir + r) % r1) * l, &info);
-			kuwahara_row(src + idx2row(i - 1) * w, jp, FALSE, &info);
-			kuwahara_row(src + idx2row(i + r) * w, jp, TRUE, &info);
-			kuwahara_min(jp, &info);
-			ir = (ir + 1) % r1;
-			continue;
-		}
-
-		if (detail)
-		{
-			/* Copy-extend the bottom row */
-			memcpy(timg + wbuf * (i % 3), buf, wbuf);
-			/* Build and mask-merge it */
-			kuwahara_detailed(timg, mask, i - 1, gcor);
-		}
-		break;
-	}
-
+	progress_init(_("Kuwahara-Nagao Filter"), 1);
+	launch_threads(kuwahara_filter, tdata, NULL, mem_height);
+	progress_end();
 	mem_channel = ch;
 
-	progress_end();
-	free(mem);
+	free(tdata);
 }
 
 ///	CLIPBOARD MASK
@@ -8530,6 +10890,7 @@ void do_clone(int ox, int oy, int nx, int ny, int opacity, int mode)
 	h = by - ay;
 
 	if ((w < 1) || (h < 1)) return;
+	mem_undo_dirty(ax + xv, ay + yv, w, h);
 
 	if (IS_INDEXED) opacity = -1; // No mixing for indexed image
 
@@ -9911,10 +12272,14 @@ static void mem_convert_row(double *dest, unsigned char *src, int l, int cspace)
 {
 	if (cspace == CSPACE_LXN)
 	{
-		while (l-- > 0)
+		int c, c0 = -1;
+
+		/* Runs of same colour need only one conversion */
+		for (; l-- > 0; dest += 3 , src += 3)
 		{
-			get_lxn(dest, MEM_2_INT(src, 0));
-			dest += 3; src += 3;
+			if ((c = MEM_2_INT(src, 0)) != c0) get_lxn(dest, c0 = c);
+			else dest[0] = dest[-3] , dest[1] = dest[-2] ,
+				dest[2] = dest[-1];
 		}
 	}
 	else if (cspace == CSPACE_SRGB)
@@ -9937,11 +12302,160 @@ static void mem_convert_row(double *dest, unsigned char *src, int l, int cspace)
  * Pedro F. Felzenszwalb, "Efficient Graph-Based Image Segmentation"
  */
 
-static int cmp_edge(const void *v1, const void *v2)
+typedef struct {
+	unsigned char *img;
+	seg_edge *edges, *src, *dest;
+	double *rows, mult;
+	int *hist;
+	int w, h, cnt, cspace, dist, shift, lastrow, progress;
+} segd;
+
+/* Compute color distances for a row of pixels to their right and bottom
+ * neighbors; edges are laid out in order of their "which" index, so that
+ * any row's edges are at a known place */
+static void seg_edges(tcb *thread)
+{
+	segd *sd = thread->data;
+	seg_edge *e;
+	double *row0, *row1;
+	int i, ii, j, k, w = sd->w, h = sd->h, l = w * 3, cnt = thread->nsteps;
+
+	for (ii = 0; (i = thread_row(thread)) >= 0; ii++)
+	{
+		row0 = sd->rows + (i & 1) * l;
+		row1 = sd->rows + (~i & 1) * l;
+		/* Row will be already there if previous one was done here */
+		if (sd->lastrow != i) mem_convert_row(row0,
+			sd->img + (size_t)i * l, w, sd->cspace);
+		sd->lastrow = i;
+		if (i < h - 1)
+		{
+			mem_convert_row(row1, sd->img + (size_t)(i + 1) * l,
+				w, sd->cspace);
+			sd->lastrow = i + 1;
+		}
+
+		e = sd->edges + (size_t)i * (w * 2 - 1);
+		k = i * w * 2;
+		for (j = 0; j < l; j += 3 , k += 2)
+		{
+			if (j < l - 3) /* Right vertex */
+			{
+				e->which = k;
+				e->diff = sd->mult * distance_3d[sd->dist](row0 + j,
+					row0 + j + 3);
+				e++;
+			}
+			if (i < h - 1) /* Bottom vertex */
+			{
+				e->which = k + 1;
+				e->diff = sd->mult * distance_3d[sd->dist](row0 + j,
+					row1 + j);
+				e++;
+			}
+		}
+		if (sd->progress && thread_step(thread, ii + 1, cnt, 20))
+		{
+			thread->stop = TRUE;
+			break;
+		}
+	}
+	thread_done(thread);
+}
+
+/* Edges are radix sorted on their distances, 8 bits at a time, the array
+ * split into this many chunks each having its own counters; distances are
+ * never negative, so bit patterns of their float values sort the same as
+ * the values do */
+#define SEG_CHUNKS 64
+
+static inline int seg_digit(seg_edge *e, int shift)
+{
+	union {
+		float f;
+		guint32 i;
+	} key;
+
+	key.f = e->diff;
+	return ((key.i >> shift) & 0xFF);
+}
+
+static seg_edge *seg_chunk(segd *sd, int n)
+{
+	size_t l = (size_t)(sd->cnt / SEG_CHUNKS + 1) * n;
+	return (sd->src + (l < (size_t)sd->cnt ? l : (size_t)sd->cnt));
+}
+
+static void seg_count(tcb *thread)
+{
+	segd *sd = thread->data;
+	seg_edge *e, *e1;
+	int i, *hist;
+
+	while ((i = thread_row(thread)) >= 0)
+	{
+		hist = sd->hist + i * 256;
+		memset(hist, 0, 256 * sizeof(int));
+		e1 = seg_chunk(sd, i + 1);
+		for (e = seg_chunk(sd, i); e < e1; e++)
+			hist[seg_digit(e, sd->shift)]++;
+	}
+	thread_done(thread);
+}
+
+static void seg_scatter(tcb *thread)
+{
+	segd *sd = thread->data;
+	seg_edge *e, *e1;
+	int i, *hist;
+
+	while ((i = thread_row(thread)) >= 0)
+	{
+		hist = sd->hist + i * 256;
+		e1 = seg_chunk(sd, i + 1);
+		for (e = seg_chunk(sd, i); e < e1; e++)
+			sd->dest[hist[seg_digit(e, sd->shift)]++] = *e;
+	}
+	thread_done(thread);
+}
+
+/* Sort edges by distance, and ones with equal distances by "which", as the
+ * radix sort is stable and the edges come in in that order */
+static void seg_sort(threaddata *tdata, segd *sd0, seg_edge *tmp)
 {
-	float f1 = ((seg_edge *)v1)->diff, f2 = ((seg_edge *)v2)->diff;
-	return (f1 < f2 ? -1 : f1 != f2 ? f1 > f2 :
-		((seg_edge *)v1)->which - ((seg_edge *)v2)->which);
+	segd *sd;
+	seg_edge *src = sd0->edges, *dest = tmp, *t;
+	int i, j, k, l, same, shift, *hist = sd0->hist;
+
+	for (shift = 0; shift < 32; shift += 8)
+	{
+		for (i = 0; i < tdata->count; i++)
+		{
+			sd = tdata->threads[i]->data;
+			sd->src = src;
+			sd->dest = dest;
+			sd->shift = shift;
+		}
+		launch_threads(seg_count, tdata, NULL, SEG_CHUNKS);
+
+		/* Turn counts into starting offsets */
+		for (i = k = same = 0; i < 256; i++)
+		{
+			for (j = 0 , l = k; j < SEG_CHUNKS; j++)
+			{
+				int c = hist[j * 256 + i];
+				hist[j * 256 + i] = k;
+				k += c;
+			}
+			if (k - l == sd0->cnt) same = TRUE; // All in one bin
+		}
+		if (same) continue; // Nothing to do in this pass
+
+		launch_threads(seg_scatter, tdata, NULL, SEG_CHUNKS);
+		t = src; src = dest; dest = t;
+	}
+	if (src != sd0->edges)
+		memcpy(sd0->edges, src, sd0->cnt * sizeof(seg_edge));
 }
 
 static inline int seg_find(seg_pixel *pix, int n)
@@ -9970,26 +12484,24 @@ seg_state *mem_seg_prepare(seg_state *s, unsigned char *img, int w, int h,
 	int flags, int cspace, int dist)
 {
 	static const unsigned char dist_scales[NUM_CSPACES] = { 1, 255, 1 };
-	seg_edge *e;
-	double mult, *row0, *row1, *rows[2];
-	int i, j, k, l, bsz, sz = w * h;
+	segd sd;
+	threaddata *tdata;
+	seg_state *res = s;
+	int sz = w * h;
 
 
 	// !!! Will need a longer int type (and twice the memory) otherwise
 	if (sz > (INT_MAX >> 1) + 1) return (NULL);
 
-	/* 3 buffers will be sharing space */
-	bsz = w * 3 * 2 * sizeof(double);
-	l = sz * sizeof(seg_pixel);
-	if (l > bsz) bsz = l;
-
 	if (!s) // Reuse existing allocation if possible
 	{ /* Allocation is HUGE, but no way to make do with smaller one - WJ */
 		void *v[3];
 
+		/* Pixel nodes are twice the size of connections, so their
+		 * space doubles as radix sort buffer */
 		s = multialloc(MA_ALIGN_DOUBLE,
 			v, sizeof(seg_state), // Dummy pointer (header struct)
-			v + 1, bsz, // Row buffers/pixel nodes
+			v + 1, sz * sizeof(seg_pixel), // Pixel nodes
 			v + 2, sz * 2 * sizeof(seg_edge), // Pixel connections
 			NULL);
 		if (!s) return (NULL);
@@ -9998,45 +12510,47 @@ seg_state *mem_seg_prepare(seg_state *s, unsigned char *img, int w, int h,
 		s->w = w;
 		s->h = h;
 	}
-	rows[0] = (void *)s->pix; // 1st row buffer
-	rows[1] = rows[0] + w * 3; // 2nd row buffer
 	s->phase = 0; // Struct is to be refilled
 
-	if (flags & SEG_PROGRESS) progress_init(_("Segmentation Pass 1"), 1);
-
-	/* Compute color distances, fill connections buffer */
-	l = w * 3;
-	mult = dist_scales[cspace]; // Make all colorspaces use similar scale
-	for (i = 0 , e = s->edges; i < h; i++)
+	memset(&sd, 0, sizeof(sd));
+	sd.img = img;
+	sd.edges = s->edges;
+	sd.w = w;
+	sd.h = h;
+	sd.cnt = sz * 2 - w - h;
+	sd.cspace = cspace;
+	sd.dist = dist;
+	sd.mult = dist_scales[cspace]; // Make all colorspaces use similar scale
+	sd.lastrow = -1;
+	sd.progress = flags & SEG_PROGRESS;
+	tdata = talloc(MA_ALIGN_DOUBLE, 0, &sd, sizeof(sd),
+		&sd.hist, SEG_CHUNKS * 256 * sizeof(int),
+		NULL,
+		&sd.rows, w * 3 * 2 * sizeof(double),
+		NULL);
+	if (!tdata)
 	{
-		k = i * w;
-		mem_convert_row(row1 = rows[i & 1], img + k * 3, w, cspace);
-		/* Right vertices for this row */
-		for (j = 3 , k *= 2; j < l; j += 3 , k += 2 , e++)
-		{
-			e->which = k;
-			e->diff = mult * distance_3d[dist](row1 + j - 3, row1 + j);
-		}
-		if (!i) continue;
-		/* Bottom vertices for previous row */
-		k = (i - 1) * w * 2 + 1;
-		row0 = rows[~i & 1];
-		for (j = 0; j < l; j += 3 , k += 2 , e++)
-		{
-			e->which = k;
-			e->diff = mult * distance_3d[dist](row0 + j, row1 + j);
-		}
-		if ((flags & SEG_PROGRESS) && ((i * 20) % h >= h - 20))
-			if (progress_update((0.9 * i) / h)) goto quit;
+		if (!res) free(s);
+		return (NULL);
 	}
 
+	if (flags & SEG_PROGRESS) progress_init(_("Segmentation Pass 1"), 1);
+
+	/* Compute color distances, fill connections buffer; the sort which
+	 * follows reports no progress, so leave the last tenth of bar to it */
+	thread_range(tdata, 0.0, 0.9);
+	launch_threads(seg_edges, tdata, NULL, h);
+	if (tdata->threads[0]->stop) goto quit;
+	thread_range(tdata, 0.0, 0.0);
+
 	/* Sort connections, smallest distances first */
-	s->cnt = e - s->edges;
-	qsort(s->edges, s->cnt, sizeof(seg_edge), cmp_edge);
+	s->cnt = sd.cnt;
+	seg_sort(tdata, &sd, (void *)s->pix);
 
 	s->phase = 1;
 
 quit:	if (flags & SEG_PROGRESS) progress_end();
+	free(tdata);
 
 	return (s);
 }
@@ -10196,6 +12710,7 @@ void mem_seg_render(unsigned char *img, const seg_state *s)
 double mem_seg_threshold(seg_state *s)
 {
 	int k = s->cnt - FRACTAL_THR * pow(s->cnt, 0.5 * FRACTAL_DIM);
+	if (k < 0) k = 0; // Tiny image
 	while (!s->edges[k].diff && (k < s->cnt - 1)) k++;
 	return (s->edges[k].diff ? s->edges[k].diff * THRESHOLD_MULT : 1.0);
 }
@@ -143,6 +143,7 @@ typedef struct {
 	png_color *pal_;
 	unsigned char *tileptr;
 	undo_data *dataptr;
+	void *spillptr;
 	size_t size;
 	int width, height, flags;
 	short cols, bpp, trans;
@@ -385,6 +386,9 @@ int mem_nudge;				// Nudge pixels per SHIFT+Arrow key during selection/paste
 
 int mem_undo_limit;		// Max MB memory allocation limit
 int mem_undo_common;		// Percent of undo space in common arena
+int mem_undo_disk;		// Max MB disk space for undo, 0 for none
+/* Offsets may be only 32-bit */
+#define MAX_UNDO_DISK (sizeof(off_t) < 8 ? 2047 : 65535)
 int mem_undo_opacity;		// Use previous image for opacity calculations?
 
 /// COLOR TRANSFORM
@@ -563,7 +567,7 @@ void mem_free_chanlist(chanlist img);
 int cmask_from(chanlist img);	// Chanlist to cmask
 
 int mem_count_all_cols();			// Count all colours - Using main image
-int mem_count_all_cols_real(unsigned char *im, int w, int h);	// Count all colours - very memory greedy
+int mem_count_all_cols_real(unsigned char *im, int w, int h);	// Count all colours
 
 int mem_cols_used(int max_count);		// Count colours used in main RGB image
 int mem_cols_used_real(unsigned char *im, int w, int h, int max_count, int prog);
@@ -598,6 +602,8 @@ size_t mem_used();
 //	Return the number of bytes used in image + undo in all layers
 size_t mem_used_layers();
 
+int mem_no_sse2;		// Use only plain C code, for checking SSE2 code against it
+
 #define FX_EDGE       0
 #define FX_EMBOSS     2
 #define FX_SHARPEN    3
@@ -614,9 +620,18 @@ size_t mem_used_layers();
 
 void do_effect( int type, int param );		// 0=edge detect 1=UNUSED 2=emboss
 void mem_bacteria( int val );			// Apply bacteria effect val times the canvas area
-void mem_gauss(double radiusX, double radiusY, int gcor);
-void mem_unsharp(double radius, double amount, int threshold, int gcor);
-void mem_dog(double radiusW, double radiusN, int norm, int gcor);
+
+/* Gaussian engines */
+#define GAUSS_AUTO  0 /* Exact for small radii, fast for large */
+#define GAUSS_EXACT 1 /* Explicit kernel, cost grows with radius */
+#define GAUSS_FAST  2 /* Extended box approximation, constant cost */
+
+#define GAUSS_FAST_RADIUS 16.0 /* Auto mode goes fast when radii exceed this */
+
+void mem_gauss(double radiusX, double radiusY, int gcor, int method);
+void mem_unsharp(double radius, double amount, int threshold, int gcor,
+	int method);
+void mem_dog(double radiusW, double radiusN, int norm, int gcor, int method);
 void mem_kuwahara(int r, int gcor, int detail);
 
 /* Colorspaces */
@@ -647,6 +662,8 @@ int maxminquan(unsigned char *inbuf, int width, int height, int quant_to,
 //	Quantize image using PNN algorithm
 int pnnquan(unsigned char *inbuf, int width, int height, int quant_to,
 	png_color *userpal);
+//	Error diffusion filters for mem_dither()
+extern short dither_fs[16], dither_stucki[16];
 //	Convert RGB->indexed using error diffusion with variety of options
 int mem_dither(unsigned char *old, int ncols, short *dither, int cspace,
 	int dist, int limit, int selc, int serpent, int rgb8b, double emult);
@@ -666,6 +683,7 @@ int mem_protected_RGB(int intcol);	// Is this intcol in list?
 void mem_swap_cols(int redraw);		// Swaps colours and update memory
 void mem_set_trans(int trans);		// Set transparent colour and update
 void mem_get_histogram(int channel);	// Calculate how many of each colour index is on the canvas
+void mem_get_histogram3(int hist[256][3], int channel);	// Same for every byte of pixel, RGB or index
 int scan_duplicates();			// Find duplicate palette colours
 void remove_duplicates();		// Remove duplicate palette colours - call AFTER scan_duplicates
 int mem_remove_unused_check();		// Check to see if we can remove unused palette colours
@@ -699,13 +717,19 @@ enum {
 	UNDO_TOOL,	/* Same as UNDO_DRAW but respects pen_down */
 	UNDO_TRANS	/* Transparent colour change (cumulative) */
 };
+#define UNDO_TRACK 0x100 /* Flag: all changes get marked by mem_undo_dirty() first */
 
+/* With UNDO_TRACK, an area must be marked before anything gets read from it
+ * through mem_undo_previous() or written to it, as tiles get saved when
+ * marked; and mem_undo_opacity, if going to be used, must be set before
+ * mem_undo_next() */
 void mem_undo_next(int mode);	// Call this after a draw event but before any changes to image
+void mem_undo_dirty(int x, int y, int w, int h);	// Mark area about to change since last undo frame
 //	 Get address of previous channel data (or current if none)
 unsigned char *mem_undo_previous(int channel);
 void mem_undo_prepare();	// Call this after changes to image, to compress last frame
 
-void mem_do_undo(int redo);	// Undo or redo requested by user
+int mem_do_undo(int redo);	// Undo or redo requested by user
 
 #define UC_CREATE  0x01	/* Force create */
 #define UC_NOCOPY  0x02	/* Forbid copy */
@@ -714,6 +738,7 @@ void mem_do_undo(int redo);	// Undo or redo requested by user
 #define UC_GETMEM  0x10 /* Get memory and do nothing */
 #define UC_ACCUM   0x20 /* Cumulative change */
 #define UC_RESET   0x40 /* Delete all, create flagged */
+#define UC_COW     0x80 /* Share channels, save tiles before they change */
 
 int undo_next_core(int mode, int new_width, int new_height, int new_bpp, int cmask);
 void update_undo(image_info *image);	// Copy image state into current undo frame
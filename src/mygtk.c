@@ -167,6 +167,8 @@ void progress_init(char *text, int canc)		// Initialise progress window
 {
 	GtkWidget *vbox6, *button_cancel, *viewport;
 
+	if (cmd_mode) return;	// No window, so progress_update() stays silent
+
 	/* Break pointer grabs, to avoid originating widget misbehaving later on */
 	release_grab();
 
@@ -236,7 +238,14 @@ int alert_box(char *title, char *message, char *text1, ...)
 	GtkWidget *alert, *button, *label;
 	char *txt;
 	int i = 0;
-	GtkAccelGroup* ag = gtk_accel_group_new();
+	GtkAccelGroup* ag;
+
+	if (cmd_mode) /* No one to ask, so take the default choice */
+	{
+		fprintf(stderr, "%s: %s\n", title, message);
+		return (1);
+	}
+	ag = gtk_accel_group_new();
 
 	/* This function must be immune to pointer grabs */
 	release_grab();
@@ -76,6 +76,8 @@ GtkWidget *float_spin_to_table(GtkWidget *table, int row, int column, int spacin
 	double value, double min, double max);
 void add_hseparator( GtkWidget *widget, int xs, int ys );
 
+int cmd_mode;	// Running without GUI, so report to console instead
+
 void progress_init(char *text, int canc);		// Initialise progress window
 int progress_update(float val);				// Update progress window
 void progress_end();					// Close progress window
@@ -1894,7 +1894,7 @@ typedef struct {
 	int cols, cols0;
 	int err;
 	char **qtxt;
-	void **dith, **colspin, **errspin;
+	void **dith, **colspin, **errspin, **wubits;
 	void **book, **qbook;
 } quantize_dd;
 
@@ -1913,6 +1913,7 @@ static void click_quantize_radio(quantize_dd *dt, void **wdata, int what, void *
 	n = quantize_mode;
 	cmd_set(dt->qbook, (n == QUAN_PNN) || (n == QUAN_WU) ? 2 :
 		n == QUAN_CURRENT ? 1 : 0);
+	cmd_sensitive(dt->wubits, n == QUAN_WU);
 
 	if (n == QUAN_EXACT) vvv[1] = vvv[2] = dt->cols0;
 	else if (n == QUAN_CURRENT) vvv[2] = mem_cols;
@@ -1931,14 +1932,6 @@ static void click_quantize_ok(quantize_dd *dt, void **wdata)
 	png_color newpal[256];
 	unsigned char *old_image = mem_img[CHN_IMAGE];
 
-	/* Dithering filters */
-	/* Floyd-Steinberg dither */
-	static short fs_dither[16] =
-		{ 16,  0, 0, 0, 7, 0,  0, 3, 5, 1, 0,  0, 0, 0, 0, 0 };
-	/* Stucki dither */
-	static short s_dither[16] =
-		{ 42,  0, 0, 0, 8, 4,  2, 4, 8, 4, 2,  1, 2, 4, 2, 1 };
-
 	run_query(wdata);
 	dither = quantize_mode != QUAN_EXACT ? dither_mode : DITH_NONE;
 	new_cols = dt->cols;
@@ -2002,7 +1995,7 @@ static void click_quantize_ok(quantize_dd *dt, void **wdata)
 	case DITH_FS:
 	case DITH_STUCKI:
 		err = mem_dither(old_image, new_cols, dither == DITH_NONE ?
-			NULL : dither == DITH_FS ? fs_dither : s_dither,
+			NULL : dither == DITH_FS ? dither_fs : dither_stucki,
 			dither_cspace, dither_dist, dither_limit, dither_sel,
 			dither_scan, dither_8b, efrac * 0.01);
 		break;
@@ -2081,7 +2074,10 @@ static void *quantize_code[] = {
 	REF(qbook), PLAINBOOKn(3),
 	WDONE, // empty page 0
 	CHECKv(_("Truncate palette"), quantize_tp), WDONE, // page 1
-	CHECKv(_("Diameter based weighting"), quan_sqrt), WDONE, // page 2
+	CHECKv(_("Diameter based weighting"), quan_sqrt),
+	TABLE2(1), REF(wubits),
+	TSPINv(_("Wu histogram bits per channel"), wu_bits, 1, WU_MAX_BITS),
+	WDONE, WDONE, // page 2
 	WDONE,
 	UNLESSx(pflag, 1),
 		/* Main page - Dither frame */
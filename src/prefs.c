@@ -427,14 +427,16 @@ static void *pref_code[] = {
 ///	---- TAB1 - GENERAL
 	PAGE(_("General")),
 #ifdef U_THREADS
-	TABLE2(4),
+	TABLE2(5),
 	TSPINv(_("Max threads (0 to autodetect)"), maxthreads, 0, 256),
 #else
-	TABLE2(3),
+	TABLE2(4),
 #endif
 	TSPINv(_("Max memory used for undo (MB)"), mem_undo_limit, 1, 2048),
 	TSPINa(_("Max undo levels"), undo_depth),
 	TSPINv(_("Communal layer undo space (%)"), mem_undo_common, 0, 100),
+	TSPINv(_("Max disk space used for undo (MB)"), mem_undo_disk, 0,
+		MAX_UNDO_DISK),
 	WDONE,
 	CHECKv(_("Use gamma correction by default"), use_gamma),
 	CHECKv(_("Optimize alpha chequers"), chequers_optimize),
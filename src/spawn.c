@@ -122,11 +122,42 @@ static char *remember_temp_file(char *name, int type, int rgb)
 	return (NULL); // Failed to allocate
 }
 
+static int scratch_fd = -1;
+
+/* Get the scratch file, creating it in temp dir if not yet there; it gets
+ * deleted when closed */
+int temp_scratch()
+{
+	char buf[PATHBUF];
+	int i;
+
+	if (scratch_fd >= 0) return (scratch_fd);
+
+	/* Prepare temp directory */
+	if (!mt_temp_dir) mt_temp_dir = new_temp_dir();
+	if (!mt_temp_dir) return (-1); /* Temp dir creation failed */
+
+	for (i = 0; (scratch_fd < 0) && (i < 256); i++)
+	{
+		snprintf(buf, PATHBUF, "%s" DIR_SEP_STR "scratch%d",
+			mt_temp_dir, i);
+#ifdef WIN32 /* Open files cannot be deleted */
+		scratch_fd = open(buf, O_RDWR | O_CREAT | O_EXCL | O_BINARY |
+			O_TEMPORARY, 0600);
+#else
+		scratch_fd = open(buf, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (scratch_fd >= 0) unlink(buf);
+#endif
+	}
+	return (scratch_fd);
+}
+
 void spawn_quit()
 {
 	tempfile *tmp;
 
 	for (tmp = tempchain; tmp; tmp = tmp->next) unlink(tmp->name);
+	if (scratch_fd >= 0) close(scratch_fd);
 	if (mt_temp_dir) rmdir(mt_temp_dir);
 }
 
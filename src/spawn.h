@@ -33,6 +33,7 @@ void pressed_file_action(int item);
 void init_factions();					// Initialize file action menu
 
 void spawn_quit();	// Delete temp files
+int temp_scratch();	// Get scratch file descriptor
 
 // Default action codes
 #define DA_GIF_CREATE  0
@@ -26,19 +26,6 @@
 
 int maxthreads;
 
-#ifdef U_THREADS
-
-#include <time.h>
-
-#if GTK_MAJOR_VERSION == 1
-#ifdef G_THREADS_IMPL_POSIX
-#include <pthread.h>
-#include <sched.h>
-#else
-#error "Non-POSIX threads not supported with GTK+1"
-#endif
-#endif
-
 /* Determine number of CPUs/cores */
 
 static int ncores;
@@ -73,8 +60,56 @@ static int numcpus()
 
 #endif
 
+int cpu_cores()
+{
+	if (!ncores) /* Autodetect number of cores */
+	{
+		ncores = numcpus();
+		if (ncores < 1) ncores = 1;
+	}
+	return (ncores);
+}
+
+/* Determine amount of physical memory, in bytes; 0 if unknown */
+
+#ifdef WIN32
+
+double sys_ram()
+{
+	MEMORYSTATUS ms;
+
+	GlobalMemoryStatus(&ms);
+	return (ms.dwTotalPhys);
+}
+
+#else
+
+double sys_ram()
+{
+#if defined _SC_PHYS_PAGES && defined _SC_PAGESIZE
+	long n = sysconf(_SC_PHYS_PAGES), sz = sysconf(_SC_PAGESIZE);
+
+	if ((n > 0) && (sz > 0)) return ((double)n * sz);
+#endif
+	return (0.0);
+}
+
+#endif
+
+#ifdef U_THREADS
+
+#if GTK_MAJOR_VERSION == 1
+#ifdef G_THREADS_IMPL_POSIX
+#include <pthread.h>
+#include <sched.h>
+#else
+#error "Non-POSIX threads not supported with GTK+1"
+#endif
+#endif
+
 #define THREAD_ALIGN    128
 #define THREAD_DEALIGN 4096
+#define MAX_WORKERS     256 /* Same as max threads in Preferences */
 
 int image_threads(int w, int h)
 {
@@ -109,15 +144,10 @@ threaddata *talloc(int flags, int tmax, void *data, int dsize, ...)
 	if (!tmax) /* Number of threads is whatever fits the current image */
 		tmax = image_threads(mem_width, mem_height);
 
-	if (!(nt = maxthreads)) /* Use as many threads as there are cores */
-	{
-		if (!ncores) /* Autodetect number of cores */
-		{
-			ncores = numcpus();
-			if (ncores < 1) ncores = 1;
-		}
-		nt = ncores;
-	}
+	/* Use as many threads as there are cores */
+	if (!(nt = maxthreads)) nt = cpu_cores();
+	/* The pool cannot run more */
+	if (nt > MAX_WORKERS) nt = MAX_WORKERS;
 
 	if (tmax > nt) tmax = nt;
 	else if (tmax < 1) tmax = 1;
@@ -223,7 +253,8 @@ int thread_progress(tcb *thread)
 	int i, j, n = thread->count;
 
 	for (i = j = 0; i < n; i++) j += tp[i]->progress;
-	if (!progress_update((float)j / thread->tsteps)) return (FALSE);
+	if (!progress_update(thread_part(thread, j, thread->tsteps)))
+		return (FALSE);
 
 	for (i = 0; i < n; i++) tp[i]->stop = TRUE;
 	return (TRUE);
@@ -231,55 +262,298 @@ int thread_progress(tcb *thread)
 
 int threads_running;
 
-void launch_threads(thread_func thread, threaddata *tdata, char *title, int total)
+/* Work is handed out in small chunks; a thread which has run out of its own
+ * work takes the latter half of what is left to the busiest one */
+
+#define THREAD_CHUNK 8
+
+DEF_MUTEX(chunk_lock);
+
+int thread_claim(tcb *thread)
 {
-	tcb *tp;
-	clock_t uninit_(before), now;
-	int i, j, n0, n1 = total, flag = FALSE;
+	tcb *tp, **tpp = thread->threads;
+	int i, l, n, res = -1;
+
+	LOCK_MUTEX(chunk_lock);
+	while (!thread->stop)
+	{
+		if ((l = thread->rend - thread->rnext) > 0) /* Own work */
+		{
+			if (l > THREAD_CHUNK) l = THREAD_CHUNK;
+			res = thread->rnext;
+			thread->rnext += l;
+			thread->row = res + 1;
+			thread->rlim = res + l;
+			break;
+		}
+		/* Find the one with most work left */
+		for (tp = NULL , n = i = 0; i < thread->count; i++)
+		{
+			if ((l = tpp[i]->rend - tpp[i]->rnext) <= n) continue;
+			n = l; tp = tpp[i];
+		}
+		if (!tp) break; // All work is done or being done
+		thread->rnext = tp->rnext + (n >> 1);
+		thread->rend = tp->rend;
+		tp->rend = thread->rnext;
+	}
+	UNLOCK_MUTEX(chunk_lock);
+	return (res);
+}
+
+/* Threads which depend on each other's partial results wait on a progress
+ * counter; barriers make the results visible to other cores before the counter
+ * is, and yielding lets the thread being waited on run if cores are short */
+
+#if GTK_MAJOR_VERSION == 1
+#define THREAD_YIELD() sched_yield()
+#else
+#define THREAD_YIELD() g_thread_yield()
+#endif
+
+#ifdef __GNUC__
+#define MEMORY_BARRIER() __sync_synchronize()
+#else
+#define MEMORY_BARRIER()
+#endif
+
+void thread_or(volatile guint32 *v, guint32 n)
+{
+#ifdef __GNUC__
+	__sync_fetch_and_or(v, n);
+#else /* A lost update only means the bits will get set again later */
+	*v |= n;
+#endif
+}
+
+/* Persistent worker pool: aux threads are created once, on first need, and
+ * then sleep on a condition variable till there is a job for them */
+
+#define POOL_POLL 50 /* Milliseconds between progress updates */
+
+typedef struct {
+	thread_func func;	// Job to do, NULL when idle
+	tcb *tp;		// Its control block
+} worker;
+
+static worker workers[MAX_WORKERS];
+static int nworkers;
+
+#if GTK_MAJOR_VERSION == 1
+
+#include <sys/time.h>
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_job = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+
+static pthread_cond_t pool_post = PTHREAD_COND_INITIALIZER;
+
+typedef struct timeval pool_time;
+#define pool_now(T) gettimeofday(T, NULL)
+
+#define POOL_LOCK() pthread_mutex_lock(&pool_lock)
+#define POOL_UNLOCK() pthread_mutex_unlock(&pool_lock)
+#define POOL_WAIT(C) pthread_cond_wait(&C, &pool_lock)
+#define POOL_WAKE(C) pthread_cond_broadcast(&C)
+#define POOL_TIMED_WAIT(C,T) pool_timed_wait(&C, T)
+
+static void pool_timed_wait(pthread_cond_t *c, pool_time *t)
+{
+	struct timespec ts;
+
+	ts.tv_sec = t->tv_sec;
+	ts.tv_nsec = t->tv_usec * 1000;
+	pthread_cond_timedwait(c, &pool_lock, &ts);
+}
+
+#else /* GLib threads */
+
+static GMutex *pool_lock;
+static GCond *pool_job, *pool_done, *pool_post;
+
+typedef GTimeVal pool_time;
+#define pool_now(T) g_get_current_time(T)
+
+#define POOL_LOCK() g_mutex_lock(pool_lock)
+#define POOL_UNLOCK() g_mutex_unlock(pool_lock)
+#define POOL_WAIT(C) g_cond_wait(C, pool_lock)
+#define POOL_WAKE(C) g_cond_broadcast(C)
+#define POOL_TIMED_WAIT(C,T) g_cond_timed_wait(C, pool_lock, T)
+
+#endif
+
+static int pool_msec(pool_time *t0, pool_time *t1)
+{
+	return ((t1->tv_sec - t0->tv_sec) * 1000 +
+		(t1->tv_usec - t0->tv_usec) / 1000);
+}
+
+static void pool_add_msec(pool_time *t, int ms)
+{
+	t->tv_usec += ms * 1000;
+	t->tv_sec += t->tv_usec / 1000000;
+	t->tv_usec %= 1000000;
+}
+
+/* A waiting thread yields for a while, in case the counter is about to change,
+ * then sleeps till it does; sleeps are timed, to notice being stopped */
+
+#define THREAD_SPINS 1000 /* Yields before going to sleep */
+
+static volatile int pool_sleepers;
+
+int thread_wait(tcb *thread, volatile int *v, int n)
+{
+	pool_time t;
+	int i;
+
+	for (i = 0; *v < n; i++)
+	{
+		if (thread->stop) return (FALSE);
+		if (i < THREAD_SPINS)
+		{
+			THREAD_YIELD();
+			continue;
+		}
+		POOL_LOCK();
+		pool_sleepers++;
+		MEMORY_BARRIER();
+		if (*v < n)
+		{
+			pool_now(&t);
+			pool_add_msec(&t, POOL_POLL);
+			POOL_TIMED_WAIT(pool_post, &t);
+		}
+		pool_sleepers--;
+		POOL_UNLOCK();
+	}
+	MEMORY_BARRIER();
+	return (TRUE);
+}
+
+void thread_post(volatile int *v, int n)
+{
+	MEMORY_BARRIER();
+	*v = n;
+	/* Wake up sleepers, if any; see the counter before they look at it
+	 * again, or have them see the new value */
+	MEMORY_BARRIER();
+	if (!pool_sleepers) return;
+	POOL_LOCK();
+	POOL_WAKE(pool_post);
+	POOL_UNLOCK();
+}
+
+static void *pool_worker(worker *w)
+{
+	thread_func func;
+
+	POOL_LOCK();
+	while (TRUE)
+	{
+		while (!(func = w->func)) POOL_WAIT(pool_job);
+		POOL_UNLOCK();
+		func(w->tp);
+		POOL_LOCK();
+		/* The tcb may be gone once the job is reported done */
+		w->tp = NULL;
+		w->func = NULL;
+		POOL_WAKE(pool_done);
+	}
+	return (NULL);
+}
+
+/* Find an idle worker, or start a new one; must be called with lock held */
+static worker *pool_get()
+{
+	worker *w;
+	int i;
 #if GTK_MAJOR_VERSION == 1
 	pthread_t tid;
 	pthread_attr_t attr;
-	int attr_failed;
+#endif
 
-	attr_failed = pthread_attr_init(&attr) ||
+	for (i = 0; i < nworkers; i++)
+		if (!workers[i].func) return (workers + i);
+	if (nworkers >= MAX_WORKERS) return (NULL);
+
+	w = workers + nworkers;
+#if GTK_MAJOR_VERSION == 1
+	if (pthread_attr_init(&attr)) return (NULL);
+	if (
 #ifdef PTHREAD_SCOPE_SYSTEM
 		pthread_attr_setscope(&attr, PTHREAD_SCOPE_SYSTEM) ||
 #endif
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED) ||
+		pthread_create(&tid, &attr, (void *(*)(void *))pool_worker, w))
+		w = NULL;
+	pthread_attr_destroy(&attr);
+#else
+	if (!g_thread_create((GThreadFunc)pool_worker, w, FALSE, NULL))
+		w = NULL;
 #endif
+	if (w) nworkers++;
+	return (w);
+}
 
-	/* Launch aux threads */
-	threads_running = TRUE;
-	for (i = tdata->count - 1; i > 0; i--)
+void launch_threads(thread_func thread, threaddata *tdata, char *title, int total)
+{
+	worker *w, *ws[MAX_WORKERS];
+	tcb *tp;
+	pool_time uninit_(before), now;
+	int i, j, n0, n1 = total, flag = FALSE;
+
+#if GTK_MAJOR_VERSION > 1
+	if (!pool_lock) /* First use */
+	{
+		pool_lock = g_mutex_new();
+		pool_job = g_cond_new();
+		pool_done = g_cond_new();
+		pool_post = g_cond_new();
+	}
+#endif
+
+	/* Reinit threads' state */
+	for (i = 0; i < tdata->count; i++)
 	{
 		tp = tdata->threads[i];
-		/* Reinit thread state */
 		tp->stop = FALSE; tp->stopped = FALSE;
 		tp->progress = 0;
+		tp->row = tp->rlim = tp->rnext = tp->rend = 0;
+	}
+
+	/* Hand out work to aux threads */
+	threads_running = TRUE;
+	POOL_LOCK();
+	for (i = tdata->count - 1; i > 0; i--)
+	{
+		tp = tdata->threads[i];
 		/* Allocate work to thread */
 		tp->step0 = n0 = (n1 * i) / (i + 1);
 		tp->nsteps = n1 - n0;
-#if GTK_MAJOR_VERSION == 1
-		if (attr_failed || pthread_create(&tid, &attr,
-			(void *(*)(void *))thread, tp))
-#else 
-		if (!g_thread_create((GThreadFunc)thread, tp, FALSE, NULL))
-#endif
+		if (!(ws[i] = w = pool_get()))
 			tp->stop = TRUE , tp->stopped = TRUE; // Failed to launch
-		else n1 = n0 , flag = TRUE; // Success - work is now being done
+		else
+		{
+			tp->rnext = n0;
+			tp->rend = n1;
+			w->tp = tp;
+			w->func = thread;
+			n1 = n0 , flag = TRUE; // Success - work is now being done
+		}
 	}
-	threads_running = flag;
-#if GTK_MAJOR_VERSION == 1
-	pthread_attr_destroy(&attr);
-#endif
-
-	/* Put main thread to work */
+	/* Main thread's share must be in place before aux threads start */
 	tp = tdata->threads[0];
-	tp->stop = FALSE; tp->stopped = FALSE;
-	tp->progress = 0;
 	tp->step0 = 0;
 	tp->nsteps = n1;
 	tp->tsteps = total;
+	tp->rend = n1;
+	threads_running = flag;
+	if (flag) POOL_WAKE(pool_job);
+	POOL_UNLOCK();
+
+	/* Put main thread to work */
 	if (title) progress_init(title, 1); /* Let init/end be done outside */
 	thread(tp);
 
@@ -287,37 +561,39 @@ void launch_threads(thread_func thread, threaddata *tdata, char *title, int tota
 	flag = 0;
 	while (TRUE)
 	{
+		POOL_LOCK();
 		for (i = j = 1; i < tdata->count; i++)
-			j += tdata->threads[i]->stopped;
+			j += !ws[i] || (ws[i]->tp != tdata->threads[i]);
+		if (j < tdata->count) /* Sleep till some thread is done */
+		{
+			pool_now(&now);
+			pool_add_msec(&now, POOL_POLL);
+			POOL_TIMED_WAIT(pool_done, &now);
+			for (i = j = 1; i < tdata->count; i++)
+				j += !ws[i] || (ws[i]->tp != tdata->threads[i]);
+		}
+		POOL_UNLOCK();
 		if (j >= tdata->count) break; // All threads finished
 		if (tdata->threads[0]->stop) // Cancellation requested
 		{
-			if (!flag) before = clock();
-			else
+			pool_now(&now);
+			if (!flag) before = now;
+			else if (pool_msec(&before, &now) >= 5000)
 			{
-				now = clock();
-				if (now - before >= 5 * CLOCKS_PER_SEC)
-				{
-				/* Major catastrophe - hung thread(s) */
-					flag = 2;
-					break;
-				}
+			/* Major catastrophe - hung thread(s) */
+				flag = 2;
+				break;
 			}
 			flag |= 1;
 		}
 		thread_progress(tdata->threads[0]);
-		/* Let 'em run */
-#if GTK_MAJOR_VERSION == 1
-		sched_yield();
-#else
-		g_thread_yield();
-#endif
 	}
 	threads_running = FALSE;
 	if (title) progress_end();
 
 /* !!! Even with OS threading, killing a thread is not supported on some systems,
- * and if a thread needs killing, it likely has corrupted some data already - WJ */
+ * and if a thread needs killing, it likely has corrupted some data already - WJ
+ * Hung workers stay busy, so the pool will not give them new jobs */
 	if (flag > 1) alert_box(_("Error"),
 		_("Helper thread is not responding. Save your work and exit the program."), NULL);
 }
@@ -412,12 +688,22 @@ threaddata *talloc(int flags, int tmax, void *data, int dsize, ...)
 	return (res);
 }
 
+int thread_claim(tcb *thread)
+{
+	if (thread->rnext >= thread->rend) return (-1);
+	thread->row = thread->rnext;
+	thread->rlim = thread->rnext = thread->rend;
+	return (thread->row++);
+}
+
 void launch_threads(thread_func thread, threaddata *tdata, char *title, int total)
 {
 	tcb *tp = tdata->threads[0];
 
 	tp->step0 = 0;
 	tp->nsteps = total;
+	tp->row = tp->rlim = tp->rnext = 0;
+	tp->rend = total;
 	if (title) progress_init(title, 1); /* Let init/end be done outside */
 	thread(tp);
 	if (title) progress_end();
@@ -27,6 +27,9 @@ struct tcb {
 	int count;		// Number of threads
 	int step0, nsteps;	// Work allocated to this thread
 	int tsteps;		// Total amount of work - set only for thread 0
+	float pstart, plen;	// Part of progressbar for the job - set only for thread 0
+	int row, rlim;		// Chunk of work being done
+	volatile int rnext, rend; // Not yet claimed part of work
 	tcb **threads;		// Pointers to all tcbs
 	void *data;		// Parameters & buffers structure for function
 };
@@ -40,12 +43,42 @@ typedef struct {
 //	Thread function type
 typedef void (*thread_func)(tcb *thread);
 
+//	Claim next chunk of work, stealing it from other threads if need be
+int thread_claim(tcb *thread);
+
+//	Get next step of work to do, or -1 if nothing is left
+static inline int thread_row(tcb *thread)
+{
+	if (thread->row < thread->rlim) return (thread->row++);
+	return (thread_claim(thread));
+}
+
+//	Let next launch_threads() show its progress in a part of progressbar,
+//	"len" long from "start" - for when the job has several passes or stages;
+//	with len = 0, progressbar is all its own
+static inline void thread_range(threaddata *tdata, float start, float len)
+{
+	tdata->threads[0]->pstart = start;
+	tdata->threads[0]->plen = len;
+}
+
+//	Progressbar position for "i" steps out of "tlim"
+static inline float thread_part(tcb *thread, int i, int tlim)
+{
+	float f = (float)i / tlim;
+	return (thread->plen ? thread->pstart + f * thread->plen : f);
+}
+
 //	Configure max number of threads to launch
 int maxthreads;
+//	Detect number of CPUs/cores
+int cpu_cores();
+//	Detect amount of physical memory
+double sys_ram();
 
 //	Prepare memory structures for threads' use
 threaddata *talloc(int flags, int tmax, void *data, int dsize, ...);
-//	Launch threads and wait for their exiting
+//	Hand work to pooled threads and wait for them to finish
 void launch_threads(thread_func thread, threaddata *tdata, char *title, int total);
 
 #ifdef U_THREADS
@@ -63,7 +96,10 @@ static inline int thread_step(tcb *thread, int i, int tlim, int steps)
 {
 	thread->progress = i;
 	if (thread->index) return (thread->stop);
-	if ((i * steps) % tlim < tlim - steps) return (FALSE);
+	/* With work stealing, main thread can do any part of the total, from none
+	 * to all; so pace updates by an even share of it rather than by "tlim" */
+	tlim = thread->tsteps / thread->count;
+	if ((tlim > steps) && ((i * steps) % tlim < tlim - steps)) return (FALSE);
 	return (thread_progress(thread));
 }
 
@@ -73,6 +109,13 @@ static inline void thread_done(tcb *thread)
 	thread->stopped = TRUE;
 }
 
+//	Wait till another thread advances a counter far enough
+int thread_wait(tcb *thread, volatile int *v, int n);
+//	Advance a counter for other threads to see
+void thread_post(volatile int *v, int n);
+//	Set bits in a word which other threads may be setting bits in too
+void thread_or(volatile guint32 *v, guint32 n);
+
 //	Define a static mutex
 #define	DEF_MUTEX(name) static GStaticMutex name = G_STATIC_MUTEX_INIT
 //	Lock a static mutex
@@ -89,11 +132,16 @@ static inline void thread_done(tcb *thread)
 static inline int thread_step(tcb *thread, int i, int tlim, int steps)
 {
 	if ((i * steps) % tlim < tlim - steps) return (FALSE);
-	return (progress_update((float)i / tlim));
+	return (progress_update(thread_part(thread, i, tlim)));
 }
 
 #define thread_done(thread)
 
+/* With only one thread, work is always done in order */
+#define thread_wait(thread,v,n) TRUE
+#define thread_post(v,n) (*(v) = (n))
+#define thread_or(v,n) (*(v) |= (n))
+
 #define	DEF_MUTEX(name)
 #define LOCK_MUTEX(name)
 #define UNLOCK_MUTEX(name)
@@ -20,6 +20,8 @@
 
 #include "mygtk.h"
 #include "memory.h"
+#include "thread.h"
+#include "wu.h"
 
 /*
 Having received many constructive comments and bug reports about my previous
@@ -68,48 +70,54 @@ static int	*wt, *mr, *mg, *mb;
 
 static int	size; // image size
 static int	K;    // color look-up table size
+static int	side; // histogram elements along each axis, 2^wu_bits + 1
 
-static void Hist3d(inbuf, vwt, vmr, vmg, vmb) 	// build 3-D color histogram of counts, r/g/b, c^2
-unsigned char *inbuf;
-int *vwt, *vmr, *vmg, *vmb;
+int	wu_bits = 5;
+
+#define IX(r, g, b) (((r) * side + (g)) * side + (b))	// [r][g][b]
+
+/* Each thread fills its own set of arrays, thread 0 the main ones */
+typedef struct {
+	unsigned char *inbuf;
+	int width;
+	double *m2;
+	int *wt, *mr, *mg, *mb;
+	threaddata *parts;	// Histogramming threads, for merging
+} wu_data;
+
+static void Hist3d(tcb *thread)	// build 3-D color histogram of counts, r/g/b, c^2
 {
+	wu_data *wd = thread->data;
+	unsigned char *inbuf;
+	double *vm2 = wd->m2;
+	int *vwt = wd->wt, *vmr = wd->mr, *vmg = wd->mg, *vmb = wd->mb;
 	register int ind, r, g, b;
-	int	     inr, ing, inb, table[256];
-	register long int i;
+	int	     inr, ing, inb, shift = 8 - wu_bits, table[256];
+	register long int i, j;
 		
 	for(i=0; i<256; ++i) table[i]=i*i;
 
-	for(i=0; i<size; ++i)
-	{
-		r = inbuf[0];
-		g = inbuf[1];
-		b = inbuf[2];
-		inbuf += 3;
-		inr=(r>>3)+1; 
-		ing=(g>>3)+1; 
-		inb=(b>>3)+1; 
-		ind=(inr<<10)+(inr<<6)+inr+(ing<<5)+ing+inb;
-		// [inr][ing][inb]
-		++vwt[ind];
-		vmr[ind] += r;
-		vmg[ind] += g;
-		vmb[ind] += b;
-		m2[ind] += table[r]+table[g]+table[b];
-	}
-
-	if (!quan_sqrt) return;
-	// "Diameter weighting" in action
-	for (i = 0; i < 33 * 33 * 33; i++)
+	while ((j = thread_row(thread)) >= 0)
 	{
-		double d;
-		if (!vwt[i]) continue;
-		d = vwt[i];
-		d = (vwt[i] = sqrt(d)) / d;
-		vmr[i] *= d;
-		vmg[i] *= d;
-		vmb[i] *= d;
-		m2[i] *= d;
+		inbuf = wd->inbuf + j * wd->width * 3;
+		for(i=0; i<wd->width; ++i)
+		{
+			r = inbuf[0];
+			g = inbuf[1];
+			b = inbuf[2];
+			inbuf += 3;
+			inr=(r>>shift)+1; 
+			ing=(g>>shift)+1; 
+			inb=(b>>shift)+1; 
+			ind=IX(inr, ing, inb);
+			++vwt[ind];
+			vmr[ind] += r;
+			vmg[ind] += g;
+			vmb[ind] += b;
+			vm2[ind] += table[r]+table[g]+table[b];
+		}
 	}
+	thread_done(thread);
 }
 
 /* At conclusion of the histogram step, we can interpret
@@ -122,60 +130,111 @@ int *vwt, *vmr, *vmg, *vmb;
 
 /* We now convert histogram into moments so that we can rapidly calculate
  * the sums of the above quantities over any desired box.
+ * This is done as running sums along b, then g, then r; the first two go
+ * one r slab per step, after adding in other threads' histograms, and the
+ * last one, one g row per step. Additions are done in the same order as by
+ * the original single-pass code, so the results are the same to the bit.
  */
 
-
-static void M3d(vwt, vmr, vmg, vmb)	// compute cumulative moments.
-int *vwt, *vmr, *vmg, *vmb;
+static void M3d_slabs(tcb *thread)	// merge histograms, sum along b & g
 {
-	register unsigned short int ind1, ind2;
-	register unsigned char i, r, g, b;
-	long int line, line_r, line_g, line_b, area[33], area_r[33], area_g[33], area_b[33];
-	double line2, area2[33];
+	threaddata *parts = ((wu_data *)thread->data)->parts;
+	wu_data *td;
+	register int ind, ind1, r, g, b, t, last = side - 1;
+	long int line, line_r, line_g, line_b;
+	double line2;
 
-	for(r=1; r<=32; ++r)
+	while ((r = thread_row(thread)) >= 0)
 	{
-		for(i=0; i<=32; ++i) area2[i]=area[i]=area_r[i]=area_g[i]=area_b[i]=0;
-		for(g=1; g<=32; ++g)
+		r++;
+		for (t = 1; t < parts->count; t++)
+		{
+			td = parts->threads[t]->data;
+			for (ind = IX(r, 1, 0); ind < IX(r + 1, 0, 0); ind++)
+			{
+				if (!td->wt[ind]) continue;
+				wt[ind] += td->wt[ind];
+				mr[ind] += td->mr[ind];
+				mg[ind] += td->mg[ind];
+				mb[ind] += td->mb[ind];
+				m2[ind] += td->m2[ind];
+			}
+		}
+
+		if (quan_sqrt) // "Diameter weighting" in action
+		for (ind = IX(r, 1, 0); ind < IX(r + 1, 0, 0); ind++)
+		{
+			double d;
+			if (!wt[ind]) continue;
+			d = wt[ind];
+			d = (wt[ind] = sqrt(d)) / d;
+			mr[ind] *= d;
+			mg[ind] *= d;
+			mb[ind] *= d;
+			m2[ind] *= d;
+		}
+
+		for(g=1; g<=last; ++g)
 		{
 			line2 = line = line_r = line_g = line_b = 0;
-			for(b=1; b<=32; ++b)
+			for(b=1; b<=last; ++b)
 			{
-				ind1 = (r<<10) + (r<<6) + r + (g<<5) + g + b;	// [r][g][b]
-				line += vwt[ind1];
-				line_r += vmr[ind1]; 
-				line_g += vmg[ind1]; 
-				line_b += vmb[ind1];
-				line2 += m2[ind1];
-				area[b] += line;
-				area_r[b] += line_r;
-				area_g[b] += line_g;
-				area_b[b] += line_b;
-				area2[b] += line2;
-				ind2 = ind1 - 1089; /* [r-1][g][b] */
-				vwt[ind1] = vwt[ind2] + area[b];
-				vmr[ind1] = vmr[ind2] + area_r[b];
-				vmg[ind1] = vmg[ind2] + area_g[b];
-				vmb[ind1] = vmb[ind2] + area_b[b];
-				m2[ind1] = m2[ind2] + area2[b];
+				ind1 = IX(r, g, b);
+				wt[ind1] = line += wt[ind1];
+				mr[ind1] = line_r += mr[ind1];
+				mg[ind1] = line_g += mg[ind1];
+				mb[ind1] = line_b += mb[ind1];
+				m2[ind1] = line2 += m2[ind1];
+				if (g == 1) continue;
+				ind = ind1 - side; /* [r][g-1][b] */
+				wt[ind1] += wt[ind];
+				mr[ind1] += mr[ind];
+				mg[ind1] += mg[ind];
+				mb[ind1] += mb[ind];
+				m2[ind1] += m2[ind];
 			}
 		}
 	}
+	thread_done(thread);
+}
+
+static void M3d_rows(tcb *thread)	// sum along r
+{
+	register int ind1, ind2, r, g, b, last = side - 1;
+
+	while ((g = thread_row(thread)) >= 0)
+	{
+		g++;
+		for(r=2; r<=last; ++r)
+		{
+			for(b=1; b<=last; ++b)
+			{
+				ind1 = IX(r, g, b);
+				ind2 = ind1 - side * side; /* [r-1][g][b] */
+				wt[ind1] += wt[ind2];
+				mr[ind1] += mr[ind2];
+				mg[ind1] += mg[ind2];
+				mb[ind1] += mb[ind2];
+				m2[ind1] += m2[ind2];
+			}
+		}
+	}
+	thread_done(thread);
 }
 
 
 static long int Vol(cube, mmt)			// Compute sum over a box of any given statistic
 struct box *cube;
-int mmt[33][33][33];
+int *mmt;
 {
-	return( mmt[cube->r1][cube->g1][cube->b1]
-		-mmt[cube->r1][cube->g1][cube->b0]
-		-mmt[cube->r1][cube->g0][cube->b1]
-		+mmt[cube->r1][cube->g0][cube->b0]
-		-mmt[cube->r0][cube->g1][cube->b1]
-		+mmt[cube->r0][cube->g1][cube->b0]
-		+mmt[cube->r0][cube->g0][cube->b1]
-		-mmt[cube->r0][cube->g0][cube->b0] );
+	return( mmt[IX(cube->r1, cube->g1, cube->b1)]
+		-mmt[IX(cube->r1, cube->g1, cube->b0)]
+		-mmt[IX(cube->r1, cube->g0, cube->b1)]
+		+mmt[IX(cube->r1, cube->g0, cube->b0)]
+		-mmt[IX(cube->r0, cube->g1, cube->b1)]
+		+mmt[IX(cube->r0, cube->g1, cube->b0)]
+		+mmt[IX(cube->r0, cube->g0, cube->b1)]
+		-mmt[IX(cube->r0, cube->g0, cube->b0)] );
 }
 
 /* The next two routines allow a slightly more efficient calculation
@@ -189,27 +248,27 @@ static long int Bottom(cube, dir, mmt)
 // (depending on dir)
 struct box *cube;
 unsigned char dir;
-int mmt[33][33][33];
+int *mmt;
 {
 	switch(dir)
 	{
 		case RED:
-			return( -mmt[cube->r0][cube->g1][cube->b1]
-				+mmt[cube->r0][cube->g1][cube->b0]
-				+mmt[cube->r0][cube->g0][cube->b1]
-				-mmt[cube->r0][cube->g0][cube->b0] );
+			return( -mmt[IX(cube->r0, cube->g1, cube->b1)]
+				+mmt[IX(cube->r0, cube->g1, cube->b0)]
+				+mmt[IX(cube->r0, cube->g0, cube->b1)]
+				-mmt[IX(cube->r0, cube->g0, cube->b0)] );
 			break;
 		case GREEN:
-			return( -mmt[cube->r1][cube->g0][cube->b1]
-				+mmt[cube->r1][cube->g0][cube->b0]
-				+mmt[cube->r0][cube->g0][cube->b1]
-				-mmt[cube->r0][cube->g0][cube->b0] );
+			return( -mmt[IX(cube->r1, cube->g0, cube->b1)]
+				+mmt[IX(cube->r1, cube->g0, cube->b0)]
+				+mmt[IX(cube->r0, cube->g0, cube->b1)]
+				-mmt[IX(cube->r0, cube->g0, cube->b0)] );
 			break;
 		case BLUE:
-			return( -mmt[cube->r1][cube->g1][cube->b0]
-				+mmt[cube->r1][cube->g0][cube->b0]
-				+mmt[cube->r0][cube->g1][cube->b0]
-				-mmt[cube->r0][cube->g0][cube->b0] );
+			return( -mmt[IX(cube->r1, cube->g1, cube->b0)]
+				+mmt[IX(cube->r1, cube->g0, cube->b0)]
+				+mmt[IX(cube->r0, cube->g1, cube->b0)]
+				-mmt[IX(cube->r0, cube->g0, cube->b0)] );
 			break;
 	}
 	return 0;
@@ -222,27 +281,27 @@ static long int Top(cube, dir, pos, mmt)
 struct box *cube;
 unsigned char dir;
 int pos;
-int mmt[33][33][33];
+int *mmt;
 {
 	switch(dir)
 	{
 		case RED:
-			return( mmt[pos][cube->g1][cube->b1] 
-				-mmt[pos][cube->g1][cube->b0]
-				-mmt[pos][cube->g0][cube->b1]
-				+mmt[pos][cube->g0][cube->b0] );
+			return( mmt[IX(pos, cube->g1, cube->b1)] 
+				-mmt[IX(pos, cube->g1, cube->b0)]
+				-mmt[IX(pos, cube->g0, cube->b1)]
+				+mmt[IX(pos, cube->g0, cube->b0)] );
 			break;
 		case GREEN:
-			return( mmt[cube->r1][pos][cube->b1] 
-				-mmt[cube->r1][pos][cube->b0]
-				-mmt[cube->r0][pos][cube->b1]
-				+mmt[cube->r0][pos][cube->b0] );
+			return( mmt[IX(cube->r1, pos, cube->b1)] 
+				-mmt[IX(cube->r1, pos, cube->b0)]
+				-mmt[IX(cube->r0, pos, cube->b1)]
+				+mmt[IX(cube->r0, pos, cube->b0)] );
 			break;
 		case BLUE:
-			return( mmt[cube->r1][cube->g1][pos]
-				-mmt[cube->r1][cube->g0][pos]
-				-mmt[cube->r0][cube->g1][pos]
-				+mmt[cube->r0][cube->g0][pos] );
+			return( mmt[IX(cube->r1, cube->g1, pos)]
+				-mmt[IX(cube->r1, cube->g0, pos)]
+				-mmt[IX(cube->r0, cube->g1, pos)]
+				+mmt[IX(cube->r0, cube->g0, pos)] );
 			break;
 	}
 	return 0;
@@ -259,14 +318,14 @@ struct box *cube;
 	dr = Vol(cube, mr); 
 	dg = Vol(cube, mg); 
 	db = Vol(cube, mb);
-	xx =     m2[ 33*33*cube->r1 + 33*cube->g1 + cube->b1] 
-		-m2[ 33*33*cube->r1 + 33*cube->g1 + cube->b0]
-		-m2[ 33*33*cube->r1 + 33*cube->g0 + cube->b1]
-		+m2[ 33*33*cube->r1 + 33*cube->g0 + cube->b0]
-		-m2[ 33*33*cube->r0 + 33*cube->g1 + cube->b1]
-		+m2[ 33*33*cube->r0 + 33*cube->g1 + cube->b0]
-		+m2[ 33*33*cube->r0 + 33*cube->g0 + cube->b1]
-		-m2[ 33*33*cube->r0 + 33*cube->g0 + cube->b0];
+	xx =     m2[IX(cube->r1, cube->g1, cube->b1)] 
+		-m2[IX(cube->r1, cube->g1, cube->b0)]
+		-m2[IX(cube->r1, cube->g0, cube->b1)]
+		+m2[IX(cube->r1, cube->g0, cube->b0)]
+		-m2[IX(cube->r0, cube->g1, cube->b1)]
+		+m2[IX(cube->r0, cube->g1, cube->b0)]
+		+m2[IX(cube->r0, cube->g0, cube->b1)]
+		-m2[IX(cube->r0, cube->g0, cube->b0)];
 	return( xx - (dr*dr+dg*dg+db*db)/(double)Vol(cube,wt) );    
 }
 
@@ -391,35 +450,60 @@ static void Mark(struct box *cube, int label, unsigned char *tag)
 	for(r=cube->r0+1; r<=cube->r1; ++r)
 		for(g=cube->g0+1; g<=cube->g1; ++g)
 			for(b=cube->b0+1; b<=cube->b1; ++b)
-				tag[(r<<10) + (r<<6) + r + (g<<5) + g + b] = label;
+				tag[IX(r, g, b)] = label;
 }
 
 int wu_quant(unsigned char *inbuf, int width, int height, int quant_to, png_color *pal)
 {
-	void *mem;
+	wu_data wd;
+	threaddata *parts, *tdata;
 	struct box	cube[MAXCOLOR];
 	unsigned char	*tag;
-	long int	next;
+	long int	next, cells;
 	register long int i, k, weight;
 	double		vv[MAXCOLOR], temp;
 
 	K = quant_to;
 	size = width*height;
+	if (wu_bits < 1) wu_bits = 1;
+	if (wu_bits > WU_MAX_BITS) wu_bits = WU_MAX_BITS;
+	side = (1 << wu_bits) + 1;
+	cells = side * side * side;
+
+	/* Another thread's histogram is only worth it if it has at least as
+	 * many pixels to count as cells to merge */
+	i = size / cells;
+	if (i > height) i = height;
+	if (i < 1) i = 1;
+	wd.inbuf = inbuf;
+	wd.width = width;
+	parts = talloc(MA_ALIGN_DOUBLE, i,
+		&wd, sizeof(wd),
+		NULL,
+		&wd.m2, cells * sizeof(double),
+		&wd.wt, cells * sizeof(int),
+		&wd.mr, cells * sizeof(int),
+		&wd.mg, cells * sizeof(int),
+		&wd.mb, cells * sizeof(int),
+		NULL);
+	if (!parts) return (-1);
+	m2 = wd.m2; wt = wd.wt; mr = wd.mr; mg = wd.mg; mb = wd.mb;
+	wd.parts = parts;
+	tdata = talloc(0, side - 1, &wd, sizeof(wd), NULL, NULL);
+	tag = malloc(cells);
+	if (!tdata || !tag)
+	{
+		free(tdata);
+		free(parts);
+		return (-1);
+	}
 
-	mem = multialloc(MA_ALIGN_DOUBLE,
-		&m2, 33*33*33 * sizeof(double),
-		&wt, 33*33*33 * sizeof(int),
-		&mr, 33*33*33 * sizeof(int),
-		&mg, 33*33*33 * sizeof(int),
-		&mb, 33*33*33 * sizeof(int),
-		&tag, 33*33*33, NULL);
-	if (!mem) return (-1);
-
-	Hist3d(inbuf, wt, mr, mg, mb);
-	M3d(wt, mr, mg, mb);
+	launch_threads(Hist3d, parts, NULL, height);
+	launch_threads(M3d_slabs, tdata, NULL, side - 1);
+	launch_threads(M3d_rows, tdata, NULL, side - 1);
 
 	cube[0].r0 = cube[0].g0 = cube[0].b0 = 0;
-	cube[0].r1 = cube[0].g1 = cube[0].b1 = 32;
+	cube[0].r1 = cube[0].g1 = cube[0].b1 = side - 1;
 	next = 0;
 
 	for(i=1; i<K; ++i)
@@ -462,6 +546,8 @@ int wu_quant(unsigned char *inbuf, int width, int height, int quant_to, png_colo
 		else pal[k].red = pal[k].green = pal[k].blue = 0;	// Bogus box
 	}
 
-	free(mem);
+	free(tag);
+	free(tdata);
+	free(parts);
 	return (0);
 }
@@ -1,4 +1,9 @@
 // wu.h
 // See wu.c for details
 
+// At 8 bits, histogram would take 400 Mb per thread
+#define WU_MAX_BITS 7
+
+int wu_bits;	// Bits per channel in histogram, 1 to WU_MAX_BITS; 5 by default
+
 int wu_quant(unsigned char *inbuf, int width, int height, int quant_to, png_color *pal);